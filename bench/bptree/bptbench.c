@@ -0,0 +1,280 @@
+/*
+ * Benchmark of bptree.c, the B+tree, against rbtree.c, the intrusive
+ * red-black tree, as ordered maps from uint64_t keys to pointers.
+ *
+ * Each run measures, on N distinct random keys:
+ *
+ *   insert  -- insert the N keys in random order
+ *   lookup  -- find N random keys, all present
+ *   scan    -- S range scans of L consecutive keys from a random key;
+ *              the ops are the keys visited
+ *
+ * and for the B+tree only:
+ *
+ *   load    -- bptree_load() the N keys in sorted order
+ *   scan    -- the same scans over the loaded tree, whose leaves are
+ *              full ("load-scan")
+ *
+ * The red-black tree nodes come from one array, as if embedded in the
+ * user's objects; their order in memory is unrelated to the key order.
+ *
+ * Build: see README.md
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bptree.h"
+#include "rbtree.h"
+
+struct entry {
+  struct rb_node node;
+  uint64_t key;
+  void *value;
+};
+
+#define KEY_CMP(x, y)   (((x) > (y)) - ((x) < (y)))
+
+static long nscans = 100000;
+static long scanlen = 100;
+static uint64_t *keys;          /* N random distinct keys */
+static uint64_t *sorted;        /* the same, in order */
+static long *probes;            /* indices of keys to look up */
+static long *starts;            /* indices of keys to start a scan at */
+static uint64_t checksum;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static void
+report(const char *impl, long n, const char *op, long ops, double elapsed)
+{
+  printf("%s,%ld,%s,%ld,%.3f,%.0f\n", impl, n, op, ops, elapsed,
+         ops / elapsed);
+  fflush(stdout);
+}
+
+
+/* splitmix64; a bijection, so distinct inputs give distinct keys */
+static uint64_t
+mix(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+
+static int
+compare_keys(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return KEY_CMP(x, y);
+}
+
+
+static void
+scan_bptree(bptree_t *t, const char *op, long n)
+{
+  bptree_iter_t it;
+  uint64_t key, prev;
+  double begin;
+  long i, j, visited = 0;
+
+  begin = now();
+  for (i = 0; i < nscans; i++) {
+    bptree_seek(t, keys[starts[i]], &it);
+    prev = 0;
+    for (j = 0; j < scanlen && bptree_next(&it, &key, NULL) == 0; j++) {
+      if (j > 0 && key <= prev) {
+        fprintf(stderr, "error: scan out of order\n");
+        abort();
+      }
+      prev = key;
+      checksum += key;
+    }
+    visited += j;
+  }
+  report("bptree", n, op, visited, now() - begin);
+}
+
+
+static void
+run_bptree(long n)
+{
+  bptree_t *t;
+  void *value;
+  double begin;
+  long i;
+
+  t = bptree_new();
+  if (!t)
+    abort();
+
+  begin = now();
+  for (i = 0; i < n; i++)
+    if (bptree_insert(t, keys[i], &keys[i]) != 0)
+      abort();
+  report("bptree", n, "insert", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    if (bptree_find(t, keys[probes[i]], &value) != 0 ||
+        value != &keys[probes[i]])
+      abort();
+    checksum += *(uint64_t *)value;
+  }
+  report("bptree", n, "lookup", n, now() - begin);
+
+  scan_bptree(t, "scan", n);
+  bptree_delete(t);
+
+  t = bptree_new();
+  begin = now();
+  if (bptree_load(t, sorted, NULL, n) != 0)
+    abort();
+  report("bptree", n, "load", n, now() - begin);
+
+  scan_bptree(t, "load-scan", n);
+  bptree_delete(t);
+}
+
+
+static void
+run_rbtree(long n)
+{
+  struct rb_root root = RB_ROOT, *rootp = &root;
+  struct entry *entries, *e, *p;
+  struct rb_node *node;
+  uint64_t prev;
+  double begin;
+  long i, j, visited = 0;
+
+  entries = malloc(sizeof(*entries) * n);
+  if (!entries)
+    abort();
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    e = &entries[i];
+    e->key = keys[i];
+    e->value = &keys[i];
+    if (RB_INSERT(rootp, struct entry, key, node, KEY_CMP, e) != NULL)
+      abort();
+  }
+  report("rbtree", n, "insert", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    p = RB_SEARCH(rootp, struct entry, node, key, KEY_CMP, keys[probes[i]]);
+    if (!p || p->value != &keys[probes[i]])
+      abort();
+    checksum += *(uint64_t *)p->value;
+  }
+  report("rbtree", n, "lookup", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nscans; i++) {
+    p = RB_SEARCH(rootp, struct entry, node, key, KEY_CMP, keys[starts[i]]);
+    node = &p->node;
+    prev = 0;
+    for (j = 0; j < scanlen && node; j++, node = rb_next(node)) {
+      p = rb_entry(node, struct entry, node);
+      if (j > 0 && p->key <= prev) {
+        fprintf(stderr, "error: scan out of order\n");
+        abort();
+      }
+      prev = p->key;
+      checksum += p->key;
+    }
+    visited += j;
+  }
+  report("rbtree", n, "scan", visited, now() - begin);
+
+  free(entries);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -n LIST   comma separated list of key counts (default: 1000,100000,1000000)\n");
+  printf("  -s N      number of range scans (default: %ld)\n", nscans);
+  printf("  -l N      keys per range scan (default: %ld)\n", scanlen);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *sizelist = "1000,100000,1000000";
+  char *list, *tok, *save;
+  long n, i, maxn = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:l:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      sizelist = optarg;
+      break;
+    case 's':
+      nscans = atol(optarg);
+      break;
+    case 'l':
+      scanlen = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    if (atol(tok) > maxn)
+      maxn = atol(tok);
+  free(list);
+
+  srand(1);
+  keys = malloc(sizeof(*keys) * maxn);
+  sorted = malloc(sizeof(*sorted) * maxn);
+  probes = malloc(sizeof(*probes) * maxn);
+  starts = malloc(sizeof(*starts) * nscans);
+
+  printf("impl,keys,op,ops,seconds,ops_per_sec\n");
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atol(tok);
+    if (n <= 0)
+      continue;
+    for (i = 0; i < n; i++)
+      keys[i] = mix(i);
+    memcpy(sorted, keys, sizeof(*keys) * n);
+    qsort(sorted, n, sizeof(*sorted), compare_keys);
+    for (i = 0; i < n; i++)
+      probes[i] = (((long)rand() << 16) ^ rand()) % n;
+    for (i = 0; i < nscans; i++)
+      starts[i] = (((long)rand() << 16) ^ rand()) % n;
+
+    run_bptree(n);
+    run_rbtree(n);
+  }
+  free(list);
+
+  fprintf(stderr, "checksum: %llu\n", (unsigned long long)checksum);
+  return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Benchmark of dheap.hh against std::priority_queue.
+ *
+ * Same workload as heapbench.c: a min-heap of 16-byte timers, with an
+ * insert, a hold (pop and re-push) and a drain phase.
+ *
+ * Build: see README.md
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <queue>
+#include <vector>
+
+#include "dheap.hh"
+
+struct timer {
+  uint64_t deadline;
+  void *data;
+};
+
+struct timer_later {
+  bool operator()(const timer &a, const timer &b) const
+  { return a.deadline > b.deadline; }
+};
+
+static long nholds = 1000000;
+static uint64_t *deadlines;
+static uint64_t *delays;
+static uint64_t checksum;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static void
+report(const char *impl, long n, const char *op, long ops, double elapsed)
+{
+  printf("%s,%ld,%s,%ld,%.3f,%.0f\n", impl, n, op, ops, elapsed,
+         ops / elapsed);
+  fflush(stdout);
+}
+
+
+template <class Heap>
+static void
+run(const char *impl, long n)
+{
+  Heap heap;
+  timer t;
+  uint64_t prev = 0;
+  double begin;
+  long i;
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    t.deadline = deadlines[i];
+    t.data = NULL;
+    heap.push(t);
+  }
+  report(impl, n, "insert", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nholds; i++) {
+    t = heap.top();
+    heap.pop();
+    t.deadline += delays[i];
+    heap.push(t);
+  }
+  report(impl, n, "hold", nholds, now() - begin);
+
+  begin = now();
+  while (!heap.empty()) {
+    t = heap.top();
+    heap.pop();
+    if (t.deadline < prev) {
+      fprintf(stderr, "error: heap order violated\n");
+      abort();
+    }
+    prev = t.deadline;
+    checksum += t.deadline;
+  }
+  report(impl, n, "drain", n, now() - begin);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -n LIST   comma separated list of heap sizes (default: 1000,100000,1000000)\n");
+  printf("  -m N      pop/push pairs in the hold phase (default: %ld)\n", nholds);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *sizelist = "1000,100000,1000000";
+  char *list, *tok, *save;
+  long n, i, maxn = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      sizelist = optarg;
+      break;
+    case 'm':
+      nholds = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    if (atol(tok) > maxn)
+      maxn = atol(tok);
+  free(list);
+
+  srand(1);
+  deadlines = new uint64_t[maxn];
+  for (i = 0; i < maxn; i++)
+    deadlines[i] = ((uint64_t)rand() << 16) ^ rand();
+  delays = new uint64_t[nholds];
+  for (i = 0; i < nholds; i++)
+    delays[i] = 1 + (((uint64_t)rand() << 16) ^ rand());
+
+  printf("impl,elements,op,ops,seconds,ops_per_sec\n");
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atol(tok);
+    if (n <= 0)
+      continue;
+    run<std::priority_queue<timer, std::vector<timer>, timer_later> >(
+      "priority_queue", n);
+    run<dheap<timer, 2, timer_later> >("dheap-2", n);
+    run<dheap<timer, 4, timer_later> >("dheap-4", n);
+    run<dheap<timer, 8, timer_later> >("dheap-8", n);
+  }
+  free(list);
+
+  fprintf(stderr, "checksum: %llu\n", (unsigned long long)checksum);
+  return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Benchmark of heap.h: the pointer heap (HEAP_DECL_TYPE) against the
+ * inline d-ary heap (DHEAP_DECL_TYPE) with 2, 4 and 8 children, and
+ * the indexed heap (IHEAP_DECL_TYPE).
+ *
+ * The elements are 16-byte timers, {deadline, data}, in a min-heap on
+ * the deadline.  For the pointer heap each timer is malloc()ed, as a
+ * scheduler would.  Each run measures three phases:
+ *
+ *   insert  -- push N timers with random deadlines
+ *   hold    -- pop the earliest timer and push it back with a later
+ *              deadline, M times, keeping N timers pending
+ *   drain   -- pop all N timers
+ *
+ * The indexed heap re-arms the earliest timer in place with
+ * IHEAP_UPDATE() in the hold phase, and has two more phases:
+ *
+ *   heapify -- load N timers at once with IHEAP_HEAPIFY()
+ *   cancel  -- remove every other timer by handle with IHEAP_REMOVE()
+ *
+ * and it drains the rest with IHEAP_POP_N(), advancing the bound in
+ * 1000 steps, as a timer loop would.
+ *
+ * Build: see README.md
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+
+struct timer {
+  uint64_t deadline;
+  void *data;
+};
+
+#define TIMER_CMP(x, y) \
+  (((y)->deadline > (x)->deadline) - ((y)->deadline < (x)->deadline))
+
+HEAP_DECL_TYPE(struct timer, ptrheap_t);
+#define ptrheap_t_cmp(x, y)     TIMER_CMP(x, y)
+
+DHEAP_DECL_TYPE(struct timer, dheap2_t, 2);
+#define dheap2_t_cmp(x, y)      TIMER_CMP(x, y)
+
+DHEAP_DECL_TYPE(struct timer, dheap4_t, 4);
+#define dheap4_t_cmp(x, y)      TIMER_CMP(x, y)
+
+DHEAP_DECL_TYPE(struct timer, dheap8_t, 8);
+#define dheap8_t_cmp(x, y)      TIMER_CMP(x, y)
+
+struct itimer {
+  uint64_t deadline;
+  int pos;
+};
+
+IHEAP_DECL_TYPE(struct itimer, iheap4_t, 4);
+#define iheap4_t_cmp(x, y)      TIMER_CMP(x, y)
+#define iheap4_t_index(x)       ((x)->pos)
+
+static long nholds = 1000000;
+static uint64_t *deadlines;     /* N random initial deadlines */
+static uint64_t *delays;        /* random re-arm delays for the hold phase */
+static uint64_t checksum;
+
+
+/* Pops must come out in deadline order. */
+static void
+check_order(uint64_t *prev, uint64_t deadline)
+{
+  if (deadline < *prev) {
+    fprintf(stderr, "error: heap order violated\n");
+    abort();
+  }
+  *prev = deadline;
+}
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static void
+report(const char *impl, long n, const char *op, long ops, double elapsed)
+{
+  printf("%s,%ld,%s,%ld,%.3f,%.0f\n", impl, n, op, ops, elapsed,
+         ops / elapsed);
+  fflush(stdout);
+}
+
+
+static void
+run_ptrheap(long n)
+{
+  ptrheap_t heap = HEAP_INITIALIZER(1024);
+  struct timer *t;
+  uint64_t prev = 0;
+  double begin;
+  long i;
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    t = malloc(sizeof(*t));
+    t->deadline = deadlines[i];
+    t->data = t;
+    if (HEAP_INSERT(ptrheap_t, &heap, t) != 0)
+      abort();
+  }
+  report("ptr", n, "insert", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nholds; i++) {
+    t = HEAP_POP(ptrheap_t, &heap);
+    t->deadline += delays[i];
+    HEAP_INSERT(ptrheap_t, &heap, t);
+  }
+  report("ptr", n, "hold", nholds, now() - begin);
+
+  begin = now();
+  while ((t = HEAP_POP(ptrheap_t, &heap)) != NULL) {
+    check_order(&prev, t->deadline);
+    checksum += t->deadline;
+    free(t);
+  }
+  report("ptr", n, "drain", n, now() - begin);
+
+  HEAP_FREE(&heap);
+}
+
+
+#define RUN_DHEAP(type, impl, n)                                \
+  do {                                                          \
+    type heap = DHEAP_INITIALIZER(1024);                        \
+    struct timer t;                                             \
+    uint64_t prev = 0;                                          \
+    double begin;                                               \
+    long i;                                                     \
+                                                                \
+    begin = now();                                              \
+    for (i = 0; i < (n); i++) {                                 \
+      t.deadline = deadlines[i];                                \
+      t.data = NULL;                                            \
+      if (DHEAP_INSERT(type, &heap, t) != 0)                    \
+        abort();                                                \
+    }                                                           \
+    report(impl, n, "insert", n, now() - begin);                \
+                                                                \
+    begin = now();                                              \
+    for (i = 0; i < nholds; i++) {                              \
+      DHEAP_POP(type, &heap, &t);                               \
+      t.deadline += delays[i];                                  \
+      DHEAP_INSERT(type, &heap, t);                             \
+    }                                                           \
+    report(impl, n, "hold", nholds, now() - begin);             \
+                                                                \
+    begin = now();                                              \
+    while (DHEAP_POP(type, &heap, &t)) {                        \
+      check_order(&prev, t.deadline);                           \
+      checksum += t.deadline;                                   \
+    }                                                           \
+    report(impl, n, "drain", n, now() - begin);                 \
+                                                                \
+    DHEAP_FREE(type, &heap);                                    \
+  } while (0)
+
+
+static void
+run_iheap(long n)
+{
+  iheap4_t heap = IHEAP_INITIALIZER(1024);
+  struct itimer *timers, **ptrs, *t, bound;
+  uint64_t prev = 0, maxdl = 0;
+  double begin;
+  long i, popped;
+  int k;
+
+  timers = malloc(sizeof(*timers) * n);
+  ptrs = malloc(sizeof(*ptrs) * n);
+  for (i = 0; i < n; i++) {
+    timers[i].deadline = deadlines[i];
+    timers[i].pos = -1;
+    ptrs[i] = &timers[i];
+  }
+
+  begin = now();
+  for (i = 0; i < n; i++)
+    if (IHEAP_INSERT(iheap4_t, &heap, &timers[i]) != 0)
+      abort();
+  report("indexed-4", n, "insert", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nholds; i++) {
+    t = IHEAP_TOP(&heap);
+    t->deadline += delays[i];
+    IHEAP_UPDATE(iheap4_t, &heap, t);
+  }
+  report("indexed-4", n, "hold", nholds, now() - begin);
+
+  begin = now();
+  for (i = 0; i < n; i += 2)
+    IHEAP_REMOVE(iheap4_t, &heap, &timers[i]);
+  report("indexed-4", n, "cancel", (n + 1) / 2, now() - begin);
+
+  while (IHEAP_POP(iheap4_t, &heap) != NULL)
+    ;
+  for (i = 0; i < n; i++) {
+    timers[i].deadline = deadlines[i];
+    if (deadlines[i] > maxdl)
+      maxdl = deadlines[i];
+  }
+
+  begin = now();
+  if (IHEAP_HEAPIFY(iheap4_t, &heap, ptrs, n) != 0)
+    abort();
+  report("indexed-4", n, "heapify", n, now() - begin);
+
+  begin = now();
+  popped = 0;
+  for (i = 1; i <= 1000; i++) {
+    bound.deadline = maxdl / 1000 * i;
+    if (i == 1000)
+      bound.deadline = maxdl;
+    /* ptrs is no longer needed; reuse it for the expired timers */
+    while ((k = IHEAP_POP_N(iheap4_t, &heap, &bound, ptrs, n)) > 0) {
+      popped += k;
+      while (k-- > 0) {
+        /* each step expires the deadlines in (prev, bound] */
+        if (ptrs[k]->deadline > bound.deadline ||
+            (i > 1 && ptrs[k]->deadline <= prev)) {
+          fprintf(stderr, "error: timer expired out of its step\n");
+          abort();
+        }
+        checksum += ptrs[k]->deadline;
+      }
+    }
+    prev = bound.deadline;
+  }
+  if (popped != n)
+    abort();
+  report("indexed-4", n, "drain", n, now() - begin);
+
+  IHEAP_FREE(&heap);
+  free(ptrs);
+  free(timers);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -n LIST   comma separated list of heap sizes (default: 1000,100000,1000000)\n");
+  printf("  -m N      pop/push pairs in the hold phase (default: %ld)\n", nholds);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *sizelist = "1000,100000,1000000";
+  char *list, *tok, *save;
+  long n, i, maxn = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      sizelist = optarg;
+      break;
+    case 'm':
+      nholds = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    if (atol(tok) > maxn)
+      maxn = atol(tok);
+  free(list);
+
+  srand(1);
+  deadlines = malloc(sizeof(*deadlines) * maxn);
+  for (i = 0; i < maxn; i++)
+    deadlines[i] = ((uint64_t)rand() << 16) ^ rand();
+  delays = malloc(sizeof(*delays) * nholds);
+  for (i = 0; i < nholds; i++)
+    delays[i] = 1 + (((uint64_t)rand() << 16) ^ rand());
+
+  printf("impl,elements,op,ops,seconds,ops_per_sec\n");
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atol(tok);
+    if (n <= 0)
+      continue;
+    run_ptrheap(n);
+    RUN_DHEAP(dheap2_t, "inline-2", n);
+    RUN_DHEAP(dheap4_t, "inline-4", n);
+    RUN_DHEAP(dheap8_t, "inline-8", n);
+    run_iheap(n);
+  }
+  free(list);
+
+  fprintf(stderr, "checksum: %llu\n", (unsigned long long)checksum);
+  return 0;
+}
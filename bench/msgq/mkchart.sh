@@ -0,0 +1,23 @@
+#!/bin/bash
+
+PROGRAM_NAME=$(basename "$0")
+BASE_DIR=$(dirname "$0")
+
+error() {
+    local ecode="$1"
+    shift
+    echo "$PROGRAM_NAME: $*" 1>&2
+    [ "$ecode" -ne 0 ] && exit "$ecode"
+}
+
+
+if ! which gnuplot 2>/dev/null 2>&1; then
+    error 1 "gnuplot not found"
+fi
+
+if [ "$#" -ne 2 ]; then
+    echo "Usage: $PROGRAM_NAME BEFORE-DATA AFTER-DATA"
+    error 1 "wrong number of argument(s)"
+fi
+
+gnuplot -e "data_before='$1'; data_after='$2'" "${BASE_DIR}/msgq.gnuplot"
@@ -0,0 +1,35 @@
+reset
+set terminal svg size 1920 1080 dynamic noenhanced
+set output "msgq.svg"
+dx=0.7
+n=2
+total_box_width_relative=0.75
+gap_width_relative=0.1
+d_width=(gap_width_relative + total_box_width_relative) * dx / 2.
+reset
+set datafile separator comma
+set key at graph 0.95, 0.95
+set grid
+set boxwidth total_box_width_relative/n relative
+set autoscale
+set style fill solid 0.5 noborder
+set xtics rotate font ",8"
+
+# transport/size/producers x consumers
+label(i)=sprintf("%s/%s/%sx%s", strcol(1), strcol(2), strcol(3), strcol(4))
+
+set multiplot layout 2,1
+
+set title "msgq throughput"
+set ylabel "packets per second"
+set format y "%.0f"
+plot data_before every ::1 using 0:7:xtic(label(0)) lc rgb"orange" with boxes title data_before, \
+     data_after every ::1 using ($0+d_width):7 lc rgb"blue" with boxes title data_after
+
+set title "msgq latency, send to dequeue"
+set ylabel "p99 (us)"
+set logscale y
+plot data_before every ::1 using 0:9:xtic(label(0)) lc rgb"orange" with boxes title data_before, \
+     data_after every ::1 using ($0+d_width):9 lc rgb"blue" with boxes title data_after
+
+unset multiplot
@@ -0,0 +1,344 @@
+/*
+ * Throughput and latency benchmark for msgq
+ *
+ * P producer threads, each with its own MSGQ, send packets to one
+ * receiving MSGQ, which C consumer threads drain with
+ * msgq_recv_batch_timedwait().  Every packet carries the
+ * CLOCK_MONOTONIC time of its send, and the consumers record the
+ * send-to-dequeue latency of each packet, so the percentiles are
+ * exact rather than read off a histogram.
+ *
+ * The "reactor" transport is the unix one, with the receiving MSGQ
+ * served by a msgq_reactor_new() loop instead of its own thread.
+ * With -b, the producers send with msgq_send_batch().
+ *
+ * Build: see README.md
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgq.h"
+
+#define RECV_BATCH      64
+#define SEND_BATCH_MAX  64
+
+struct producer {
+  pthread_t thread;
+  MSGQ *msgq;
+  long count;                   /* packets to send */
+  int failed;
+  int error;                    /* errno of the failed send */
+};
+
+struct consumer {
+  pthread_t thread;
+  uint64_t *samples;            /* latency of each packet, in ns */
+  long count;
+};
+
+static long nmessages = 50000;
+static int send_batch = 1;
+static char address[64];
+static size_t packet_size;
+static MSGQ *receiver;
+static long received;
+static uint64_t last_recv;
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+
+static void *
+producer(void *arg)
+{
+  struct producer *pp = arg;
+  struct msgq_packet *packet;
+  struct msgq_msg msgs[SEND_BATCH_MAX];
+  uint64_t stamp;
+  long i;
+  int n, ret;
+
+  packet = calloc(1, sizeof(*packet) + packet_size);
+  packet->size = packet_size;
+  for (n = 0; n < send_batch; n++) {
+    msgs[n].receiver = address;
+    msgs[n].packet = packet;
+  }
+
+  for (i = 0; i < pp->count; i += n) {
+    stamp = now_ns();
+    memcpy(packet->data, &stamp, sizeof(stamp));
+    if (send_batch == 1) {
+      n = 1;
+      ret = msgq_send_(pp->msgq, address, packet);
+    }
+    else {
+      /* every packet of a batch carries the stamp of the batch */
+      n = pp->count - i < send_batch ? pp->count - i : send_batch;
+      ret = msgq_send_batch(pp->msgq, msgs, n);
+      if (ret >= 0 && ret < n)
+        ret = -1;
+    }
+    if (ret < 0) {
+      pp->failed = 1;
+      pp->error = errno;
+      break;
+    }
+  }
+  free(packet);
+  return NULL;
+}
+
+
+static void *
+consumer(void *arg)
+{
+  struct consumer *cp = arg;
+  struct msgq_packet *packets[RECV_BATCH];
+  struct timespec abstime;
+  uint64_t stamp, t;
+  int i, n;
+
+  while (__atomic_load_n(&received, __ATOMIC_RELAXED) < nmessages) {
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_nsec += 100000000;
+    if (abstime.tv_nsec >= 1000000000) {
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000;
+    }
+
+    n = msgq_recv_batch_timedwait(receiver, packets, RECV_BATCH, &abstime);
+    if (n <= 0)
+      continue;
+
+    t = now_ns();
+    for (i = 0; i < n; i++) {
+      memcpy(&stamp, packets[i]->data, sizeof(stamp));
+      cp->samples[cp->count++] = t - stamp;
+      msgq_pkt_delete(packets[i]);
+    }
+    if (__atomic_add_fetch(&received, n, __ATOMIC_RELAXED) >= nmessages)
+      __atomic_store_n(&last_recv, t, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+
+static void
+run(const char *transport, size_t size, int nproducers, int nconsumers)
+{
+  struct producer *producers;
+  struct consumer *consumers;
+  struct msgq_stat stat;
+  struct msgq_pool_stat pstat;
+  MSGQ_REACTOR *reactor = NULL;
+  uint64_t *samples, begin;
+  double elapsed;
+  long total;
+  int i;
+
+  if (strcmp(transport, "shm") == 0)
+    snprintf(address, sizeof(address), "shm:/msgqbench-%d", (int)getpid());
+  else
+    snprintf(address, sizeof(address), "/tmp/msgqbench-%d", (int)getpid());
+
+  if (strcmp(transport, "reactor") == 0) {
+    reactor = msgq_reactor_new(1);
+    if (!reactor) {
+      fprintf(stderr, "error: msgq_reactor_new() failed: %s\n",
+              strerror(errno));
+      exit(1);
+    }
+  }
+
+  receiver = msgq_open_reactor(reactor, address);
+  if (!receiver) {
+    fprintf(stderr, "error: msgq_open(%s) failed: %s\n", address,
+            strerror(errno));
+    exit(1);
+  }
+  packet_size = size;
+  received = 0;
+  last_recv = 0;
+
+  producers = calloc(nproducers, sizeof(*producers));
+  consumers = calloc(nconsumers, sizeof(*consumers));
+  for (i = 0; i < nproducers; i++) {
+    producers[i].msgq = msgq_open(NULL);
+    producers[i].count = nmessages / nproducers +
+      (i < nmessages % nproducers);
+  }
+  for (i = 0; i < nconsumers; i++)
+    consumers[i].samples = malloc(sizeof(uint64_t) * nmessages);
+
+  begin = now_ns();
+  for (i = 0; i < nconsumers; i++)
+    pthread_create(&consumers[i].thread, NULL, consumer, &consumers[i]);
+  for (i = 0; i < nproducers; i++)
+    pthread_create(&producers[i].thread, NULL, producer, &producers[i]);
+
+  for (i = 0; i < nproducers; i++) {
+    pthread_join(producers[i].thread, NULL);
+    if (producers[i].failed) {
+      fprintf(stderr, "error: %s() failed: %s\n",
+              send_batch == 1 ? "msgq_send_" : "msgq_send_batch",
+              strerror(producers[i].error));
+      exit(1);
+    }
+  }
+  for (i = 0; i < nconsumers; i++)
+    pthread_join(consumers[i].thread, NULL);
+  elapsed = (last_recv - begin) / 1000000000.0;
+
+  /* merge the samples of all consumers */
+  samples = malloc(sizeof(uint64_t) * nmessages);
+  total = 0;
+  for (i = 0; i < nconsumers; i++) {
+    memcpy(samples + total, consumers[i].samples,
+           sizeof(uint64_t) * consumers[i].count);
+    total += consumers[i].count;
+    free(consumers[i].samples);
+  }
+  qsort(samples, total, sizeof(uint64_t), cmp_u64);
+
+  msgq_stat(receiver, &stat);
+  msgq_pool_stat(receiver, &pstat);
+
+  printf("%s,%zu,%d,%d,%ld,%.3f,%.0f,%.1f,%.1f,%.1f,%ld,%d,%lu,%lu\n",
+         transport, size, nproducers, nconsumers, total, elapsed,
+         total / elapsed,
+         samples[total / 2] / 1000.0,
+         samples[(long)(total * 0.99)] / 1000.0,
+         samples[(long)(total * 0.999)] / 1000.0,
+         stat.depth_max, send_batch, pstat.hits, pstat.misses);
+  fflush(stdout);
+
+  for (i = 0; i < nproducers; i++)
+    msgq_close(producers[i].msgq);
+  msgq_close(receiver);
+  if (reactor)
+    msgq_reactor_delete(reactor);
+  if (address[0] == '/')
+    unlink(address);
+
+  free(samples);
+  free(producers);
+  free(consumers);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -s LIST   comma separated list of packet sizes (default: 16,64,256,1024,4096)\n");
+  printf("  -p LIST   comma separated list of producer threads (default: 1,2,4)\n");
+  printf("  -c LIST   comma separated list of consumer threads (default: 1,2,4)\n");
+  printf("  -T LIST   comma separated list of transports, unix, shm or reactor\n"
+         "            (default: unix,shm,reactor)\n");
+  printf("  -n N      packets per run (default: %ld)\n", nmessages);
+  printf("  -b N      send N packets per msgq_send_batch() call (default: 1,\n"
+         "            which uses msgq_send_(); at most %d)\n", SEND_BATCH_MAX);
+}
+
+
+/* Split the comma separated LIST into at most MAX positive integers. */
+static int
+parse_list(const char *list, long *values, int max)
+{
+  char *buf, *tok, *save;
+  int n = 0;
+
+  buf = strdup(list);
+  for (tok = strtok_r(buf, ",", &save); tok && n < max;
+       tok = strtok_r(NULL, ",", &save))
+    if (atol(tok) > 0)
+      values[n++] = atol(tok);
+  free(buf);
+  return n;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *sizelist = "16,64,256,1024,4096";
+  const char *prodlist = "1,2,4";
+  const char *conslist = "1,2,4";
+  const char *translist = "unix,shm,reactor";
+  long sizes[32], prods[32], conss[32];
+  int nsizes, nprods, nconss;
+  char *trans, *tok, *save;
+  int opt, s, p, c;
+
+  while ((opt = getopt(argc, argv, "s:p:c:T:n:b:h")) != -1) {
+    switch (opt) {
+    case 's':
+      sizelist = optarg;
+      break;
+    case 'p':
+      prodlist = optarg;
+      break;
+    case 'c':
+      conslist = optarg;
+      break;
+    case 'T':
+      translist = optarg;
+      break;
+    case 'n':
+      nmessages = atol(optarg);
+      break;
+    case 'b':
+      send_batch = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  nsizes = parse_list(sizelist, sizes, 32);
+  nprods = parse_list(prodlist, prods, 32);
+  nconss = parse_list(conslist, conss, 32);
+  if (nmessages <= 0 || send_batch <= 0 || send_batch > SEND_BATCH_MAX) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (s = 0; s < nsizes; s++)
+    if (sizes[s] < (long)sizeof(uint64_t))
+      sizes[s] = sizeof(uint64_t);  /* room for the stamp */
+
+  printf("transport,size,producers,consumers,messages,seconds,"
+         "msgs_per_sec,p50_us,p99_us,p999_us,depth_max,send_batch,"
+         "pool_hits,pool_misses\n");
+
+  trans = strdup(translist);
+  for (tok = strtok_r(trans, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    for (s = 0; s < nsizes; s++)
+      for (p = 0; p < nprods; p++)
+        for (c = 0; c < nconss; c++)
+          run(tok, sizes[s], prods[p], conss[c]);
+  free(trans);
+  return 0;
+}
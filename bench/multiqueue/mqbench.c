@@ -0,0 +1,227 @@
+/*
+ * Benchmark of multiqueue.c against one heap behind one mutex.
+ *
+ * The queue is filled with -k random keys.  Then every thread pops a
+ * key and pushes it back with a random later key, as a scheduler
+ * re-arms a periodic timer, for -t seconds.  The same loop runs on a
+ * DHEAP from heap.h guarded by a pthread_mutex_t.
+ *
+ * Build: see README.md
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "multiqueue.h"
+
+struct item {
+  uint64_t key;
+  void *data;
+};
+
+DHEAP_DECL_TYPE(struct item, lheap_t, 4);
+#define lheap_t_cmp(x, y)       \
+  (((y)->key > (x)->key) - ((y)->key < (x)->key))
+
+static int nkeys = 100000;
+static int duration = 2;
+static int nqueues_per_thread = 2;
+static int stress = 0;
+
+static multiqueue_t *mq;
+static lheap_t lheap;
+static pthread_mutex_t lheap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int use_mutex;
+static int stop;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static int
+queue_push(uint64_t key, void *data)
+{
+  struct item item = { key, data };
+  int ret;
+
+  if (!use_mutex)
+    return multiqueue_push(mq, key, data);
+
+  pthread_mutex_lock(&lheap_mutex);
+  DHEAP_INSERT_(lheap_t, &lheap, item, ret);
+  pthread_mutex_unlock(&lheap_mutex);
+  return ret ? -1 : 0;
+}
+
+
+static int
+queue_pop(uint64_t *key, void **data)
+{
+  struct item item;
+  int popped;
+
+  if (!use_mutex)
+    return multiqueue_pop(mq, key, data);
+
+  pthread_mutex_lock(&lheap_mutex);
+  DHEAP_POP_(lheap_t, &lheap, &item, popped);
+  pthread_mutex_unlock(&lheap_mutex);
+  if (!popped)
+    return -1;
+  *key = item.key;
+  *data = item.data;
+  return 0;
+}
+
+
+static void *
+worker(void *arg)
+{
+  unsigned seed = (unsigned)(size_t)arg;
+  long count = 0;
+  uint64_t key;
+  void *data;
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    if (queue_pop(&key, &data) < 0) {
+      fprintf(stderr, "error: queue is empty\n");
+      abort();
+    }
+    /* every data pointer carries its own key in stress mode */
+    if (stress && (uint64_t)(uintptr_t)data != key) {
+      fprintf(stderr, "error: key %llu carries data %p\n",
+              (unsigned long long)key, data);
+      abort();
+    }
+    key += 1 + rand_r(&seed) % 1000;
+    queue_push(key, stress ? (void *)(uintptr_t)key : data);
+    count++;
+  }
+  return (void *)count;
+}
+
+
+static void
+run(const char *impl, int nthreads)
+{
+  pthread_t *threads;
+  double begin, elapsed;
+  long total = 0;
+  uint64_t key;
+  void *ret;
+  int i;
+
+  use_mutex = strcmp(impl, "mutex-heap") == 0;
+  if (!use_mutex)
+    mq = multiqueue_new(nthreads * nqueues_per_thread);
+
+  srand(1);
+  for (i = 0; i < nkeys; i++) {
+    key = ((uint64_t)rand() << 16) ^ rand();
+    queue_push(key, (void *)(uintptr_t)key);
+  }
+  stop = 0;
+
+  threads = malloc(sizeof(*threads) * nthreads);
+  begin = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(size_t)(i + 1));
+
+  sleep(duration);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], &ret);
+    total += (long)ret;
+  }
+  elapsed = now() - begin;
+
+  printf("%s,%d,%ld,%.3f,%.0f\n", impl, nthreads, total, elapsed,
+         total / elapsed);
+  fflush(stdout);
+
+  free(threads);
+  if (use_mutex)
+    DHEAP_FREE(lheap_t, &lheap);
+  else {
+    if (multiqueue_count(mq) != nkeys) {
+      fprintf(stderr, "error: %ld keys left, expected %d\n",
+              multiqueue_count(mq), nkeys);
+      abort();
+    }
+    multiqueue_delete(mq);
+  }
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -c LIST   comma separated list of threads (default: 1,2,4,8,16,32,64)\n");
+  printf("  -t SEC    duration of each run (default: %d)\n", duration);
+  printf("  -k N      number of keys in the queue (default: %d)\n", nkeys);
+  printf("  -q N      heaps per thread in the multiqueue (default: %d)\n",
+         nqueues_per_thread);
+  printf("  -S        stress mode; validate every popped key\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *threadlist = "1,2,4,8,16,32,64";
+  char *list, *tok, *save;
+  int opt, n;
+
+  while ((opt = getopt(argc, argv, "c:t:k:q:Sh")) != -1) {
+    switch (opt) {
+    case 'c':
+      threadlist = optarg;
+      break;
+    case 't':
+      duration = atoi(optarg);
+      break;
+    case 'k':
+      nkeys = atoi(optarg);
+      break;
+    case 'q':
+      nqueues_per_thread = atoi(optarg);
+      break;
+    case 'S':
+      stress = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (nkeys < 1 || nqueues_per_thread < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("impl,threads,ops,seconds,ops_per_sec\n");
+
+  list = strdup(threadlist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atoi(tok);
+    if (n <= 0)
+      continue;
+    run("mutex-heap", n);
+    run("multiqueue", n);
+  }
+  free(list);
+  return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Concurrency benchmark and stress test for SYMTABLE_CONCURRENT
+ *
+ * N reader threads look up random names while one writer thread updates
+ * values and enters/leaves frames at a fixed rate.  The same workload
+ * runs on a plain table guarded by a pthread_rwlock_t for comparison.
+ *
+ * Build: see README.md
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "symtable.h"
+
+static int nkeys = 10000;
+static int duration = 3;
+static int wrate = 1000;        /* writes per second */
+static int stress = 0;
+
+static symtable_t *table;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static int use_rwlock;
+static int stop;
+static char **names;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/* Every value is "NAME#SERIAL", so that a reader can detect a torn value. */
+static int
+check_value(const char *name, const char *value)
+{
+  size_t len = strlen(name);
+
+  return strncmp(name, value, len) == 0 && value[len] == '#';
+}
+
+
+static void *
+reader(void *arg)
+{
+  unsigned seed = (unsigned)(size_t)arg;
+  long count = 0;
+  char buf[64], *p;
+  const char *name;
+  size_t size;
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    name = names[rand_r(&seed) % nkeys];
+
+    if (use_rwlock)
+      pthread_rwlock_rdlock(&rwlock);
+    else
+      symtable_read_lock(table);
+
+    p = symtable_lookup(table, name, &size, 0);
+    if (p) {
+      if (size > sizeof(buf))
+        size = sizeof(buf);
+      memcpy(buf, p, size);
+    }
+
+    if (use_rwlock)
+      pthread_rwlock_unlock(&rwlock);
+    else
+      symtable_read_unlock(table);
+
+    if (stress) {
+      if (!p || !check_value(name, buf)) {
+        fprintf(stderr, "error: bad value for %s\n", name);
+        abort();
+      }
+      if (count % 64 == 0) {
+        /* a plain table substitutes in its shared obstack */
+        if (use_rwlock)
+          pthread_rwlock_wrlock(&rwlock);
+        p = symtable_string_substitute(table, "${var1}/${var2}");
+        if (use_rwlock)
+          pthread_rwlock_unlock(&rwlock);
+        if (!p || strncmp(p, "var1#", 5) != 0 || !strstr(p, "/var2#")) {
+          fprintf(stderr, "error: bad substitution: %s\n", p ? p : "(null)");
+          abort();
+        }
+        free(p);
+      }
+    }
+    count++;
+  }
+  return (void *)count;
+}
+
+
+static void
+write_lock(void)
+{
+  if (use_rwlock)
+    pthread_rwlock_wrlock(&rwlock);
+}
+
+
+static void
+write_unlock(void)
+{
+  if (use_rwlock)
+    pthread_rwlock_unlock(&rwlock);
+}
+
+
+static void *
+writer(void *arg)
+{
+  struct timespec ts;
+  long count = 0;
+  char value[64];
+  const char *name;
+  int i;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = wrate > 0 ? 1000000000L / wrate : 0;
+
+  while (wrate > 0 && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    name = names[rand() % nkeys];
+    snprintf(value, sizeof(value), "%s#%ld", name, count);
+
+    write_lock();
+    if (count % 100 == 99) {
+      /* shadow a few names in a new frame for a while */
+      if (symtable_current_frame(table) > 0)
+        symtable_leave(table);
+      else {
+        symtable_enter(table, NULL);
+        for (i = 0; i < 16; i++) {
+          name = names[rand() % nkeys];
+          snprintf(value, sizeof(value), "%s#%ld", name, count);
+          symtable_register(table, name, value, -1);
+        }
+      }
+    }
+    else
+      symtable_register(table, name, value, -1);
+    write_unlock();
+
+    count++;
+    nanosleep(&ts, NULL);
+  }
+  return (void *)count;
+}
+
+
+static void
+run(const char *impl, unsigned flags, int nthreads)
+{
+  pthread_t *threads, wthread;
+  char value[64];
+  double begin, elapsed;
+  long total = 0, writes;
+  void *ret;
+  int i;
+
+  table = symtable_new(nkeys, 4, flags);
+  for (i = 0; i < nkeys; i++) {
+    snprintf(value, sizeof(value), "%s#init", names[i]);
+    symtable_register(table, names[i], value, -1);
+  }
+  use_rwlock = !(flags & SYMTABLE_CONCURRENT);
+  stop = 0;
+
+  threads = malloc(sizeof(*threads) * nthreads);
+  begin = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, reader, (void *)(size_t)(i + 1));
+  pthread_create(&wthread, NULL, writer, NULL);
+
+  sleep(duration);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], &ret);
+    total += (long)ret;
+  }
+  pthread_join(wthread, &ret);
+  writes = (long)ret;
+  elapsed = now() - begin;
+
+  printf("%s,%d,%.0f,%ld,%.3f,%.0f\n", impl, nthreads, writes / elapsed,
+         total, elapsed, total / elapsed);
+  fflush(stdout);
+
+  free(threads);
+  symtable_delete(table);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -c LIST   comma separated list of reader threads (default: 1,2,4,8,16)\n");
+  printf("  -t SEC    duration of each run (default: %d)\n", duration);
+  printf("  -k N      number of names (default: %d)\n", nkeys);
+  printf("  -w N      writes per second, 0 for none (default: %d)\n", wrate);
+  printf("  -S        stress mode; validate every value read\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *threadlist = "1,2,4,8,16";
+  char *list, *tok, *save;
+  char name[32];
+  int opt, n, i;
+
+  while ((opt = getopt(argc, argv, "c:t:k:w:Sh")) != -1) {
+    switch (opt) {
+    case 'c':
+      threadlist = optarg;
+      break;
+    case 't':
+      duration = atoi(optarg);
+      break;
+    case 'k':
+      nkeys = atoi(optarg);
+      break;
+    case 'w':
+      wrate = atoi(optarg);
+      break;
+    case 'S':
+      stress = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (nkeys < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  names = malloc(sizeof(*names) * nkeys);
+  for (i = 0; i < nkeys; i++) {
+    snprintf(name, sizeof(name), "var%d", i);
+    names[i] = strdup(name);
+  }
+
+  printf("impl,threads,writes_per_sec,lookups,seconds,lookups_per_sec\n");
+
+  list = strdup(threadlist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atoi(tok);
+    if (n <= 0)
+      continue;
+    run("rwlock", 0, n);
+    run("concurrent", SYMTABLE_CONCURRENT, n);
+    run("concurrent-openaddr", SYMTABLE_CONCURRENT | SYMTABLE_OPT_OPENADDR, n);
+  }
+  free(list);
+  return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Lookup benchmark: chained buckets vs. SYMTABLE_OPT_OPENADDR, by name
+ * and by atom
+ *
+ * Build: see README.md
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "symtable.h"
+
+static int nlookups = 10000000;
+static int miss_percent = 0;
+static int nframes = 4;
+static double load = 1.0;       /* names per bucket of the chained table */
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/* Mix of short names (kept inline in the slot) and long, dotted ones. */
+static void
+make_name(char *buf, size_t size, int i)
+{
+  if (i % 4 == 3)
+    snprintf(buf, size, "template.section%d.variable_%d", i % 97, i);
+  else
+    snprintf(buf, size, "var%d", i);
+}
+
+
+static void
+run(const char *impl, unsigned flags, int atoms, int nkeys, char **queries)
+{
+  symtable_t *st;
+  symtable_atom_t *qatoms = NULL;
+  char name[64];
+  double begin, elapsed;
+  size_t size;
+  long found = 0;
+  int i, f;
+
+  st = symtable_new(flags ? nkeys : (size_t)(nkeys / load) + 1,
+                    nframes + 1, flags);
+  if (!st) {
+    fprintf(stderr, "error: symtable_new failed\n");
+    exit(1);
+  }
+
+  /* Every frame re-binds a quarter of the names of the outer frame. */
+  for (f = 0; f < nframes; f++) {
+    if (f > 0)
+      symtable_enter(st, NULL);
+    for (i = 0; i < (f == 0 ? nkeys : nkeys / 4); i++) {
+      make_name(name, sizeof(name), i * (f ? 4 : 1) % nkeys);
+      symtable_register(st, name, name, -1);
+    }
+  }
+
+  if (atoms) {
+    /* resolved once, as a template would do */
+    qatoms = malloc(sizeof(*qatoms) * 0x100000);
+    for (i = 0; i < 0x100000; i++)
+      qatoms[i] = symtable_intern(st, queries[i]);
+  }
+
+  begin = now();
+  if (atoms) {
+    for (i = 0; i < nlookups; i++)
+      if (symtable_lookup_atom(st, qatoms[i & 0xFFFFF], &size, 0))
+        found++;
+  }
+  else {
+    for (i = 0; i < nlookups; i++)
+      if (symtable_lookup(st, queries[i & 0xFFFFF], &size, 0))
+        found++;
+  }
+  elapsed = now() - begin;
+
+  printf("%s,%d,%d,%ld,%.3f,%.0f\n", impl, nkeys, nlookups, found,
+         elapsed, nlookups / elapsed);
+  fflush(stdout);
+
+  symtable_delete(st);
+  free(qatoms);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -k LIST   comma separated list of number of names (default: 100,1000,10000,100000,1000000)\n");
+  printf("  -n N      number of lookups per run (default: %d)\n", nlookups);
+  printf("  -m PCT    percentage of lookups for unknown names (default: %d)\n", miss_percent);
+  printf("  -f N      number of frames (default: %d)\n", nframes);
+  printf("  -l LOAD   names per bucket of the chained table (default: %.1f)\n", load);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *keylist = "100,1000,10000,100000,1000000";
+  char *list, *tok, *save;
+  char **queries;
+  char name[64];
+  int opt, nkeys, i;
+
+  while ((opt = getopt(argc, argv, "k:n:m:f:l:h")) != -1) {
+    switch (opt) {
+    case 'k':
+      keylist = optarg;
+      break;
+    case 'n':
+      nlookups = atoi(optarg);
+      break;
+    case 'm':
+      miss_percent = atoi(optarg);
+      break;
+    case 'f':
+      nframes = atoi(optarg);
+      break;
+    case 'l':
+      load = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (nframes < 1)
+    nframes = 1;
+
+  /* 1M pre-generated query names, reused in a loop */
+  queries = malloc(sizeof(*queries) * 0x100000);
+
+  printf("impl,keys,lookups,found,seconds,lookups_per_sec\n");
+
+  list = strdup(keylist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    nkeys = atoi(tok);
+    if (nkeys <= 0)
+      continue;
+
+    srand(nkeys);
+    for (i = 0; i < 0x100000; i++) {
+      if (rand() % 100 < miss_percent)
+        snprintf(name, sizeof(name), "missing%d", rand());
+      else
+        make_name(name, sizeof(name), rand() % nkeys);
+      queries[i] = strdup(name);
+    }
+
+    run("chained", 0, 0, nkeys, queries);
+    run("openaddr", SYMTABLE_OPT_OPENADDR, 0, nkeys, queries);
+    run("chained-atom", 0, 1, nkeys, queries);
+    run("openaddr-atom", SYMTABLE_OPT_OPENADDR, 1, nkeys, queries);
+
+    for (i = 0; i < 0x100000; i++)
+      free(queries[i]);
+  }
+  free(list);
+  free(queries);
+  return 0;
+}
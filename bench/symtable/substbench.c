@@ -0,0 +1,165 @@
+/*
+ * Substitution benchmark: symtable_string_substitute() vs. compiled
+ * templates (symtable_template_compile/symtable_template_expand)
+ *
+ * Build: see README.md
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "symtable.h"
+
+static int ntemplates = 300;
+static int nvars = 1000;
+static int nexpand = 2000000;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+/* Template with REFS references, separated by short literal text. */
+static char *
+make_template(int refs)
+{
+  char *buf = malloc(refs * 48 + 64);
+  char *p = buf;
+  int i;
+
+  p += sprintf(p, "<item id=\"");
+  for (i = 0; i < refs; i++)
+    p += sprintf(p, "${var%d}\" class=\"", rand() % nvars);
+  sprintf(p, "\"/>");
+  return buf;
+}
+
+
+static void
+run(unsigned flags, int refs)
+{
+  symtable_t *st;
+  symtable_template_t **compiled;
+  char **templates;
+  char name[32], value[32];
+  double begin, elapsed;
+  char *p, *q;
+  int i;
+
+  st = symtable_new(nvars, 4, flags);
+  for (i = 0; i < nvars; i++) {
+    snprintf(name, sizeof(name), "var%d", i);
+    snprintf(value, sizeof(value), "value-%d", i * 7919);
+    symtable_register(st, name, value, -1);
+  }
+
+  templates = malloc(sizeof(*templates) * ntemplates);
+  compiled = malloc(sizeof(*compiled) * ntemplates);
+  for (i = 0; i < ntemplates; i++) {
+    templates[i] = make_template(refs);
+    compiled[i] = symtable_template_compile(st, templates[i]);
+
+    p = symtable_string_substitute(st, templates[i]);
+    q = symtable_template_expand(st, compiled[i]);
+    if (!p || !q || strcmp(p, q) != 0) {
+      fprintf(stderr, "error: result mismatch for \"%s\"\n", templates[i]);
+      exit(1);
+    }
+    free(p);
+    free(q);
+  }
+
+  begin = now();
+  for (i = 0; i < nexpand; i++) {
+    p = symtable_string_substitute(st, templates[i % ntemplates]);
+    free(p);
+  }
+  elapsed = now() - begin;
+  printf("interp,%s,%d,%d,%d,%.3f,%.0f\n",
+         flags ? "openaddr" : "chained", ntemplates, refs, nexpand,
+         elapsed, nexpand / elapsed);
+
+  begin = now();
+  for (i = 0; i < nexpand; i++) {
+    p = symtable_template_expand(st, compiled[i % ntemplates]);
+    free(p);
+  }
+  elapsed = now() - begin;
+  printf("compiled,%s,%d,%d,%d,%.3f,%.0f\n",
+         flags ? "openaddr" : "chained", ntemplates, refs, nexpand,
+         elapsed, nexpand / elapsed);
+  fflush(stdout);
+
+  for (i = 0; i < ntemplates; i++) {
+    symtable_template_free(compiled[i]);
+    free(templates[i]);
+  }
+  free(compiled);
+  free(templates);
+  symtable_delete(st);
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -r LIST   comma separated list of references per template (default: 1,4,16)\n");
+  printf("  -t N      number of templates (default: %d)\n", ntemplates);
+  printf("  -v N      number of variables (default: %d)\n", nvars);
+  printf("  -n N      number of expansions per run (default: %d)\n", nexpand);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *reflist = "1,4,16";
+  char *list, *tok, *save;
+  int opt, refs;
+
+  while ((opt = getopt(argc, argv, "r:t:v:n:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      reflist = optarg;
+      break;
+    case 't':
+      ntemplates = atoi(optarg);
+      break;
+    case 'v':
+      nvars = atoi(optarg);
+      break;
+    case 'n':
+      nexpand = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (ntemplates < 1 || nvars < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("impl,table,templates,refs,expansions,seconds,expansions_per_sec\n");
+
+  list = strdup(reflist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    refs = atoi(tok);
+    if (refs < 0)
+      continue;
+    srand(refs);
+    run(0, refs);
+    run(SYMTABLE_OPT_OPENADDR, refs);
+  }
+  free(list);
+  return 0;
+}
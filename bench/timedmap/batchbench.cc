@@ -0,0 +1,226 @@
+/*
+ * build:
+ *    $ gcc -c ../../xerror.c
+ *    $ g++ -O2 -pthread -I../.. batchbench.cc xerror.o -o batchbench -lpthread
+ *
+ * Usage:
+ *    $ ./batchbench                   # batches of 10,50,100,200 keys
+ *    $ ./batchbench -b 128 -n 20000   # 20000 batches of 128 keys
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <libgen.h>
+#include <getopt.h>
+
+#include "shtimedmap.hh"
+
+STMAP_TYPE_DECL(smap_t, int, int);
+
+static void show_help_and_exit(void);
+double elapsed(const struct timespec *begin);
+
+int num_batches = 10000;
+int num_keys = 100000;
+unsigned num_shards = 0;
+const char *batch_list = "10,50,100,200";
+
+volatile int bench_sink;
+
+const char *program_name;
+
+
+static inline uint32_t
+xorshift32(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+static void
+report(const char *op, const char *mode, int batch, uint64_t keys,
+       double secs, uint64_t locks)
+{
+  printf("%s,%s,%d,%" PRIu64 ",%.0f,%.4f\n", op, mode, batch, keys,
+         keys / secs, (double)locks / keys);
+  fflush(stdout);
+}
+
+
+static void
+bench_batch(smap_t &map, int batch)
+{
+  int *keys = new int[batch];
+  int *vals = new int[batch];
+  smap_t::ref *refs = new smap_t::ref[batch];
+  uint64_t nkeys = (uint64_t)num_batches * batch;
+  uint32_t seed;
+  struct timespec ts;
+  uint64_t locks;
+  int i, j, sink = 0;
+
+  /* set, one key at a time */
+  seed = 2463534242U;
+  locks = map.stats().locks;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for (i = 0; i < num_batches; i++) {
+    for (j = 0; j < batch; j++) {
+      uint32_t r = xorshift32(&seed);
+      map.set((int)(r % num_keys), (int)r);
+    }
+  }
+  report("set", "single", batch, nkeys, elapsed(&ts), map.stats().locks - locks);
+
+  /* set_many */
+  seed = 2463534242U;
+  locks = map.stats().locks;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for (i = 0; i < num_batches; i++) {
+    for (j = 0; j < batch; j++) {
+      uint32_t r = xorshift32(&seed);
+      keys[j] = (int)(r % num_keys);
+      vals[j] = (int)r;
+    }
+    map.set_many(keys, vals, batch);
+  }
+  report("set", "batch", batch, nkeys, elapsed(&ts), map.stats().locks - locks);
+
+  /* get, one key at a time */
+  seed = 88675123U;
+  locks = map.stats().locks;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for (i = 0; i < num_batches; i++) {
+    for (j = 0; j < batch; j++) {
+      uint32_t r = xorshift32(&seed);
+      TMAP_GET(smap_t, map, (int)(r % num_keys), g) {
+        if (g)
+          sink += *g;
+      }
+    }
+  }
+  report("get", "single", batch, nkeys, elapsed(&ts), map.stats().locks - locks);
+
+  /* get_many */
+  seed = 88675123U;
+  locks = map.stats().locks;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for (i = 0; i < num_batches; i++) {
+    for (j = 0; j < batch; j++) {
+      uint32_t r = xorshift32(&seed);
+      keys[j] = (int)(r % num_keys);
+    }
+    map.get_many(keys, batch, refs);
+    for (j = 0; j < batch; j++)
+      if (refs[j])
+        sink += *refs[j];
+  }
+  report("get", "batch", batch, nkeys, elapsed(&ts), map.stats().locks - locks);
+
+  bench_sink = sink;
+  delete [] refs;
+  delete [] vals;
+  delete [] keys;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  int opt;
+
+  program_name = basename(argv[0]);
+  xerror_init(program_name, 0);
+
+  while ((opt = getopt(argc, argv, "b:n:k:s:h")) != -1) {
+    switch (opt) {
+    case 'b':
+      batch_list = optarg;
+      break;
+    case 'n':
+      num_batches = atoi(optarg);
+      break;
+    case 'k':
+      num_keys = atoi(optarg);
+      break;
+    case 's':
+      num_shards = atoi(optarg);
+      break;
+    case 'h':
+      show_help_and_exit();
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (num_keys <= 0 || num_batches <= 0)
+    xerror(1, 0, "invalid number of keys or batches");
+
+  smap_t map(600 * 1000, num_shards);
+
+  printf("op,mode,batch,keys,keys_per_sec,locks_per_key\n");
+
+  char *list = strdup(batch_list);
+  char *saveptr = 0;
+  for (char *tok = strtok_r(list, ",", &saveptr); tok;
+       tok = strtok_r(0, ",", &saveptr)) {
+    int batch = atoi(tok);
+    if (batch > 0)
+      bench_batch(map, batch);
+  }
+  free(list);
+
+  return 0;
+}
+
+
+double
+elapsed(const struct timespec *begin)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - begin->tv_sec) +
+    (end.tv_nsec - begin->tv_nsec) / 1000000000.0;
+}
+
+
+static void
+show_help_and_exit(void)
+{
+  static const char *msg[] = {
+    "",
+    "  -b LIST  comma separated list of batch sizes (default: 10,50,100,200)",
+    "  -n N     run N batches for each case (default: 10000)",
+    "  -k K     use K distinct keys (default: 100000)",
+    "  -s S     use S shards (default: 4 * # of CPUs)",
+    "",
+    "  -h       show help messages and exit",
+    "",
+    "  For each batch size, this program registers and looks up the same keys",
+    "one at a time (set, TMAP_GET) and in batches (set_many, get_many), and",
+    "prints the throughput and the shard lock acquisitions per key in CSV.",
+    "",
+  };
+  size_t i;
+
+  printf("Usage: %s [OPTION...]\n", program_name);
+  for (i = 0; i < sizeof(msg) / sizeof(msg[0]); i++) {
+    puts(msg[i]);
+  }
+
+  exit(0);
+}
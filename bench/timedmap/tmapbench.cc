@@ -0,0 +1,243 @@
+/*
+ * build:
+ *    $ gcc -c ../../xerror.c
+ *    $ g++ -O2 -pthread -I../.. tmapbench.cc xerror.o -lpthread
+ *
+ * Usage:
+ *    $ ./a.out                        # default sweep, 3 seconds per run
+ *    $ ./a.out -c 1,2,4,8,16,32 -t 5  # sweep given thread counts
+ *    $ ./a.out -r 98 -k 100000        # 98% reads over 100000 keys
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <libgen.h>
+#include <getopt.h>
+
+#include "timedmap.hh"
+#include "shtimedmap.hh"
+
+TMAP_TYPE_DECL(lmap_t, int, int);    // std::map + single mutex
+STMAP_TYPE_DECL(smap_t, int, int);   // sharded + timer wheel
+
+static void show_help_and_exit(void);
+void diff_time(struct timespec *result, struct timespec *lhs,  struct timespec *rhs);
+
+int run_duration = 3;
+int num_keys = 10000;
+int read_ratio = 90;            /* percentage of get operations */
+int life_time = 60;             /* in seconds */
+unsigned num_shards = 0;
+const char *thread_list = "1,2,4,8,16,32";
+
+volatile int bench_stop = 0;
+volatile int bench_sink;
+
+const char *program_name;
+
+
+template <class M>
+struct bench_arg {
+  M *map;
+  int id;
+  uint64_t ops;
+};
+
+
+static inline uint32_t
+xorshift32(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+template <class M, class G>
+static void *
+bench_worker(void *arg)
+{
+  bench_arg<M> *ba = (bench_arg<M> *)arg;
+  M &map = *ba->map;
+  uint32_t seed = 2463534242U + ba->id * 7919;
+  uint64_t ops = 0;
+  int sink = 0;
+
+  while (!bench_stop) {
+    uint32_t r = xorshift32(&seed);
+    int key = (int)(r % num_keys);
+
+    if ((int)((r >> 16) % 100) < read_ratio) {
+      for (G g(map, key, map.duration()); g.once(); ) {
+        if (g)
+          sink += *g;
+      }
+    }
+    else
+      map.set(key, (int)r);
+    ops++;
+  }
+
+  bench_sink = sink;
+  ba->ops = ops;
+  return NULL;
+}
+
+
+template <class M, class G>
+static void
+bench_run(const char *name, M &map, int nthreads)
+{
+  pthread_t *threads = new pthread_t[nthreads];
+  bench_arg<M> *args = new bench_arg<M>[nthreads];
+  struct timespec ts_begin, ts_end, ts_diff;
+  uint64_t total = 0;
+  int i, ret;
+
+  for (i = 0; i < num_keys; i++)
+    map.set(i, i);
+
+  bench_stop = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts_begin);
+
+  for (i = 0; i < nthreads; i++) {
+    args[i].map = &map;
+    args[i].id = i;
+    args[i].ops = 0;
+    ret = pthread_create(threads + i, NULL, bench_worker<M, G>, args + i);
+    if (ret != 0)
+      xerror(1, ret, "pthread_create() failed");
+  }
+
+  sleep(run_duration);
+  __sync_synchronize();
+  bench_stop = 1;
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+    total += args[i].ops;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  diff_time(&ts_diff, &ts_begin, &ts_end);
+
+  double secs = ts_diff.tv_sec + ts_diff.tv_nsec / 1000000000.0;
+  printf("%s,%d,%" PRIu64 ",%.3f,%.0f\n", name, nthreads, total, secs,
+         total / secs);
+  fflush(stdout);
+
+  delete [] args;
+  delete [] threads;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  int opt;
+
+  program_name = basename(argv[0]);
+  xerror_init(program_name, 0);
+
+  while ((opt = getopt(argc, argv, "c:t:k:r:s:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      thread_list = optarg;
+      break;
+    case 't':
+      run_duration = atoi(optarg);
+      break;
+    case 'k':
+      num_keys = atoi(optarg);
+      break;
+    case 'r':
+      read_ratio = atoi(optarg);
+      break;
+    case 's':
+      num_shards = atoi(optarg);
+      break;
+    case 'h':
+      show_help_and_exit();
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (num_keys <= 0)
+    xerror(1, 0, "invalid number of keys, %d", num_keys);
+
+  printf("impl,threads,ops,seconds,ops_per_sec\n");
+
+  char *list = strdup(thread_list);
+  char *saveptr = 0;
+  for (char *tok = strtok_r(list, ",", &saveptr); tok;
+       tok = strtok_r(0, ",", &saveptr)) {
+    int nthreads = atoi(tok);
+    if (nthreads <= 0)
+      continue;
+    {
+      lmap_t map(life_time);
+      bench_run<lmap_t, lmap_tgetter>("timedmap", map, nthreads);
+    }
+    {
+      smap_t map(life_time * 1000, num_shards);
+      bench_run<smap_t, smap_tgetter>("sharded", map, nthreads);
+    }
+  }
+  free(list);
+
+  return 0;
+}
+
+
+void
+diff_time(struct timespec *result, struct timespec *lhs,  struct timespec *rhs)
+{
+  if (rhs->tv_nsec < lhs->tv_nsec) {
+    rhs->tv_nsec += 1000000000;
+    rhs->tv_sec--;
+  }
+
+  result->tv_nsec = rhs->tv_nsec - lhs->tv_nsec;
+  result->tv_sec = rhs->tv_sec - lhs->tv_sec;
+}
+
+
+static void
+show_help_and_exit(void)
+{
+  static const char *msg[] = {
+    "",
+    "  -c LIST  comma separated list of thread counts (default: 1,2,4,8,16,32)",
+    "  -t T     run each case for T second(s) (default: 3)",
+    "  -k K     use K distinct keys (default: 10000)",
+    "  -r R     R percent of the operations are get, others are set (default: 90)",
+    "  -s S     use S shards for sharded_timedmap (default: 4 * # of CPUs)",
+    "",
+    "  -h       show help messages and exit",
+    "",
+    "  For each thread count, this program runs the same get/set mix against",
+    "timedmap (std::map with a single mutex) and sharded_timedmap, then prints",
+    "the throughput of each run in CSV.",
+    "",
+  };
+  size_t i;
+
+  printf("Usage: %s [OPTION...]\n", program_name);
+  for (i = 0; i < sizeof(msg) / sizeof(msg[0]); i++) {
+    puts(msg[i]);
+  }
+
+  exit(0);
+}
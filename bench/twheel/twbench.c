@@ -0,0 +1,263 @@
+/*
+ * Benchmark of twheel.c, the hierarchical timer wheel, against the
+ * indexed 4-ary heap of heap.h (IHEAP_DECL_TYPE), which also schedules,
+ * reschedules and cancels timers by handle.
+ *
+ * N timers get random deadlines within the next R milliseconds (-r),
+ * as connection timeouts would.  Each run measures four phases:
+ *
+ *   schedule   -- schedule N timers
+ *   reschedule -- move a random timer to a new random deadline, M
+ *                 times, as when a connection sees traffic
+ *   cancel     -- cancel every other timer
+ *   expire     -- advance the clock 1 ms at a time over R ms, calling
+ *                 each timer that becomes due
+ *
+ * Build: see README.md
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "twheel.h"
+
+struct itimer {
+  uint64_t deadline;
+  int pos;
+};
+
+IHEAP_DECL_TYPE(struct itimer, iheap4_t, 4);
+#define iheap4_t_cmp(x, y)      \
+  (((y)->deadline > (x)->deadline) - ((y)->deadline < (x)->deadline))
+#define iheap4_t_index(x)       ((x)->pos)
+
+static long nresched = 1000000;
+static long range = 60000;      /* deadlines fall in [1, range] ms */
+static uint64_t *deadlines;     /* N initial deadlines */
+static uint64_t *redeadlines;   /* new deadlines for the reschedule phase */
+static long *victims;           /* timers to reschedule */
+static uint64_t checksum;
+static uint64_t clock_ms;       /* the simulated clock of the expire phase */
+static long fired;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static void
+report(const char *impl, long n, const char *op, long ops, double elapsed)
+{
+  printf("%s,%ld,%s,%ld,%.3f,%.0f\n", impl, n, op, ops, elapsed,
+         ops / elapsed);
+  fflush(stdout);
+}
+
+
+/* Timers must fire in the very millisecond they are due. */
+static void
+expire(uint64_t deadline)
+{
+  if (deadline != clock_ms) {
+    fprintf(stderr, "error: timer due at %llu fired at %llu\n",
+            (unsigned long long)deadline, (unsigned long long)clock_ms);
+    abort();
+  }
+  checksum += deadline;
+  fired++;
+}
+
+
+static void
+on_expire(struct twheel_timer *timer, void *arg)
+{
+  (void)arg;
+  expire(timer->expires);
+}
+
+
+static void
+run_twheel(long n)
+{
+  twheel_t *w;
+  struct twheel_timer *timers;
+  double begin;
+  long i;
+
+  w = twheel_new(0);
+  timers = malloc(sizeof(*timers) * n);
+  if (!w || !timers)
+    abort();
+  for (i = 0; i < n; i++)
+    twheel_timer_init(&timers[i], on_expire, NULL);
+
+  begin = now();
+  for (i = 0; i < n; i++)
+    twheel_schedule(w, &timers[i], deadlines[i]);
+  report("twheel", n, "schedule", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nresched; i++)
+    twheel_schedule(w, &timers[victims[i]], redeadlines[i]);
+  report("twheel", n, "reschedule", nresched, now() - begin);
+
+  begin = now();
+  for (i = 0; i < n; i += 2)
+    twheel_cancel(w, &timers[i]);
+  report("twheel", n, "cancel", (n + 1) / 2, now() - begin);
+
+  fired = 0;
+  begin = now();
+  for (clock_ms = 1; clock_ms <= (uint64_t)range; clock_ms++)
+    twheel_advance(w, clock_ms);
+  report("twheel", n, "expire", fired, now() - begin);
+  if (fired != n / 2 || twheel_count(w) != 0)
+    abort();
+
+  twheel_delete(w);
+  free(timers);
+}
+
+
+static void
+run_iheap(long n)
+{
+  iheap4_t heap = IHEAP_INITIALIZER(1024);
+  struct itimer *timers, **out, bound;
+  double begin;
+  long i;
+  int k;
+
+  timers = malloc(sizeof(*timers) * n);
+  out = malloc(sizeof(*out) * n);
+  if (!timers || !out)
+    abort();
+  for (i = 0; i < n; i++)
+    timers[i].pos = -1;
+
+  begin = now();
+  for (i = 0; i < n; i++) {
+    timers[i].deadline = deadlines[i];
+    if (IHEAP_INSERT(iheap4_t, &heap, &timers[i]) != 0)
+      abort();
+  }
+  report("indexed-4", n, "schedule", n, now() - begin);
+
+  begin = now();
+  for (i = 0; i < nresched; i++) {
+    timers[victims[i]].deadline = redeadlines[i];
+    IHEAP_UPDATE(iheap4_t, &heap, &timers[victims[i]]);
+  }
+  report("indexed-4", n, "reschedule", nresched, now() - begin);
+
+  begin = now();
+  for (i = 0; i < n; i += 2)
+    IHEAP_REMOVE(iheap4_t, &heap, &timers[i]);
+  report("indexed-4", n, "cancel", (n + 1) / 2, now() - begin);
+
+  fired = 0;
+  begin = now();
+  for (clock_ms = 1; clock_ms <= (uint64_t)range; clock_ms++) {
+    bound.deadline = clock_ms;
+    while ((k = IHEAP_POP_N(iheap4_t, &heap, &bound, out, n)) > 0)
+      while (k-- > 0)
+        expire(out[k]->deadline);
+  }
+  report("indexed-4", n, "expire", fired, now() - begin);
+  if (fired != n / 2 || IHEAP_COUNT(&heap) != 0)
+    abort();
+
+  IHEAP_FREE(&heap);
+  free(timers);
+  free(out);
+}
+
+
+static uint64_t
+random_deadline(void)
+{
+  return 1 + (((uint64_t)rand() << 16) ^ rand()) % range;
+}
+
+
+static void
+usage(const char *prog)
+{
+  printf("usage: %s [OPTION...]\n", prog);
+  printf("  -n LIST   comma separated list of timer counts (default: 1000,100000,1000000)\n");
+  printf("  -m N      timers to reschedule (default: %ld)\n", nresched);
+  printf("  -r MS     deadlines fall within MS milliseconds (default: %ld)\n",
+         range);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *sizelist = "1000,100000,1000000";
+  char *list, *tok, *save;
+  long n, i, maxn = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:r:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      sizelist = optarg;
+      break;
+    case 'm':
+      nresched = atol(optarg);
+      break;
+    case 'r':
+      range = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (range <= 0) {
+    fprintf(stderr, "error: -r must be positive\n");
+    return 1;
+  }
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    if (atol(tok) > maxn)
+      maxn = atol(tok);
+  free(list);
+
+  srand(1);
+  deadlines = malloc(sizeof(*deadlines) * maxn);
+  for (i = 0; i < maxn; i++)
+    deadlines[i] = random_deadline();
+  redeadlines = malloc(sizeof(*redeadlines) * nresched);
+  victims = malloc(sizeof(*victims) * nresched);
+  for (i = 0; i < nresched; i++)
+    redeadlines[i] = random_deadline();
+
+  printf("impl,timers,op,ops,seconds,ops_per_sec\n");
+
+  list = strdup(sizelist);
+  for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    n = atol(tok);
+    if (n <= 0)
+      continue;
+    for (i = 0; i < nresched; i++)
+      victims[i] = (((long)rand() << 16) ^ rand()) % n;
+    run_twheel(n);
+    run_iheap(n);
+  }
+  free(list);
+
+  fprintf(stderr, "checksum: %llu\n", (unsigned long long)checksum);
+  return 0;
+}
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * See bptree.h for the license.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bptree.h"
+
+/*
+ * Every node is BPTREE_NODE_SIZE bytes.  A leaf holds LEAF_MAX keys
+ * and their values, in separate arrays so that a search reads only
+ * the keys.  An inner node holds INNER_MAX keys and one more child;
+ * child[i] covers the keys in [keys[i - 1], keys[i]).  Except for the
+ * root, no node is less than about half full.
+ */
+#define LEAF_MAX        ((BPTREE_NODE_SIZE - 16) / 16)
+#define LEAF_MIN        (LEAF_MAX / 2)
+#define INNER_MAX       ((BPTREE_NODE_SIZE - 16) / 16)
+#define INNER_MIN       (INNER_MAX / 2)
+
+/* Deep enough for any tree that fits in memory */
+#define BPT_MAXDEPTH    32
+
+struct bptree_node {
+  int leaf;
+  int count;                    /* number of keys */
+};
+
+struct bptree_leaf {
+  struct bptree_node hdr;
+  struct bptree_leaf *next;
+  uint64_t keys[LEAF_MAX];
+  void *values[LEAF_MAX];
+};
+
+struct bptree_inner {
+  struct bptree_node hdr;
+  uint64_t keys[INNER_MAX];
+  struct bptree_node *child[INNER_MAX + 1];
+};
+
+typedef char bpt_leaf_fits[sizeof(struct bptree_leaf) <= BPTREE_NODE_SIZE
+                           ? 1 : -1];
+typedef char bpt_inner_fits[sizeof(struct bptree_inner) <= BPTREE_NODE_SIZE
+                            ? 1 : -1];
+
+#define LEAF(n)         ((struct bptree_leaf *)(n))
+#define INNER(n)        ((struct bptree_inner *)(n))
+
+struct bptree {
+  struct bptree_node *root;     /* NULL if empty */
+  long count;
+};
+
+
+static struct bptree_node *
+node_new(int leaf)
+{
+  void *p;
+
+  if (posix_memalign(&p, 64, BPTREE_NODE_SIZE) != 0)
+    return NULL;
+  ((struct bptree_node *)p)->leaf = leaf;
+  ((struct bptree_node *)p)->count = 0;
+  if (leaf)
+    LEAF(p)->next = NULL;
+  return p;
+}
+
+
+static void
+node_free(struct bptree_node *n)
+{
+  int i;
+
+  if (!n->leaf)
+    for (i = 0; i <= n->count; i++)
+      node_free(INNER(n)->child[i]);
+  free(n);
+}
+
+
+/*
+ * Return the number of KEYS that are less than KEY.  A node has so few
+ * keys that counting them all without a branch beats a binary search,
+ * which mispredicts at every step.
+ */
+static __inline__ int
+rank_lt(const uint64_t *keys, int n, uint64_t key)
+{
+  int i, rank = 0;
+
+  for (i = 0; i < n; i++)
+    rank += keys[i] < key;
+  return rank;
+}
+
+
+/* Return the number of KEYS that are less than or equal to KEY. */
+static __inline__ int
+rank_le(const uint64_t *keys, int n, uint64_t key)
+{
+  int i, rank = 0;
+
+  for (i = 0; i < n; i++)
+    rank += keys[i] <= key;
+  return rank;
+}
+
+
+bptree_t *
+bptree_new(void)
+{
+  return calloc(1, sizeof(bptree_t));
+}
+
+
+void
+bptree_delete(bptree_t *t)
+{
+  if (t->root)
+    node_free(t->root);
+  free(t);
+}
+
+
+static struct bptree_leaf *
+find_leaf(const bptree_t *t, uint64_t key)
+{
+  struct bptree_node *n = t->root;
+
+  while (n && !n->leaf)
+    n = INNER(n)->child[rank_le(INNER(n)->keys, n->count, key)];
+  return LEAF(n);
+}
+
+
+int
+bptree_find(const bptree_t *t, uint64_t key, void **value)
+{
+  struct bptree_leaf *leaf = find_leaf(t, key);
+  int pos;
+
+  if (!leaf)
+    return -1;
+  pos = rank_lt(leaf->keys, leaf->hdr.count, key);
+  if (pos == leaf->hdr.count || leaf->keys[pos] != key)
+    return -1;
+  if (value)
+    *value = leaf->values[pos];
+  return 0;
+}
+
+
+/*
+ * Insert KEY and VALUE at POS of the full LEAF, moving the upper half
+ * to RIGHT.  Appending to the last leaf leaves it full instead, so
+ * that ascending insertions fill the leaves.
+ */
+static void
+leaf_split(struct bptree_leaf *leaf, struct bptree_leaf *right, int pos,
+           uint64_t key, void *value)
+{
+  uint64_t keys[LEAF_MAX + 1];
+  void *values[LEAF_MAX + 1];
+  int lcount;
+
+  memcpy(keys, leaf->keys, sizeof(*keys) * pos);
+  memcpy(values, leaf->values, sizeof(*values) * pos);
+  keys[pos] = key;
+  values[pos] = value;
+  memcpy(keys + pos + 1, leaf->keys + pos, sizeof(*keys) * (LEAF_MAX - pos));
+  memcpy(values + pos + 1, leaf->values + pos,
+         sizeof(*values) * (LEAF_MAX - pos));
+
+  if (pos == LEAF_MAX && !leaf->next)
+    lcount = LEAF_MAX;
+  else
+    lcount = (LEAF_MAX + 1) / 2;
+
+  memcpy(leaf->keys, keys, sizeof(*keys) * lcount);
+  memcpy(leaf->values, values, sizeof(*values) * lcount);
+  leaf->hdr.count = lcount;
+  memcpy(right->keys, keys + lcount, sizeof(*keys) * (LEAF_MAX + 1 - lcount));
+  memcpy(right->values, values + lcount,
+         sizeof(*values) * (LEAF_MAX + 1 - lcount));
+  right->hdr.count = LEAF_MAX + 1 - lcount;
+
+  right->next = leaf->next;
+  leaf->next = right;
+}
+
+
+/*
+ * Insert KEY and its right CHILD at POS of the full inner node N,
+ * moving the upper half to RIGHT.  Returns the key that moves up.
+ */
+static uint64_t
+inner_split(struct bptree_inner *n, struct bptree_inner *right, int pos,
+            uint64_t key, struct bptree_node *child)
+{
+  uint64_t keys[INNER_MAX + 1];
+  struct bptree_node *children[INNER_MAX + 2];
+  int lcount = (INNER_MAX + 1) / 2;
+
+  memcpy(keys, n->keys, sizeof(*keys) * pos);
+  keys[pos] = key;
+  memcpy(keys + pos + 1, n->keys + pos, sizeof(*keys) * (INNER_MAX - pos));
+  memcpy(children, n->child, sizeof(*children) * (pos + 1));
+  children[pos + 1] = child;
+  memcpy(children + pos + 2, n->child + pos + 1,
+         sizeof(*children) * (INNER_MAX - pos));
+
+  /* keys[lcount] moves up */
+  memcpy(n->keys, keys, sizeof(*keys) * lcount);
+  memcpy(n->child, children, sizeof(*children) * (lcount + 1));
+  n->hdr.count = lcount;
+  memcpy(right->keys, keys + lcount + 1,
+         sizeof(*keys) * (INNER_MAX - lcount));
+  memcpy(right->child, children + lcount + 1,
+         sizeof(*children) * (INNER_MAX + 1 - lcount));
+  right->hdr.count = INNER_MAX - lcount;
+
+  return keys[lcount];
+}
+
+
+int
+bptree_insert(bptree_t *t, uint64_t key, void *value)
+{
+  struct bptree_inner *path[BPT_MAXDEPTH], *parent;
+  struct bptree_node *n, *spare[BPT_MAXDEPTH + 1], *child;
+  struct bptree_leaf *leaf;
+  int idx[BPT_MAXDEPTH];
+  int depth = 0, nspare, d, pos;
+  uint64_t sep;
+
+  if (!t->root) {
+    t->root = node_new(1);
+    if (!t->root)
+      return -1;
+  }
+
+  for (n = t->root; !n->leaf; n = INNER(n)->child[idx[depth++]]) {
+    path[depth] = INNER(n);
+    idx[depth] = rank_le(INNER(n)->keys, n->count, key);
+  }
+  leaf = LEAF(n);
+  pos = rank_lt(leaf->keys, leaf->hdr.count, key);
+
+  if (pos < leaf->hdr.count && leaf->keys[pos] == key) {
+    leaf->values[pos] = value;
+    return 1;
+  }
+
+  if (leaf->hdr.count < LEAF_MAX) {
+    memmove(leaf->keys + pos + 1, leaf->keys + pos,
+            sizeof(*leaf->keys) * (leaf->hdr.count - pos));
+    memmove(leaf->values + pos + 1, leaf->values + pos,
+            sizeof(*leaf->values) * (leaf->hdr.count - pos));
+    leaf->keys[pos] = key;
+    leaf->values[pos] = value;
+    leaf->hdr.count++;
+    t->count++;
+    return 0;
+  }
+
+  /*
+   * The split goes up through the full ancestors, and may add a new
+   * root; allocate every node first, so that nothing changes on error.
+   */
+  nspare = 1;
+  for (d = depth - 1; d >= 0 && path[d]->hdr.count == INNER_MAX; d--)
+    nspare++;
+  if (d < 0)
+    nspare++;
+  for (d = 0; d < nspare; d++) {
+    spare[d] = node_new(d == 0);
+    if (!spare[d]) {
+      while (d-- > 0)
+        free(spare[d]);
+      return -1;
+    }
+  }
+
+  leaf_split(leaf, LEAF(spare[0]), pos, key, value);
+  sep = LEAF(spare[0])->keys[0];
+  child = spare[0];
+  nspare = 1;
+
+  while (depth > 0) {
+    parent = path[--depth];
+    pos = idx[depth];
+    if (parent->hdr.count < INNER_MAX) {
+      memmove(parent->keys + pos + 1, parent->keys + pos,
+              sizeof(*parent->keys) * (parent->hdr.count - pos));
+      memmove(parent->child + pos + 2, parent->child + pos + 1,
+              sizeof(*parent->child) * (parent->hdr.count - pos));
+      parent->keys[pos] = sep;
+      parent->child[pos + 1] = child;
+      parent->hdr.count++;
+      t->count++;
+      return 0;
+    }
+    sep = inner_split(parent, INNER(spare[nspare]), pos, sep, child);
+    child = spare[nspare++];
+  }
+
+  /* the root was split */
+  parent = INNER(spare[nspare]);
+  parent->keys[0] = sep;
+  parent->child[0] = t->root;
+  parent->child[1] = child;
+  parent->hdr.count = 1;
+  t->root = &parent->hdr;
+  t->count++;
+  return 0;
+}
+
+
+/*
+ * Refill the node at child index I of PARENT, which has one key too
+ * few, from a sibling, or merge it with one.  Returns nonzero if
+ * PARENT lost a key.
+ */
+static int
+rebalance(struct bptree_inner *parent, int i)
+{
+  struct bptree_node *n = parent->child[i], *left, *right;
+  int min = n->leaf ? LEAF_MIN : INNER_MIN;
+
+  left = i > 0 ? parent->child[i - 1] : NULL;
+  right = i < parent->hdr.count ? parent->child[i + 1] : NULL;
+
+  if (left && left->count > min) {
+    /* borrow the last entry of the left sibling */
+    if (n->leaf) {
+      memmove(LEAF(n)->keys + 1, LEAF(n)->keys,
+              sizeof(uint64_t) * n->count);
+      memmove(LEAF(n)->values + 1, LEAF(n)->values,
+              sizeof(void *) * n->count);
+      LEAF(n)->keys[0] = LEAF(left)->keys[left->count - 1];
+      LEAF(n)->values[0] = LEAF(left)->values[left->count - 1];
+      parent->keys[i - 1] = LEAF(n)->keys[0];
+    }
+    else {
+      memmove(INNER(n)->keys + 1, INNER(n)->keys,
+              sizeof(uint64_t) * n->count);
+      memmove(INNER(n)->child + 1, INNER(n)->child,
+              sizeof(void *) * (n->count + 1));
+      INNER(n)->keys[0] = parent->keys[i - 1];
+      INNER(n)->child[0] = INNER(left)->child[left->count];
+      parent->keys[i - 1] = INNER(left)->keys[left->count - 1];
+    }
+    left->count--;
+    n->count++;
+    return 0;
+  }
+
+  if (right && right->count > min) {
+    /* borrow the first entry of the right sibling */
+    if (n->leaf) {
+      LEAF(n)->keys[n->count] = LEAF(right)->keys[0];
+      LEAF(n)->values[n->count] = LEAF(right)->values[0];
+      memmove(LEAF(right)->keys, LEAF(right)->keys + 1,
+              sizeof(uint64_t) * (right->count - 1));
+      memmove(LEAF(right)->values, LEAF(right)->values + 1,
+              sizeof(void *) * (right->count - 1));
+      parent->keys[i] = LEAF(right)->keys[0];
+    }
+    else {
+      INNER(n)->keys[n->count] = parent->keys[i];
+      INNER(n)->child[n->count + 1] = INNER(right)->child[0];
+      parent->keys[i] = INNER(right)->keys[0];
+      memmove(INNER(right)->keys, INNER(right)->keys + 1,
+              sizeof(uint64_t) * (right->count - 1));
+      memmove(INNER(right)->child, INNER(right)->child + 1,
+              sizeof(void *) * right->count);
+    }
+    right->count--;
+    n->count++;
+    return 0;
+  }
+
+  /* merge child[i] and child[i + 1], moving the right one into the left */
+  if (left) {
+    right = n;
+    n = left;
+    i--;
+  }
+  if (n->leaf) {
+    memcpy(LEAF(n)->keys + n->count, LEAF(right)->keys,
+           sizeof(uint64_t) * right->count);
+    memcpy(LEAF(n)->values + n->count, LEAF(right)->values,
+           sizeof(void *) * right->count);
+    LEAF(n)->next = LEAF(right)->next;
+    n->count += right->count;
+  }
+  else {
+    INNER(n)->keys[n->count] = parent->keys[i];
+    memcpy(INNER(n)->keys + n->count + 1, INNER(right)->keys,
+           sizeof(uint64_t) * right->count);
+    memcpy(INNER(n)->child + n->count + 1, INNER(right)->child,
+           sizeof(void *) * (right->count + 1));
+    n->count += right->count + 1;
+  }
+  free(right);
+
+  memmove(parent->keys + i, parent->keys + i + 1,
+          sizeof(uint64_t) * (parent->hdr.count - i - 1));
+  memmove(parent->child + i + 1, parent->child + i + 2,
+          sizeof(void *) * (parent->hdr.count - i - 1));
+  parent->hdr.count--;
+  return 1;
+}
+
+
+int
+bptree_remove(bptree_t *t, uint64_t key, void **value)
+{
+  struct bptree_inner *path[BPT_MAXDEPTH];
+  struct bptree_node *n;
+  struct bptree_leaf *leaf;
+  int idx[BPT_MAXDEPTH];
+  int depth = 0, pos, min;
+
+  if (!t->root)
+    return -1;
+
+  for (n = t->root; !n->leaf; n = INNER(n)->child[idx[depth++]]) {
+    path[depth] = INNER(n);
+    idx[depth] = rank_le(INNER(n)->keys, n->count, key);
+  }
+  leaf = LEAF(n);
+  pos = rank_lt(leaf->keys, leaf->hdr.count, key);
+  if (pos == leaf->hdr.count || leaf->keys[pos] != key)
+    return -1;
+
+  if (value)
+    *value = leaf->values[pos];
+  memmove(leaf->keys + pos, leaf->keys + pos + 1,
+          sizeof(*leaf->keys) * (leaf->hdr.count - pos - 1));
+  memmove(leaf->values + pos, leaf->values + pos + 1,
+          sizeof(*leaf->values) * (leaf->hdr.count - pos - 1));
+  leaf->hdr.count--;
+  t->count--;
+
+  /*
+   * The separators above may still name the removed key; they remain
+   * valid bounds, so only an underflow needs any work.
+   */
+  min = LEAF_MIN;
+  while (depth > 0 && n->count < min) {
+    depth--;
+    if (!rebalance(path[depth], idx[depth]))
+      break;
+    n = &path[depth]->hdr;
+    min = INNER_MIN;
+  }
+
+  n = t->root;
+  if (n->count == 0) {
+    /* the root is an empty leaf, or an inner node with one child */
+    t->root = n->leaf ? NULL : INNER(n)->child[0];
+    free(n);
+  }
+  return 0;
+}
+
+
+/* Return the size of node I of N nodes that share TOTAL entries. */
+static long
+load_share(long i, long n, long total, long max, long min)
+{
+  long last = total - (n - 1) * max;
+
+  if (n > 1 && last < min) {
+    /* the last two nodes split the rest evenly */
+    if (i == n - 2)
+      return (max + last) / 2;
+    if (i == n - 1)
+      return (max + last + 1) / 2;
+  }
+  return i == n - 1 ? last : max;
+}
+
+
+int
+bptree_load(bptree_t *t, const uint64_t *keys, void *const *values,
+            long count)
+{
+  struct bptree_node **level, *n;
+  struct bptree_leaf *prev = NULL;
+  uint64_t *mins;
+  long nnodes, nparents, i, j, k, size;
+
+  if (t->root || count < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 1; i < count; i++)
+    if (keys[i - 1] >= keys[i]) {
+      errno = EINVAL;
+      return -1;
+    }
+  if (count == 0)
+    return 0;
+
+  nnodes = (count + LEAF_MAX - 1) / LEAF_MAX;
+  level = malloc(sizeof(*level) * nnodes);
+  mins = malloc(sizeof(*mins) * nnodes);
+  if (!level || !mins)
+    goto nomem;
+
+  for (i = k = 0; i < nnodes; i++) {
+    n = node_new(1);
+    if (!n) {
+      while (i-- > 0)
+        free(level[i]);
+      goto nomem;
+    }
+    size = load_share(i, nnodes, count, LEAF_MAX, LEAF_MIN);
+    memcpy(LEAF(n)->keys, keys + k, sizeof(*keys) * size);
+    if (values)
+      memcpy(LEAF(n)->values, values + k, sizeof(*values) * size);
+    else
+      memset(LEAF(n)->values, 0, sizeof(*values) * size);
+    n->count = size;
+    if (prev)
+      prev->next = LEAF(n);
+    prev = LEAF(n);
+    level[i] = n;
+    mins[i] = keys[k];
+    k += size;
+  }
+
+  /* Each level groups the nodes of the one below; level[] is reused. */
+  while (nnodes > 1) {
+    nparents = (nnodes + INNER_MAX) / (INNER_MAX + 1);
+    for (i = k = 0; i < nparents; i++) {
+      n = node_new(0);
+      if (!n) {
+        /* free the new subtrees, and the nodes not yet adopted */
+        for (j = 0; j < i; j++)
+          node_free(level[j]);
+        for (j = k; j < nnodes; j++)
+          node_free(level[j]);
+        goto nomem;
+      }
+      size = load_share(i, nparents, nnodes, INNER_MAX + 1, INNER_MIN + 1);
+      memcpy(INNER(n)->child, level + k, sizeof(*level) * size);
+      memcpy(INNER(n)->keys, mins + k + 1, sizeof(*mins) * (size - 1));
+      n->count = size - 1;
+      level[i] = n;
+      mins[i] = mins[k];
+      k += size;
+    }
+    nnodes = nparents;
+  }
+
+  t->root = level[0];
+  t->count = count;
+  free(level);
+  free(mins);
+  return 0;
+
+ nomem:
+  free(level);
+  free(mins);
+  errno = ENOMEM;
+  return -1;
+}
+
+
+void
+bptree_seek(const bptree_t *t, uint64_t key, bptree_iter_t *it)
+{
+  it->leaf = find_leaf(t, key);
+  it->pos = it->leaf ? rank_lt(it->leaf->keys, it->leaf->hdr.count, key) : 0;
+}
+
+
+void
+bptree_first(const bptree_t *t, bptree_iter_t *it)
+{
+  bptree_seek(t, 0, it);
+}
+
+
+int
+bptree_next(bptree_iter_t *it, uint64_t *key, void **value)
+{
+  struct bptree_leaf *leaf = it->leaf;
+
+  while (leaf && it->pos >= leaf->hdr.count) {
+    leaf = it->leaf = leaf->next;
+    it->pos = 0;
+  }
+  if (!leaf)
+    return -1;
+
+  if (key)
+    *key = leaf->keys[it->pos];
+  if (value)
+    *value = leaf->values[it->pos];
+  it->pos++;
+  return 0;
+}
+
+
+long
+bptree_count(const bptree_t *t)
+{
+  return t->count;
+}
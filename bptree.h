@@ -0,0 +1,149 @@
+#ifndef BPTREE_H__
+#define BPTREE_H__
+
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * Copyright (C) 2014 Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * Everyone is permitted to copy and distribute verbatim or modified
+ * copies of this license document, and changing it is allowed as long
+ * as the name is changed.
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ * This program is free software. It comes without any warranty, to the
+ * extent permitted by applicable law. You can redistribute it and/or
+ * modify it under the terms of the Do What The Fuck You Want To Public
+ * License, Version 2, as published by Sam Hocevar. See
+ * http://www.wtfpl.net/ for more details.
+ */
+
+#include <stdint.h>
+
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * bptree -- B+tree ordered map from uint64_t keys to pointers.
+ *
+ * rbtree.h keeps one key per node, so a lookup follows a pointer, and
+ * likely misses the cache, for every level of a tree some 2 * log2(n)
+ * deep, and rb_next() walks up and down the tree between neighbors.
+ * A bptree node is BPTREE_NODE_SIZE bytes, a few cache lines aligned
+ * to a cache line, and holds up to 15 keys, so a tree of ten million
+ * keys is only 6 or 7 levels deep.  All the entries are in the leaves,
+ * and each leaf links to the next one, so a range scan reads the keys
+ * in order from consecutive slots of a few nodes.
+ *
+ *   bptree_t *t = bptree_new();
+ *   bptree_insert(t, key, value);
+ *   if (bptree_find(t, key, &value) == 0)
+ *     ...
+ *
+ *   bptree_iter_t it;
+ *   bptree_seek(t, lo, &it);          -- iterate over [lo, hi)
+ *   while (bptree_next(&it, &key, &value) == 0 && key < hi)
+ *     ...
+ *
+ * bptree_load() builds a tree from sorted input in O(n), with full
+ * leaves, which is much faster than n insertions.
+ *
+ * Keys of another type can be mapped to a uint64_t that keeps their
+ * order (e.g. a timestamp, or the first 8 bytes of a string in big
+ * endian, with the value pointing to the rest).  A bptree_t is not
+ * thread-safe.
+ */
+
+#define BPTREE_NODE_SIZE        256
+
+struct bptree;
+typedef struct bptree bptree_t;
+
+struct bptree_leaf;
+
+/*
+ * An iterator stays valid only as long as the tree is not modified.
+ */
+typedef struct {
+  struct bptree_leaf *leaf;
+  int pos;
+} bptree_iter_t;
+
+/*
+ * Create an empty tree.  Returns NULL on error.
+ */
+extern bptree_t *bptree_new(void);
+
+/*
+ * Delete T.  The values are not released.
+ */
+extern void bptree_delete(bptree_t *t);
+
+/*
+ * Map KEY to VALUE.  Returns zero if KEY was added, 1 if KEY was
+ * already in T and its value was replaced, or -1 if out of memory.
+ */
+extern int bptree_insert(bptree_t *t, uint64_t key, void *value);
+
+/*
+ * Find KEY, and store its value to *VALUE unless VALUE is NULL.
+ * Returns zero if found, -1 otherwise.
+ */
+extern int bptree_find(const bptree_t *t, uint64_t key, void **value);
+
+/*
+ * Remove KEY, and store its value to *VALUE unless VALUE is NULL.
+ * Returns zero if KEY was removed, -1 if it was not in T.
+ */
+extern int bptree_remove(bptree_t *t, uint64_t key, void **value);
+
+/*
+ * Load COUNT entries into the empty tree T.  KEYS must be strictly
+ * ascending; VALUES may be NULL to map every key to NULL.  Returns
+ * zero on success, or -1 with errno set to EINVAL if T was not empty
+ * or the keys were not ascending, or to ENOMEM.  On error T is left
+ * empty.
+ */
+extern int bptree_load(bptree_t *t, const uint64_t *keys,
+                       void *const *values, long count);
+
+/*
+ * Position IT on the first key that is not less than KEY.
+ */
+extern void bptree_seek(const bptree_t *t, uint64_t key, bptree_iter_t *it);
+
+/*
+ * Position IT on the first key of T.
+ */
+extern void bptree_first(const bptree_t *t, bptree_iter_t *it);
+
+/*
+ * Store the key and the value at IT to *KEY and *VALUE, either of
+ * which may be NULL, and move IT to the next key.  Returns zero on
+ * success, or -1 if IT was past the last key.
+ */
+extern int bptree_next(bptree_iter_t *it, uint64_t *key, void **value);
+
+/*
+ * Return the number of keys in T.
+ */
+extern long bptree_count(const bptree_t *t);
+
+END_C_DECLS
+
+#endif  /* BPTREE_H__ */
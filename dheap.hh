@@ -0,0 +1,144 @@
+#ifndef DHEAP_HH__
+#define DHEAP_HH__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+
+//
+// dheap is the C++ counterpart of DHEAP_DECL_TYPE in heap.h: a d-ary
+// heap that keeps the elements inline in one 64-byte aligned array,
+// with the children of a node starting at a multiple of D elements.
+// When sizeof(T) * D is 64, the children of a node share one cache
+// line.
+//
+// Like std::priority_queue (and heap.h), the greatest element with
+// respect to COMPARE is on the top; use std::greater<T> for a
+// min-heap:
+//
+//   struct timer { uint64_t deadline; void *data; };
+//   struct timer_later {
+//     bool operator()(const timer &a, const timer &b) const
+//     { return a.deadline > b.deadline; }
+//   };
+//
+//   dheap<timer, 4, timer_later> heap;
+//   heap.push(t);
+//   while (!heap.empty() && heap.top().deadline <= now) {
+//     fire(heap.top());
+//     heap.pop();
+//   }
+//
+// T must be default constructible, since the array keeps D - 1 unused
+// slots in front of the root.
+//
+
+template <class T>
+struct dheap_allocator {
+  typedef T value_type;
+
+  dheap_allocator() {}
+  template <class U> dheap_allocator(const dheap_allocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    void *p;
+    if (posix_memalign(&p, 64, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, std::size_t) { free(p); }
+
+  template <class U> bool operator==(const dheap_allocator<U> &) const
+  { return true; }
+  template <class U> bool operator!=(const dheap_allocator<U> &) const
+  { return false; }
+};
+
+
+template <class T, unsigned D = 4, class Compare = std::less<T> >
+class dheap {
+  static_assert(D >= 2, "arity must be at least 2");
+
+  // The root is at body_[D - 1]; element i is at body_[i + D - 1].
+  std::vector<T, dheap_allocator<T> > body_;
+  Compare cmp_;
+
+  T &at(std::size_t i) { return body_[i + D - 1]; }
+
+  void sift_up(std::size_t i, T elem) {
+    while (i > 0) {
+      std::size_t parent = (i - 1) / D;
+      if (!cmp_(at(parent), elem))
+        break;
+      at(i) = std::move(at(parent));
+      i = parent;
+    }
+    at(i) = std::move(elem);
+  }
+
+  void sift_down(std::size_t i, T elem) {
+    std::size_t n = size();
+
+    while (true) {
+      std::size_t child = i * D + 1;
+      if (child >= n)
+        break;
+
+      std::size_t lim = child + D < n ? child + D : n;
+      std::size_t best = child;
+      for (std::size_t k = child + 1; k < lim; k++)
+        if (cmp_(at(best), at(k)))
+          best = k;
+
+      if (!cmp_(elem, at(best)))
+        break;
+      if (best * D + 1 < n)
+        __builtin_prefetch(&at(best * D + 1));
+      at(i) = std::move(at(best));
+      i = best;
+    }
+    at(i) = std::move(elem);
+  }
+
+public:
+  typedef T value_type;
+  typedef std::size_t size_type;
+
+  explicit dheap(const Compare &cmp = Compare())
+    : body_(D - 1), cmp_(cmp) {}
+
+  bool empty() const { return body_.size() == D - 1; }
+  size_type size() const { return body_.size() - (D - 1); }
+
+  void reserve(size_type n) { body_.reserve(n + D - 1); }
+  void clear() { body_.resize(D - 1); }
+
+  const T &top() const { return body_[D - 1]; }
+
+  void push(const T &elem) {
+    body_.push_back(elem);
+    T e = std::move(body_.back());
+    sift_up(size() - 1, std::move(e));
+  }
+
+  void pop() {
+    T last = std::move(body_.back());
+    body_.pop_back();
+    if (!empty())
+      sift_down(0, std::move(last));
+  }
+
+  // Move the top to ELEM and pop it; returns false if empty.
+  bool pop(T &elem) {
+    if (empty())
+      return false;
+    elem = std::move(at(0));
+    pop();
+    return true;
+  }
+};
+
+#endif  // DHEAP_HH__
@@ -340,6 +340,29 @@ edque_pop_front(struct elist *ht)
   return p;
 }
 
+
+/*
+ * Move all nodes in the deque OTHER to the back of the deque HT.
+ * OTHER becomes empty.
+ */
+static __inline__ void
+edque_splice_back(struct elist *ht, struct elist *other)
+{
+  if (!EDQUE_HEAD(other))
+    return;
+
+  if (EDQUE_TAIL(ht)) {
+    EDQUE_TAIL(ht)->next = EDQUE_HEAD(other);
+    EDQUE_HEAD(other)->prev = EDQUE_TAIL(ht);
+    EDQUE_TAIL(ht) = EDQUE_TAIL(other);
+  }
+  else {
+    EDQUE_HEAD(ht) = EDQUE_HEAD(other);
+    EDQUE_TAIL(ht) = EDQUE_TAIL(other);
+  }
+  EDQUE_HEAD(other) = EDQUE_TAIL(other) = 0;
+}
+
 #undef EDQUE_HEAD
 #undef EDQUE_TAIL
 
@@ -24,6 +24,9 @@
  * http://www.wtfpl.net/ for more details.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #define HEAP_DECL_TYPE(elem_type, name)         \
   typedef struct {                              \
     elem_type **body;                           \
@@ -52,6 +55,7 @@
 #define HEAP_MAKE_ROOM_(heap, result)                           \
   do {                                                          \
     void *p;                                                    \
+    (result) = 1;                                               \
     if (!(heap)->body || (heap)->end >= (heap)->size) {         \
       p = realloc((heap)->body,                                 \
                   (heap)->size * 2  * sizeof((heap)->body[0])); \
@@ -143,4 +147,477 @@
          result; })
 #endif  /* __GNUC__ */
 
+/*
+ * DHEAP -- d-ary heap with the elements stored inline.
+ *
+ * HEAP_DECL_TYPE keeps pointers, so every comparison dereferences a
+ * pointer to some other cache line.  DHEAP keeps the elements
+ * themselves in one contiguous array, and each node has ARITY
+ * children instead of two, so the heap is shallower and all children
+ * of a node are compared in one sequential run.
+ *
+ * The array is 64-byte aligned and shifted by ARITY - 1 slots, so the
+ * children of a node always start at a multiple of ARITY elements.
+ * When sizeof(elem_type) * ARITY is 64 (e.g. 16-byte elements in a
+ * 4-ary heap, 8-byte elements in an 8-ary heap), the children of a
+ * node fill exactly one cache line.
+ *
+ * As with HEAP_DECL_TYPE, the element that compares greatest with
+ * TYPE_cmp(x, y) is on the top.  TYPE_cmp() takes pointers to two
+ * elements.  For example, a min-heap of timers:
+ *
+ *   struct timer { uint64_t deadline; void *data; };
+ *   DHEAP_DECL_TYPE(struct timer, timerheap_t, 4);
+ *   #define timerheap_t_cmp(x, y)  \
+ *     (((y)->deadline > (x)->deadline) - ((y)->deadline < (x)->deadline))
+ *
+ *   timerheap_t heap = DHEAP_INITIALIZER(1024);
+ *   struct timer t = { deadline, data };
+ *
+ *   if (DHEAP_INSERT(timerheap_t, &heap, t) != 0)
+ *     ... out of memory ...
+ *   while (DHEAP_POP(timerheap_t, &heap, &t))
+ *     ...
+ *   DHEAP_FREE(timerheap_t, &heap);
+ *
+ * Elements are copied in and out by assignment.  The macros need
+ * GCC's __typeof__, and do not share any temporary in the heap, so
+ * two threads may work on two different heaps of the same type.
+ */
+#define DHEAP_DECL_TYPE(elem_type, name, arity) \
+  typedef struct {                              \
+    elem_type *body;                            \
+    int end;                                    \
+    size_t size;                                \
+  } name;                                       \
+  enum { name##_arity = (arity) }
+
+/* SIZE is the initial capacity; zero means 64. */
+#define DHEAP_INITIALIZER(size)         { 0, 0, (size) }
+
+#define DHEAP_PARENT(type, x)   (((x) - 1) / type##_arity)
+#define DHEAP_CHILD(type, x)    ((x) * type##_arity + 1)
+
+#define DHEAP_COUNT(heap)       ((heap)->end)
+#define DHEAP_TOP(heap)         ((heap)->end > 0 ? &(heap)->body[0] : 0)
+
+#define DHEAP_FREE(type, heap)                          \
+        do {                                            \
+          if ((heap)->body)                             \
+            free((heap)->body - (type##_arity - 1));    \
+          (heap)->body = 0;                             \
+          (heap)->end = 0;                              \
+          (heap)->size = 0;                             \
+        } while (0)
+
+#define DHEAP_MAKE_ROOM_(type, heap, result)                            \
+  do {                                                                  \
+    void *dh_mem_;                                                      \
+    size_t dh_size_;                                                    \
+    (result) = 1;                                                       \
+    if (!(heap)->body || (heap)->end >= (heap)->size) {                 \
+      dh_size_ = (heap)->size ? (heap)->size : 64;                      \
+      if ((heap)->body)                                                 \
+        dh_size_ *= 2;                                                  \
+      if (posix_memalign(&dh_mem_, 64, (dh_size_ + type##_arity - 1) *  \
+                         sizeof((heap)->body[0])) == 0) {               \
+        if ((heap)->body) {                                             \
+          memcpy((char *)dh_mem_ +                                      \
+                 (type##_arity - 1) * sizeof((heap)->body[0]),          \
+                 (heap)->body, (heap)->end * sizeof((heap)->body[0]));  \
+          free((heap)->body - (type##_arity - 1));                      \
+        }                                                               \
+        (heap)->body = (__typeof__((heap)->body))dh_mem_ +              \
+          (type##_arity - 1);                                           \
+        (heap)->size = dh_size_;                                        \
+      }                                                                 \
+      else                                                              \
+        (result) = 0;                                                   \
+    }                                                                   \
+  } while (0)
+
+/* Move the hole at INDEX up until ELEM fits, and store ELEM there. */
+#define DHEAP_SIFT_UP_(type, heap, index, elem)                         \
+  do {                                                                  \
+    int dh_i_ = (index);                                                \
+    while (dh_i_ > 0) {                                                 \
+      int dh_parent_ = DHEAP_PARENT(type, dh_i_);                       \
+      if (type##_cmp(&(heap)->body[dh_parent_], &(elem)) < 0) {         \
+        (heap)->body[dh_i_] = (heap)->body[dh_parent_];                 \
+        dh_i_ = dh_parent_;                                             \
+      }                                                                 \
+      else break;                                                       \
+    }                                                                   \
+    (heap)->body[dh_i_] = (elem);                                       \
+  } while (0)
+
+/* Move the hole at INDEX down until ELEM fits, and store ELEM there. */
+#define DHEAP_SIFT_DOWN_(type, heap, index, elem)                       \
+  do {                                                                  \
+    int dh_i_ = (index);                                                \
+    while (1) {                                                         \
+      int dh_child_ = DHEAP_CHILD(type, dh_i_);                         \
+      int dh_best_, dh_k_, dh_lim_;                                     \
+                                                                        \
+      if (dh_child_ >= (heap)->end)                                     \
+        break;                                                          \
+      dh_lim_ = dh_child_ + type##_arity;                               \
+      if (dh_lim_ > (heap)->end)                                        \
+        dh_lim_ = (heap)->end;                                          \
+      dh_best_ = dh_child_;                                             \
+      for (dh_k_ = dh_child_ + 1; dh_k_ < dh_lim_; dh_k_++)             \
+        if (type##_cmp(&(heap)->body[dh_best_],                         \
+                       &(heap)->body[dh_k_]) < 0)                       \
+          dh_best_ = dh_k_;                                             \
+      if (type##_cmp(&(elem), &(heap)->body[dh_best_]) >= 0)            \
+        break;                                                          \
+      __builtin_prefetch(&(heap)->body[DHEAP_CHILD(type, dh_best_)]);   \
+      (heap)->body[dh_i_] = (heap)->body[dh_best_];                     \
+      dh_i_ = dh_best_;                                                 \
+    }                                                                   \
+    (heap)->body[dh_i_] = (elem);                                       \
+  } while (0)
+
+/* RESULT is zero on success, nonzero if out of memory. */
+#define DHEAP_INSERT_(type, heap, elem, result)                 \
+    do {                                                        \
+      int dh_success_;                                          \
+      __typeof__((heap)->body[0]) dh_elem_ = (elem);            \
+      DHEAP_MAKE_ROOM_(type, heap, dh_success_);                \
+      if (dh_success_) {                                        \
+        (heap)->end++;                                          \
+        DHEAP_SIFT_UP_(type, heap, (heap)->end - 1, dh_elem_);  \
+      }                                                         \
+      (result) = !dh_success_;                                  \
+    } while (0)
+
+/* Pop the top to *ELEMP.  RESULT is 1 if popped, 0 if HEAP was empty. */
+#define DHEAP_POP_(type, heap, elemp, result)                           \
+    do {                                                                \
+      (result) = 0;                                                     \
+      if ((heap)->end > 0) {                                            \
+        __typeof__((heap)->body[0]) dh_last_;                           \
+        *(elemp) = (heap)->body[0];                                     \
+        dh_last_ = (heap)->body[--(heap)->end];                         \
+        if ((heap)->end > 0)                                            \
+          DHEAP_SIFT_DOWN_(type, heap, 0, dh_last_);                    \
+        (result) = 1;                                                   \
+      }                                                                 \
+    } while (0)
+
+#ifdef __GNUC__
+#define DHEAP_INSERT(type, heap, elem)                  \
+    ({                                                  \
+      int result;                                       \
+      DHEAP_INSERT_(type, heap, elem, result);          \
+      result; })
+
+#define DHEAP_POP(type, heap, elemp)                    \
+    ({                                                  \
+      int result;                                       \
+      DHEAP_POP_(type, heap, elemp, result);            \
+      result; })
+#endif  /* __GNUC__ */
+
+/*
+ * IHEAP -- indexed d-ary heap.
+ *
+ * IHEAP keeps pointers, like HEAP_DECL_TYPE, but every element also
+ * records its own position in the heap.  With that, an element can be
+ * removed, or re-sorted after its key changed, in O(log n) without
+ * searching for it, which is what cancelling or rescheduling a timer
+ * needs.  The element is its own handle.
+ *
+ * Besides TYPE_cmp(x, y), define TYPE_index(x) as an lvalue of type
+ * int in the element.  IHEAP sets it to the position of the element,
+ * or to -1 once the element leaves the heap.  Initialize it to -1 for
+ * IHEAP_REMOVE() and IHEAP_UPDATE() to recognize an element that was
+ * never inserted.
+ *
+ *   struct timer { uint64_t deadline; int pos; ... };
+ *   IHEAP_DECL_TYPE(struct timer, timerq_t, 4);
+ *   #define timerq_t_cmp(x, y)     ...smaller deadline is greater...
+ *   #define timerq_t_index(x)      ((x)->pos)
+ *
+ *   timerq_t q = IHEAP_INITIALIZER(1024);
+ *
+ *   IHEAP_INSERT(timerq_t, &q, t);
+ *   t->deadline = later;
+ *   IHEAP_UPDATE(timerq_t, &q, t);         -- reschedule
+ *   IHEAP_REMOVE(timerq_t, &q, t);         -- cancel
+ *
+ *   struct timer now_ = { now }, *expired[64];
+ *   n = IHEAP_POP_N(timerq_t, &q, &now_, expired, 64);
+ *
+ * IHEAP_HEAPIFY() adds COUNT elements at once and restores the order
+ * in O(n + COUNT), instead of O(COUNT log n) with IHEAP_INSERT().
+ *
+ * IHEAP_POP_N() pops up to MAX elements that compare greater than or
+ * equal to BOUND, that is, all the expired timers when BOUND holds the
+ * current time.  They form a subtree at the root, which is collected
+ * breadth-first in OUT, in no particular order; sort OUT if the order
+ * matters.  If they are a large share of the heap, the rest is
+ * compacted and heapified in one O(n) pass instead of removing them
+ * one by one.
+ */
+#define IHEAP_DECL_TYPE(elem_type, name, arity) \
+  typedef struct {                              \
+    elem_type **body;                           \
+    int end;                                    \
+    size_t size;                                \
+  } name;                                       \
+  enum { name##_arity = (arity) }
+
+/* SIZE is the initial capacity; zero means 64. */
+#define IHEAP_INITIALIZER(size)         { 0, 0, (size) }
+
+#define IHEAP_COUNT(heap)       ((heap)->end)
+#define IHEAP_TOP(heap)         ((heap)->end > 0 ? (heap)->body[0] : 0)
+
+#define IHEAP_FREE(heap)                        \
+        do {                                    \
+          if ((heap)->body)                     \
+            free((heap)->body);                 \
+          (heap)->body = 0;                     \
+          (heap)->end = 0;                      \
+          (heap)->size = 0;                     \
+        } while (0)
+
+/* Make room for COUNT more elements. */
+#define IHEAP_MAKE_ROOM_(heap, count, result)                           \
+  do {                                                                  \
+    void *ihm_p_;                                                       \
+    size_t ihm_size_;                                                   \
+    (result) = 1;                                                       \
+    if (!(heap)->body || (heap)->end + (size_t)(count) > (heap)->size) { \
+      ihm_size_ = (heap)->size ? (heap)->size : 64;                     \
+      while ((heap)->end + (size_t)(count) > ihm_size_)                 \
+        ihm_size_ *= 2;                                                 \
+      ihm_p_ = realloc((heap)->body, ihm_size_ * sizeof((heap)->body[0])); \
+      if (ihm_p_) {                                                     \
+        (heap)->body = ihm_p_;                                          \
+        (heap)->size = ihm_size_;                                       \
+      }                                                                 \
+      else                                                              \
+        (result) = 0;                                                   \
+    }                                                                   \
+  } while (0)
+
+#define IHEAP_SET_(type, heap, i, elemp)        \
+  do {                                          \
+    (heap)->body[i] = (elemp);                  \
+    type##_index((elemp)) = (i);                \
+  } while (0)
+
+#define IHEAP_SIFT_UP_(type, heap, index)                               \
+  do {                                                                  \
+    int ihu_i_ = (index);                                               \
+    __typeof__((heap)->body[0]) ihu_e_ = (heap)->body[ihu_i_];          \
+    while (ihu_i_ > 0) {                                                \
+      int ihu_parent_ = DHEAP_PARENT(type, ihu_i_);                     \
+      if (type##_cmp((heap)->body[ihu_parent_], ihu_e_) < 0) {          \
+        IHEAP_SET_(type, heap, ihu_i_, (heap)->body[ihu_parent_]);      \
+        ihu_i_ = ihu_parent_;                                           \
+      }                                                                 \
+      else break;                                                       \
+    }                                                                   \
+    IHEAP_SET_(type, heap, ihu_i_, ihu_e_);                             \
+  } while (0)
+
+#define IHEAP_SIFT_DOWN_(type, heap, index)                             \
+  do {                                                                  \
+    int ihd_i_ = (index);                                               \
+    __typeof__((heap)->body[0]) ihd_e_ = (heap)->body[ihd_i_];          \
+    while (1) {                                                         \
+      int ihd_child_ = DHEAP_CHILD(type, ihd_i_);                       \
+      int ihd_best_, ihd_k_, ihd_lim_;                                  \
+                                                                        \
+      if (ihd_child_ >= (heap)->end)                                    \
+        break;                                                          \
+      ihd_lim_ = ihd_child_ + type##_arity;                             \
+      if (ihd_lim_ > (heap)->end)                                       \
+        ihd_lim_ = (heap)->end;                                         \
+      ihd_best_ = ihd_child_;                                           \
+      for (ihd_k_ = ihd_child_ + 1; ihd_k_ < ihd_lim_; ihd_k_++)        \
+        if (type##_cmp((heap)->body[ihd_best_], (heap)->body[ihd_k_]) < 0) \
+          ihd_best_ = ihd_k_;                                           \
+      if (type##_cmp(ihd_e_, (heap)->body[ihd_best_]) >= 0)             \
+        break;                                                          \
+      IHEAP_SET_(type, heap, ihd_i_, (heap)->body[ihd_best_]);          \
+      ihd_i_ = ihd_best_;                                               \
+    }                                                                   \
+    IHEAP_SET_(type, heap, ihd_i_, ihd_e_);                             \
+  } while (0)
+
+/* Restore the order around INDEX, whichever way its key moved. */
+#define IHEAP_FIX_(type, heap, index)                                   \
+  do {                                                                  \
+    int ihx_i_ = (index);                                               \
+    if (ihx_i_ > 0 &&                                                   \
+        type##_cmp((heap)->body[DHEAP_PARENT(type, ihx_i_)],            \
+                   (heap)->body[ihx_i_]) < 0)                           \
+      IHEAP_SIFT_UP_(type, heap, ihx_i_);                               \
+    else                                                                \
+      IHEAP_SIFT_DOWN_(type, heap, ihx_i_);                             \
+  } while (0)
+
+/* RESULT is zero on success, nonzero if out of memory. */
+#define IHEAP_INSERT_(type, heap, elemp, result)                \
+  do {                                                          \
+    int ihi_success_;                                           \
+    IHEAP_MAKE_ROOM_(heap, 1, ihi_success_);                    \
+    if (ihi_success_) {                                         \
+      IHEAP_SET_(type, heap, (heap)->end, (elemp));             \
+      (heap)->end++;                                            \
+      IHEAP_SIFT_UP_(type, heap, (heap)->end - 1);              \
+    }                                                           \
+    (result) = !ihi_success_;                                   \
+  } while (0)
+
+/* Remove the element at INDEX, which must be valid. */
+#define IHEAP_REMOVE_AT_(type, heap, index)                             \
+  do {                                                                  \
+    int ihr_i_ = (index);                                               \
+    type##_index((heap)->body[ihr_i_]) = -1;                            \
+    if (ihr_i_ != --(heap)->end) {                                      \
+      IHEAP_SET_(type, heap, ihr_i_, (heap)->body[(heap)->end]);        \
+      IHEAP_FIX_(type, heap, ihr_i_);                                   \
+    }                                                                   \
+  } while (0)
+
+/* RESULT is the top element, or 0 if HEAP was empty. */
+#define IHEAP_POP_(type, heap, result)                                  \
+  do {                                                                  \
+    (result) = IHEAP_TOP(heap);                                         \
+    if (result)                                                         \
+      IHEAP_REMOVE_AT_(type, heap, 0);                                  \
+  } while (0)
+
+/* RESULT is zero on success, -1 if ELEMP is not in HEAP. */
+#define IHEAP_REMOVE_(type, heap, elemp, result)                        \
+  do {                                                                  \
+    int ihr_pos_ = type##_index((elemp));                               \
+    if (ihr_pos_ >= 0 && ihr_pos_ < (heap)->end &&                      \
+        (heap)->body[ihr_pos_] == (elemp)) {                            \
+      IHEAP_REMOVE_AT_(type, heap, ihr_pos_);                           \
+      (result) = 0;                                                     \
+    }                                                                   \
+    else                                                                \
+      (result) = -1;                                                    \
+  } while (0)
+
+/* RESULT is zero on success, -1 if ELEMP is not in HEAP. */
+#define IHEAP_UPDATE_(type, heap, elemp, result)                        \
+  do {                                                                  \
+    int ihx_pos_ = type##_index((elemp));                               \
+    if (ihx_pos_ >= 0 && ihx_pos_ < (heap)->end &&                      \
+        (heap)->body[ihx_pos_] == (elemp)) {                            \
+      IHEAP_FIX_(type, heap, ihx_pos_);                                 \
+      (result) = 0;                                                     \
+    }                                                                   \
+    else                                                                \
+      (result) = -1;                                                    \
+  } while (0)
+
+/* Re-establish the heap order over the whole array, bottom-up. */
+#define IHEAP_BUILD_(type, heap)                                        \
+  do {                                                                  \
+    int ihb_i_;                                                         \
+    if ((heap)->end > 1)                                                \
+      for (ihb_i_ = DHEAP_PARENT(type, (heap)->end - 1); ihb_i_ >= 0;   \
+           ihb_i_--)                                                    \
+        IHEAP_SIFT_DOWN_(type, heap, ihb_i_);                           \
+  } while (0)
+
+/* RESULT is zero on success, nonzero if out of memory. */
+#define IHEAP_HEAPIFY_(type, heap, elems, count, result)                \
+  do {                                                                  \
+    int ihh_success_;                                                   \
+    size_t ihh_k_;                                                      \
+    IHEAP_MAKE_ROOM_(heap, count, ihh_success_);                        \
+    if (ihh_success_) {                                                 \
+      for (ihh_k_ = 0; ihh_k_ < (size_t)(count); ihh_k_++) {            \
+        IHEAP_SET_(type, heap, (heap)->end, (elems)[ihh_k_]);           \
+        (heap)->end++;                                                  \
+      }                                                                 \
+      IHEAP_BUILD_(type, heap);                                         \
+    }                                                                   \
+    (result) = !ihh_success_;                                           \
+  } while (0)
+
+/* RESULT is the number of elements popped to OUT. */
+#define IHEAP_POP_N_(type, heap, bound, out, max, result)               \
+  do {                                                                  \
+    int ihn_n_ = 0, ihn_j_, ihn_c_, ihn_lim_, ihn_w_, ihn_r_;           \
+                                                                        \
+    if ((max) > 0 && (heap)->end > 0 &&                                 \
+        type##_cmp((heap)->body[0], (bound)) >= 0)                      \
+      (out)[ihn_n_++] = (heap)->body[0];                                \
+    /* breadth-first over the qualifying subtree, OUT as the queue */   \
+    for (ihn_j_ = 0; ihn_j_ < ihn_n_; ihn_j_++) {                       \
+      ihn_c_ = DHEAP_CHILD(type, type##_index((out)[ihn_j_]));          \
+      ihn_lim_ = ihn_c_ + type##_arity;                                 \
+      if (ihn_lim_ > (heap)->end)                                       \
+        ihn_lim_ = (heap)->end;                                         \
+      for (; ihn_c_ < ihn_lim_ && ihn_n_ < (max); ihn_c_++)             \
+        if (type##_cmp((heap)->body[ihn_c_], (bound)) >= 0)             \
+          (out)[ihn_n_++] = (heap)->body[ihn_c_];                       \
+    }                                                                   \
+                                                                        \
+    if (ihn_n_ > (heap)->end / 8) {                                     \
+      /* compact the rest, then heapify it in one pass */               \
+      for (ihn_j_ = 0; ihn_j_ < ihn_n_; ihn_j_++)                       \
+        type##_index((out)[ihn_j_]) = -1;                               \
+      for (ihn_r_ = ihn_w_ = 0; ihn_r_ < (heap)->end; ihn_r_++)         \
+        if (type##_index((heap)->body[ihn_r_]) >= 0) {                  \
+          IHEAP_SET_(type, heap, ihn_w_, (heap)->body[ihn_r_]);         \
+          ihn_w_++;                                                     \
+        }                                                               \
+      (heap)->end = ihn_w_;                                             \
+      IHEAP_BUILD_(type, heap);                                         \
+    }                                                                   \
+    else                                                                \
+      /* deepest first, so that fewer of them move */                   \
+      for (ihn_j_ = ihn_n_ - 1; ihn_j_ >= 0; ihn_j_--)                  \
+        IHEAP_REMOVE_AT_(type, heap, type##_index((out)[ihn_j_]));      \
+    (result) = ihn_n_;                                                  \
+  } while (0)
+
+#ifdef __GNUC__
+#define IHEAP_INSERT(type, heap, elemp)                 \
+    ({                                                  \
+      int result;                                       \
+      IHEAP_INSERT_(type, heap, elemp, result);         \
+      result; })
+
+#define IHEAP_POP(type, heap)                           \
+    ({ __typeof__((heap)->body[0]) result;              \
+       IHEAP_POP_(type, heap, result);                  \
+       result; })
+
+#define IHEAP_REMOVE(type, heap, elemp)                 \
+    ({                                                  \
+      int result;                                       \
+      IHEAP_REMOVE_(type, heap, elemp, result);         \
+      result; })
+
+#define IHEAP_UPDATE(type, heap, elemp)                 \
+    ({                                                  \
+      int result;                                       \
+      IHEAP_UPDATE_(type, heap, elemp, result);         \
+      result; })
+
+#define IHEAP_HEAPIFY(type, heap, elems, count)         \
+    ({                                                  \
+      int result;                                       \
+      IHEAP_HEAPIFY_(type, heap, elems, count, result); \
+      result; })
+
+#define IHEAP_POP_N(type, heap, bound, out, max)                \
+    ({                                                          \
+      int result;                                               \
+      IHEAP_POP_N_(type, heap, bound, out, max, result);        \
+      result; })
+#endif  /* __GNUC__ */
+
 #endif  /* HEAP_H__ */
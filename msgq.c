@@ -23,13 +23,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <linux/futex.h>
 
 #include <error.h>
 
@@ -38,6 +47,8 @@
 #include "msgq.h"
 #include "elist.h"
 #ifdef MSGQ_BROADCAST
+#include <fnmatch.h>
+#include <sys/inotify.h>
 #include "sglob.h"
 #endif  /* MSGQ_BROADCAST */
 
@@ -47,23 +58,77 @@
 
 #define sizeof_packet(packet)   (sizeof(*(packet)) + (packet)->size)
 
+/* Maximum number of packets per sendmmsg(2)/recvmmsg(2) */
+#define MSGQ_BATCH      32
+
 /*
  * All received message is packaged in struct msgq_node.  This struct
- * provides 'link' so that each struct can be wired in a doubly linked list
+ * provides 'link' so that each struct can be wired in the receive queue.
  * Users cannot see this struct -- users can see only the 'packet' member,
  * which is struct msgq_packet instance.
  *
- * Both struct msgq_node instance and its packet member are
- * dynamically allocated.  Once the users got the message (e.g. using
+ * struct msgq_node instance and its packet are allocated in one
+ * block, which comes from the packet pool of the MSGQ (see struct
+ * msgq_pool).  Once the users got the message (e.g. using
  * msgq_recv()), We do not keep a pointer to struct msgq_node
  * instance.  Instead, the 'container' member of the struct
  * msgq_packet('packet') will point the enclosing struct msgq_node.
  * See the source of msgq_pkt_delete() for more.
  */
+struct msgq_link {
+  struct msgq_link *next;
+};
+
 struct msgq_node {
-  struct elist link;            /* for the doubly linked list */
+  struct msgq_link link;        /* for the receive queue */
   char sender[UNIX_PATH_MAX];   /* sender address for 'packet */
   struct msgq_packet *packet;   /* the actual message */
+  uint64_t stamp;               /* CLOCK_MONOTONIC ns of enqueueing */
+
+  struct msgq_pool *pool;       /* owner pool, or NULL if malloc'ed */
+  int cls;                      /* size class in 'pool' */
+  struct msgq_node *next;       /* next free node in the pool */
+};
+
+
+/*
+ * Packet pool
+ *
+ * The receiver thread (or the reactor loop serving the MSGQ) allocates
+ * every node, and the consumer threads release them via
+ * msgq_pkt_delete().  Nodes are kept in power-of-two
+ * size classes, from 1 << MSGQ_POOL_SHIFT bytes up.  Each class has
+ * two free lists:
+ *
+ *  - 'freed' is a lock-free stack where msgq_pkt_delete() pushes
+ *    nodes.  Only the receiver pops from it, and it takes the whole
+ *    stack with one exchange, so there is no ABA problem.
+ *
+ *  - 'local' is owned by the receiver, which allocates from it
+ *    without any atomic operation.
+ *
+ * Packets may be deleted after msgq_close(), so the pool counts the
+ * MSGQ and every outstanding pooled packet in 'refs'.  The last one
+ * frees the pool.
+ */
+#define MSGQ_POOL_SHIFT         8
+#define MSGQ_POOL_CLASSES       7       /* 256 .. 16384 bytes */
+#define MSGQ_POOL_CACHE_MAX     1024    /* max. free nodes per class */
+
+struct msgq_pool_class {
+  struct msgq_node *freed;      /* pushed by msgq_pkt_delete() */
+  long cached;                  /* nodes in 'freed' and 'local' */
+
+  struct msgq_node *local;      /* popped by the receiver */
+} __attribute__((aligned(64)));
+
+struct msgq_pool {
+  struct msgq_pool_class cls[MSGQ_POOL_CLASSES];
+
+  unsigned long hits;           /* written by the receiver only */
+  unsigned long misses;
+  unsigned long releases;       /* nodes free(3)ed since a class was full */
+  long refs;
 };
 
 
@@ -73,34 +138,75 @@ struct msgq_node {
 #define MSGQ_STAT_DEAD  2
 
 /*
- * Currently, 'recv_mutex' is the only mutex that struct msgq_ provided.
- * Since we do not have any other queue except the 'recvq' member,  one
- * mutex is sufficient for now.
+ * The receive queue is an intrusive MPSC queue (Dmitry Vyukov's
+ * algorithm) of struct msgq_node.  The receiver thread pushes a whole
+ * batch of nodes with one atomic exchange on 'qhead', and never takes
+ * a lock.  The consumers pop from 'qtail'; since the queue allows only
+ * one consumer at a time, they serialize on 'pop_mutex', which the
+ * receiver never touches.
  *
- * 'recv_cond' is using together with 'recv_mutex' if needed.
- * 'recv_cond' wakes any caller that is waiting for more message,
- * specifically, msgq_recv_wait().
+ * Consumers that find the queue empty sleep on the futex word 'qseq',
+ * which the receiver increments after every push.  The receiver calls
+ * futex(2) only if 'qwaiters' is nonzero.
+ *
+ * 'recv_mutex' and 'stat_cond' are only for the status changes of
+ * the receiver thread.
  */
 struct msgq_ {
   int fd;
   char address[UNIX_PATH_MAX];
 
-  unsigned char *pkbuf;         /* internal buffer to receive a message */
+  unsigned char *pkbuf;         /* internal buffer to receive MSGQ_BATCH
+                                 * messages, MSGQ_MSG_MAX bytes each */
 
-  int broadcast;                /* use ptheread_cond_broatcast() if nonzero */
+  int broadcast;                /* wake all waiters on a packet if nonzero */
 
-  struct elist recvq;           /* queue for received messages */
-  size_t recvs;                 /* number of packets in recvq */
+  struct msgq_link *qhead;      /* last pushed node */
+  unsigned int qseq;            /* futex word, bumped on every push */
+  int qwaiters;                 /* number of consumers sleeping on 'qseq' */
+  long recvs;                   /* number of packets in the queue */
+  long hwm;                     /* high-water mark of 'recvs', or 0 */
+  unsigned int throttled;       /* futex word, 1 while the receiver pauses */
 
+  struct msgq_link *qtail __attribute__((aligned(64)));
+                                /* next node to pop, under 'pop_mutex' */
+  struct msgq_link qstub;
+  pthread_mutex_t pop_mutex;
 
-  pthread_cond_t recv_cond;     /* condition for waiting for incoming msg */
-  pthread_mutex_t recv_mutex;
+  pthread_mutex_t recv_mutex __attribute__((aligned(64)));
 
   pthread_cond_t stat_cond;
   //pthread_mutex_t stat_mutex;
   int receiver_status;          /* receiver status, MSGQ_STAT_* */
 
   pthread_t receiver;           /* thread for receiving messages */
+  struct msgq_loop *loop;       /* reactor loop receiving instead, if any */
+
+  struct msgq_pool *pool;       /* allocator for received packets */
+
+  /* Counters for msgq_stat(), grouped by their writers */
+  unsigned long st_sent __attribute__((aligned(64)));   /* by senders */
+  unsigned long st_sent_bytes;
+  unsigned long st_send_failures;
+  unsigned long st_send_eagain;
+
+  unsigned long st_received __attribute__((aligned(64)));
+                                /* by the receiver, or under 'pop_mutex'
+                                 * for a "shm:" MSGQ */
+  unsigned long st_received_bytes;
+  long st_depth_max;
+
+  unsigned long st_dequeued __attribute__((aligned(64)));
+                                /* under 'pop_mutex' */
+  unsigned long st_latency[MSGQ_LAT_BUCKETS];
+
+  uint64_t frag_id;             /* id of the last fragmented packet sent */
+  struct msgq_reasm *reasm;     /* packets being reassembled, newest first */
+  int nreasm;                   /* number of entries in 'reasm' */
+
+  struct msgq_ring *ring;       /* own ring if opened as "shm:/NAME" */
+  struct msgq_ring *peers;      /* rings of "shm:" receivers */
+  pthread_mutex_t peer_mutex;   /* serializes adding to 'peers' */
 };
 
 #define MSGQ_LOCK(msgq)        LOCK(&(msgq)->recv_mutex, "recv")
@@ -110,16 +216,42 @@ struct msgq_ {
 static int validate_packet(struct msgq_packet *packet, ssize_t len);
 static int msgq_start_receiver(MSGQ *msgq);
 static void *msgq_receiver(void *arg);
+static int msgq_reactor_attach(MSGQ_REACTOR *reactor, MSGQ *msgq);
+static void msgq_reactor_pause(MSGQ *msgq);
+static void msgq_reactor_rearm(MSGQ *msgq);
+static int msgq_send_frags(MSGQ *msgq, const struct sockaddr_un *addr,
+                           const struct msgq_packet *packet);
+static void msgq_reasm_clear(MSGQ *msgq);
 static int msgq_get_listener(MSGQ *msgq, const char *address);
 
 static int bind_anonymous(int fd, char address[]);
-static struct msgq_packet *msgq_copy_packet(const struct msgq_packet *packet);
-static struct msgq_node *msgq_node_create(const char *sender,
+static struct msgq_pool *msgq_pool_new(void);
+static void msgq_pool_unref(struct msgq_pool *pool);
+static struct msgq_node *msgq_node_create(struct msgq_pool *pool,
+                                          const char *sender,
                                           const struct msgq_packet *packet);
+static void msgq_node_delete(struct msgq_node *np);
+static struct msgq_node *msgq_pool_get(struct msgq_pool *pool, size_t size);
+
+struct msgq_ring;
+static int is_shm_address(const char *address);
+static int msgq_ring_send(MSGQ *msgq, const char *receiver,
+                          const struct msgq_packet *packet, int nonblock);
+static int msgq_ring_take(MSGQ *msgq, struct msgq_packet **packets,
+                          size_t count);
+static void msgq_ring_release(struct msgq_ring *ring,
+                              struct msgq_packet *packet);
+static const char *msgq_ring_sender(struct msgq_packet *packet);
+static uint64_t msgq_ring_stamp(struct msgq_packet *packet);
+static int msgq_ring_taken(struct msgq_packet *packet);
+static int msgq_ring_open(MSGQ *msgq, const char *address);
+static void msgq_ring_close(MSGQ *msgq);
+static void msgq_ring_unmap(struct msgq_ring *ring);
+static int msgq_ring_count(MSGQ *msgq);
+static uint32_t msgq_ring_seq(MSGQ *msgq);
+static long msgq_ring_sleep(MSGQ *msgq, uint32_t seq,
+                            const struct timespec *abstime);
 
-static int gettime(struct timespec *res);
-static int timespec_subtract(struct timespec *result,
-                             struct timespec *x, struct timespec *y);
 
 #ifndef NDEBUG
 static void verror_(const char *kind, int status, int errnum,
@@ -159,23 +291,17 @@ UNLOCK(pthread_mutex_t *mutex, const char *id)
 }
 
 
-static int
-gettime(struct timespec *res)
+/* Returns CLOCK_MONOTONIC in nanoseconds; used to stamp packets. */
+static __inline__ uint64_t
+msgq_clock(void)
 {
-  int ret;
-#if _POSIX_C_SOURCE < 199309L
-  struct timeval tv;
-  if ((ret = gettimeofday(&tv, NULL)) == 0) {
-    res.tv_sec = tv.tv_sec;
-    res.tv_nsec = tv.tv_usec * 1000;
-  }
-#else
-  ret = clock_gettime(CLOCK_REALTIME, res);
-#endif  /* _POSIX_C_SOURCE */
+  struct timespec now;
 
-  return ret;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
+
 /*
  * If nonzero, block all signals (using sigfillset()) before creating
  * the receiver thread.  The reason is that I do not know that the
@@ -186,7 +312,7 @@ gettime(struct timespec *res)
  * Frankly, I don't think that calling sigfillset() for blocking
  * signals will cause trouble later.  Anyway, if 'block_all_signals'
  * is zero, the receiver thread will block only certain signals.  See
- * msgq_start_receiver() for more.
+ * msgq_create_thread() for more.  The same applies to the reactor loops.
  */
 static int block_all_signals = 1;
 
@@ -221,11 +347,11 @@ msgq_message_count(MSGQ *msgq)
 {
   int ret;
 
-  MSGQ_LOCK(msgq);
-  ret = msgq->recvs;
-  MSGQ_UNLOCK(msgq);
-
-  return ret;
+  if (msgq->ring)
+    ret = msgq_ring_count(msgq);
+  else
+    ret = __atomic_load_n(&msgq->recvs, __ATOMIC_RELAXED);
+  return ret > 0 ? ret : 0;
 }
 
 
@@ -235,6 +361,8 @@ msgq_pkt_sender(struct msgq_packet *packet)
   struct msgq_node *np;
   if (!packet->container)
     return NULL;
+  if ((uintptr_t)packet->container & 1)
+    return msgq_ring_sender(packet);
   np = (struct msgq_node *)packet->container;
   return np->sender;
 }
@@ -246,17 +374,141 @@ msgq_pkt_delete(struct msgq_packet *packet)
   struct msgq_node *np;
   if (!packet || !packet->container)
     return -1;
+  if ((uintptr_t)packet->container & 1) {
+    /* a packet in a shared-memory ring; not one still reserved */
+    if (!msgq_ring_taken(packet)) {
+      errno = EINVAL;
+      return -1;
+    }
+    msgq_ring_release((struct msgq_ring *)((uintptr_t)packet->container - 1),
+                      packet);
+    return 0;
+  }
   np = (struct msgq_node *)packet->container;
 
-  assert(ELIST_NEXT(np->link) == 0);
-  assert(ELIST_PREV(np->link) == 0);
+  assert(np->link.next == NULL);
+
+  msgq_node_delete(np);
+  return 0;
+}
+
+
+int
+msgq_pool_stat(MSGQ *msgq, struct msgq_pool_stat *stat)
+{
+  struct msgq_pool *pool = msgq->pool;
+  int i;
+
+  stat->hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+  stat->misses = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+  stat->releases = __atomic_load_n(&pool->releases, __ATOMIC_RELAXED);
+  stat->cached = 0;
+  for (i = 0; i < MSGQ_POOL_CLASSES; i++)
+    stat->cached += __atomic_load_n(&pool->cls[i].cached, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+/*
+ * Count a send of PACKETS packets with BYTES bytes of data if RET is
+ * zero, or a failure otherwise.  'errno' is preserved.
+ */
+static void
+msgq_count_send(MSGQ *msgq, int ret, unsigned long packets,
+                unsigned long bytes)
+{
+  if (ret == 0) {
+    __atomic_add_fetch(&msgq->st_sent, packets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&msgq->st_sent_bytes, bytes, __ATOMIC_RELAXED);
+  }
+  else if (errno == EAGAIN)
+    __atomic_add_fetch(&msgq->st_send_eagain, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&msgq->st_send_failures, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Count COUNT packets just popped to PACKETS in the latency histogram.
+ * The caller must hold 'pop_mutex'.
+ */
+static void
+msgq_count_dequeue(MSGQ *msgq, struct msgq_packet **packets, size_t count)
+{
+  uint64_t now = msgq_clock(), stamp;
+  unsigned long *bucket;
+  size_t i;
+  int b;
+
+  for (i = 0; i < count; i++) {
+    if ((uintptr_t)packets[i]->container & 1)
+      stamp = msgq_ring_stamp(packets[i]);
+    else
+      stamp = ((struct msgq_node *)packets[i]->container)->stamp;
+
+    b = (now > stamp) ? 63 - __builtin_clzll(now - stamp) : 0;
+    if (b >= MSGQ_LAT_BUCKETS)
+      b = MSGQ_LAT_BUCKETS - 1;
+    bucket = &msgq->st_latency[b];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&msgq->st_dequeued, msgq->st_dequeued + count,
+                   __ATOMIC_RELAXED);
+}
+
+
+int
+msgq_stat(MSGQ *msgq, struct msgq_stat *stat)
+{
+  int i;
 
-  free(packet);
-  free(np);
+  stat->sent = __atomic_load_n(&msgq->st_sent, __ATOMIC_RELAXED);
+  stat->sent_bytes = __atomic_load_n(&msgq->st_sent_bytes, __ATOMIC_RELAXED);
+  stat->send_failures = __atomic_load_n(&msgq->st_send_failures,
+                                        __ATOMIC_RELAXED);
+  stat->send_eagain = __atomic_load_n(&msgq->st_send_eagain,
+                                      __ATOMIC_RELAXED);
+
+  stat->received = __atomic_load_n(&msgq->st_received, __ATOMIC_RELAXED);
+  stat->received_bytes = __atomic_load_n(&msgq->st_received_bytes,
+                                         __ATOMIC_RELAXED);
+  stat->dequeued = __atomic_load_n(&msgq->st_dequeued, __ATOMIC_RELAXED);
+  stat->depth = msgq_message_count(msgq);
+  stat->depth_max = __atomic_load_n(&msgq->st_depth_max, __ATOMIC_RELAXED);
+
+  for (i = 0; i < MSGQ_LAT_BUCKETS; i++)
+    stat->latency[i] = __atomic_load_n(&msgq->st_latency[i],
+                                       __ATOMIC_RELAXED);
   return 0;
 }
 
 
+unsigned long
+msgq_stat_latency(const struct msgq_stat *stat, double q)
+{
+  unsigned long total = 0, seen = 0, rank;
+  int i;
+
+  for (i = 0; i < MSGQ_LAT_BUCKETS; i++)
+    total += stat->latency[i];
+  if (total == 0)
+    return 0;
+
+  if (q < 0)
+    q = 0;
+  rank = (unsigned long)(q * total);
+  if (rank >= total)
+    rank = total - 1;
+
+  for (i = 0; i < MSGQ_LAT_BUCKETS - 1; i++) {
+    seen += stat->latency[i];
+    if (seen > rank)
+      break;
+  }
+  return 2UL << i;
+}
+
+
 /*
  * Wait for the status change of the listener thread.
  *
@@ -315,71 +567,302 @@ msgq_recv_wait(MSGQ *msgq)
 }
 
 
-struct msgq_packet *
-msgq_recv_timedwait(MSGQ *msgq, struct timespec *abstime)
+static long
+futex_wait(unsigned int *addr, unsigned int val, const struct timespec *abstime)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                 val, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+
+static long
+futex_wake(unsigned int *addr, int count)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+
+/*
+ * Link the chain of nodes from FIRST to LAST to the receive queue.
+ * Any thread may call this function.
+ */
+static void
+msgq_queue_link(MSGQ *msgq, struct msgq_link *first, struct msgq_link *last)
+{
+  struct msgq_link *prev;
+
+  last->next = NULL;
+  prev = __atomic_exchange_n(&msgq->qhead, last, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Wake up to COUNT consumers sleeping in msgq_wait_packets().
+ */
+static void
+msgq_queue_wake(MSGQ *msgq, int count)
+{
+  __atomic_add_fetch(&msgq->qseq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&msgq->qwaiters, __ATOMIC_SEQ_CST) > 0) {
+    DEBUG(0, "receiver: wake %d", count);
+    futex_wake(&msgq->qseq, count);
+  }
+}
+
+
+/*
+ * Push the chain of COUNT nodes from FIRST to LAST to the receive
+ * queue, and wake the consumers.
+ */
+static void
+msgq_queue_push(MSGQ *msgq, struct msgq_link *first, struct msgq_link *last,
+                int count)
+{
+  long depth;
+
+  depth = __atomic_add_fetch(&msgq->recvs, count, __ATOMIC_RELAXED);
+  if (depth > msgq->st_depth_max)
+    __atomic_store_n(&msgq->st_depth_max, depth, __ATOMIC_RELAXED);
+  msgq_queue_link(msgq, first, last);
+  msgq_queue_wake(msgq, msgq->broadcast ? INT_MAX : count);
+}
+
+
+/*
+ * Pop a node from the receive queue.  The caller must hold
+ * 'pop_mutex'.
+ *
+ * Returns NULL if the queue is empty, or if a push is in progress.
+ * In the latter case, the pusher bumps 'qseq' when it is done.
+ */
+static struct msgq_node *
+msgq_queue_pop(MSGQ *msgq)
+{
+  struct msgq_link *tail = msgq->qtail;
+  struct msgq_link *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &msgq->qstub) {
+    if (!next)
+      return NULL;
+    msgq->qtail = tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (!next) {
+    if (tail != __atomic_load_n(&msgq->qhead, __ATOMIC_ACQUIRE))
+      return NULL;
+
+    /* TAIL is the last node; put the stub behind it to take it. */
+    msgq_queue_link(msgq, &msgq->qstub, &msgq->qstub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (!next)
+      return NULL;
+  }
+
+  msgq->qtail = next;
+  tail->next = NULL;
+  __atomic_sub_fetch(&msgq->recvs, 1, __ATOMIC_RELAXED);
+  return ELIST_ENTRY(tail, struct msgq_node, link);
+}
+
+
+/*
+ * Flow control
+ *
+ * If 'hwm' is nonzero, the receiver takes at most 'hwm' - 'recvs'
+ * packets per recvmmsg(2), and pauses when the queue reaches 'hwm'.
+ * A receiver thread sleeps on the futex word 'throttled'; a reactor
+ * loop removes the socket from its epoll set instead.  Either way, the
+ * socket is not read, so the kernel pushes back on the senders.
+ *
+ * The consumer that brings 'recvs' down to 'hwm' / 2 clears
+ * 'throttled' and resumes the receiver.  Each side writes its own
+ * variable, then reads the other's after a full barrier, so that the
+ * pause and the resume cannot miss each other.
+ */
+
+/* Returns how many packets the receiver may take now. */
+static unsigned int
+msgq_credit(MSGQ *msgq)
+{
+  long hwm = __atomic_load_n(&msgq->hwm, __ATOMIC_RELAXED);
+  long depth;
+
+  if (hwm == 0)
+    return MSGQ_BATCH;
+  depth = __atomic_load_n(&msgq->recvs, __ATOMIC_RELAXED);
+  if (depth >= hwm)
+    return 0;
+  return (hwm - depth < MSGQ_BATCH) ? hwm - depth : MSGQ_BATCH;
+}
+
+
+/* Resume the receiver of MSGQ if it is paused, and the queue is low. */
+static void
+msgq_resume(MSGQ *msgq)
+{
+  unsigned int one = 1;
+  long hwm;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&msgq->throttled, __ATOMIC_RELAXED))
+    return;
+
+  hwm = __atomic_load_n(&msgq->hwm, __ATOMIC_RELAXED);
+  if (hwm > 0 && __atomic_load_n(&msgq->recvs, __ATOMIC_RELAXED) > hwm / 2)
+    return;
+
+  if (!__atomic_compare_exchange_n(&msgq->throttled, &one, 0, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return;                     /* someone else resumed it */
+
+  DEBUG(0, "receiver: resuming");
+  if (msgq->loop)
+    msgq_reactor_rearm(msgq);
+  else
+    futex_wake(&msgq->throttled, 1);
+}
+
+
+/*
+ * Called by the receiver when msgq_credit() returned zero.  A receiver
+ * thread returns once resumed; a reactor loop returns immediately, and
+ * gets the socket back in its epoll set when resumed.
+ */
+static void
+msgq_pause(MSGQ *msgq)
+{
+  if (msgq->loop)
+    msgq_reactor_pause(msgq);
+
+  DEBUG(0, "receiver: pausing at %ld packet(s)", msgq->recvs);
+  __atomic_store_n(&msgq->throttled, 1, __ATOMIC_SEQ_CST);
+  msgq_resume(msgq);            /* in case the queue drained meanwhile */
+
+  if (!msgq->loop)
+    while (__atomic_load_n(&msgq->throttled, __ATOMIC_SEQ_CST))
+      futex_wait(&msgq->throttled, 1, NULL);
+}
+
+
+int
+msgq_set_hwm(MSGQ *msgq, long hwm)
+{
+  if (hwm < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  __atomic_store_n(&msgq->hwm, hwm, __ATOMIC_RELAXED);
+  msgq_resume(msgq);
+  return 0;
+}
+
+
+/*
+ * Move up to COUNT packets from the receive queue to PACKETS.
+ */
+static int
+msgq_pop_packets(MSGQ *msgq, struct msgq_packet **packets, size_t count)
 {
-  struct elist *p;
   struct msgq_node *np;
-  struct timespec now, diff;
-  int ret;
+  size_t i;
 
-  MSGQ_LOCK(msgq);
+  LOCK(&msgq->pop_mutex, "pop");
+  if (msgq->ring)
+    i = msgq_ring_take(msgq, packets, count);
+  else
+    for (i = 0; i < count; i++) {
+      np = msgq_queue_pop(msgq);
+      if (!np)
+        break;
+      packets[i] = np->packet;
+    }
+  if (i > 0)
+    msgq_count_dequeue(msgq, packets, i);
+  UNLOCK(&msgq->pop_mutex, "pop");
+
+  if (i > 0 && !msgq->ring && __atomic_load_n(&msgq->hwm, __ATOMIC_RELAXED))
+    msgq_resume(msgq);
+
+  return (int)i;
+}
+
+
+/*
+ * Like msgq_pop_packets(), but wait until at least one packet is
+ * available.  Returns -1 with 'errno' set on timeout or error; see
+ * msgq_recv_timedwait().
+ */
+static int
+msgq_wait_packets(MSGQ *msgq, struct msgq_packet **packets, size_t count,
+                  struct timespec *abstime)
+{
+  unsigned int seq;
+  long ret;
+  int n;
 
   while (1) {
-    p = edque_pop_front(&msgq->recvq);
-    if (p)
-      break;
+    if (msgq->ring)
+      seq = msgq_ring_seq(msgq);
+    else
+      seq = __atomic_load_n(&msgq->qseq, __ATOMIC_SEQ_CST);
 
-    if (msgq->receiver_status == MSGQ_STAT_DEAD) {
+    n = msgq_pop_packets(msgq, packets, count);
+    if (n > 0 || count == 0)
+      return n;
+
+    if (__atomic_load_n(&msgq->receiver_status,
+                        __ATOMIC_SEQ_CST) == MSGQ_STAT_DEAD) {
       WARN(0, "msgq_recv_wait: lister is dead. no more packet available!");
       errno = EADDRNOTAVAIL;
-      goto just_end;
+      return -1;
     }
 
     DEBUG(0, "msgq_recv_wait: waiting...");
-    if (abstime) {
-      ret = pthread_cond_timedwait(&msgq->recv_cond, &msgq->recv_mutex,
-                                   abstime);
-      if (ret != 0)
-        DEBUG(ret, "msgq_recv_wait: pthread_cond_timedwait(3) failed");
-    }
+    if (msgq->ring)
+      ret = msgq_ring_sleep(msgq, seq, abstime);
     else {
-      ret = pthread_cond_wait(&msgq->recv_cond, &msgq->recv_mutex);
-      if (ret != 0)
-        DEBUG(ret, "msgq_recv_wait: pthread_cond_wait(3) failed");
+      __atomic_add_fetch(&msgq->qwaiters, 1, __ATOMIC_SEQ_CST);
+      ret = futex_wait(&msgq->qseq, seq, abstime);
+      __atomic_sub_fetch(&msgq->qwaiters, 1, __ATOMIC_SEQ_CST);
     }
     DEBUG(0, "msgq_recv_wait: awaken!");
 
-    /* The mutex is locked state. */
-
-    if (ret != 0) {
-      errno = ret;
-      goto just_end;            /* error or timeout */
-    }
-
-    if (abstime) {
-      /* On spurious wakeup, if ABSTIME is given, and it is timed out,
-       * then escape the loop. */
-      gettime(&now);
-      if (timespec_subtract(&diff, &now, abstime) == 0)
-        goto just_end;          /* timeout */
+    /* EAGAIN means 'qseq' has changed, and EINTR means a signal;
+     * try again for both. */
+    if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+      if (errno != ETIMEDOUT)
+        DEBUG(errno, "msgq_recv_wait: futex(2) failed");
+      return -1;                /* error or timeout */
     }
   }
+}
 
-  msgq->recvs--;
-  MSGQ_UNLOCK(msgq);
 
-  np = ELIST_ENTRY(p, struct msgq_node, link);
-  return np->packet;
+struct msgq_packet *
+msgq_recv_timedwait(MSGQ *msgq, struct timespec *abstime)
+{
+  struct msgq_packet *packet;
+
+  if (msgq_wait_packets(msgq, &packet, 1, abstime) < 0)
+    return NULL;
+  return packet;
+}
 
- just_end:
-  /* You should not call any function that possibly modify 'errno' here. */
 
-  /* flow comes here if conditional waiting function failed, or if
-   * timed-out. */
+int
+msgq_recv_batch(MSGQ *msgq, struct msgq_packet **packets, size_t count)
+{
+  return msgq_pop_packets(msgq, packets, count);
+}
+
 
-  MSGQ_UNLOCK(msgq);
-  return NULL;
+int
+msgq_recv_batch_timedwait(MSGQ *msgq, struct msgq_packet **packets,
+                          size_t count, struct timespec *abstime)
+{
+  return msgq_wait_packets(msgq, packets, count, abstime);
 }
 
 
@@ -411,54 +894,14 @@ timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y)
 }
 #endif  /* 0 */
 
-/*
- * Subtract the `struct timespec' values X and Y, storing the result in
- * RESULT.  Return 1 if the difference is negative, otherwise 0.
- *
- * Stealed from GLIBC manual.
- */
-static int
-timespec_subtract(struct timespec *result,
-                  struct timespec *x, struct timespec *y)
-{
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x->tv_nsec < y->tv_nsec) {
-    int nsec = (y->tv_nsec - x->tv_nsec) / 1000000000 + 1;
-    y->tv_nsec -= 1000000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_nsec - y->tv_nsec > 1000000000) {
-    int nsec = (x->tv_nsec - y->tv_nsec) / 1000000000;
-    y->tv_nsec += 1000000000 * nsec;
-    y->tv_sec -= nsec;
-  }
-
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_nsec = x->tv_nsec - y->tv_nsec;
-
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
-}
-
 struct msgq_packet *
 msgq_recv(MSGQ *msgq)
 {
-  struct elist *p;
-  struct msgq_node *np;
+  struct msgq_packet *packet;
 
-  MSGQ_LOCK(msgq);
-  p = edque_pop_front(&msgq->recvq);
-  if (!p) {
-    MSGQ_UNLOCK(msgq);
+  if (msgq_pop_packets(msgq, &packet, 1) == 0)
     return NULL;
-  }
-  msgq->recvs--;
-  MSGQ_UNLOCK(msgq);
-
-  np = ELIST_ENTRY(p, struct msgq_node, link);
-  return np->packet;
+  return packet;
 }
 
 
@@ -490,8 +933,18 @@ msgq_send_(MSGQ *msgq, const char *receiver, const struct msgq_packet *packet)
   struct sockaddr_un addr;
   ssize_t ret;
 
+  if (is_shm_address(receiver))
+    return msgq_ring_send(msgq, receiver, packet, 0);
+
   addr.sun_family = AF_LOCAL;
   strncpy(addr.sun_path, receiver, sizeof(addr.sun_path) - 1);
+  addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+
+  if (sizeof_packet(packet) > MSGQ_MSG_MAX) {
+    ret = msgq_send_frags(msgq, &addr, packet);
+    msgq_count_send(msgq, ret, 1, packet->size);
+    return ret;
+  }
 
   /* TODO: lock?? */
   ret = sendto(msgq->fd, packet, sizeof_packet(packet), MSG_NOSIGNAL,
@@ -500,33 +953,349 @@ msgq_send_(MSGQ *msgq, const char *receiver, const struct msgq_packet *packet)
 
   if (ret < 0) {
     WARN(errno, "sendto(2) failed");
+    msgq_count_send(msgq, -1, 1, 0);
     return -1;
   }
 
+  msgq_count_send(msgq, 0, 1, packet->size);
   return 0;
 }
 
 
-#ifdef MSGQ_BROADCAST
 int
-msgq_broadcast_string_wildcard(MSGQ *msgq, const char *pattern,
-                               const char *fmt, ...)
+msgq_try_send(MSGQ *msgq, const char *receiver,
+              const struct msgq_packet *packet)
 {
-  va_list ap;
-  int ret;
-  struct msgq_packet *p;
+  struct sockaddr_un addr;
 
-  va_start(ap, fmt);
-  ret = vsnprintf(NULL, 0, fmt, ap);
-  va_end(ap);
-  p = malloc(sizeof(*p) + ret + 1);
-  if (!p)
-    return -1;
-  va_start(ap, fmt);
-  vsnprintf(p->data, ret + 1, fmt, ap);
-  va_end(ap);
-  p->size = ret + 1;
-  p->container = NULL;
+  if (is_shm_address(receiver))
+    return msgq_ring_send(msgq, receiver, packet, 1);
+
+  if (sizeof_packet(packet) > MSGQ_MSG_MAX) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  addr.sun_family = AF_LOCAL;
+  strncpy(addr.sun_path, receiver, sizeof(addr.sun_path) - 1);
+  addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+
+  if (sendto(msgq->fd, packet, sizeof_packet(packet),
+             MSG_DONTWAIT | MSG_NOSIGNAL,
+             (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (errno != EAGAIN)
+      WARN(errno, "sendto(2) failed");
+    msgq_count_send(msgq, -1, 1, 0);
+    return -1;
+  }
+  msgq_count_send(msgq, 0, 1, packet->size);
+  return 0;
+}
+
+
+int
+msgq_send_batch(MSGQ *msgq, const struct msgq_msg *msgs, size_t count)
+{
+  struct sockaddr_un addr[MSGQ_BATCH];
+  struct mmsghdr hdr[MSGQ_BATCH];
+  struct iovec iov[MSGQ_BATCH];
+  unsigned long bytes;
+  size_t sent = 0;
+  int i, n, ret;
+
+  while (sent < count) {
+    if (is_shm_address(msgs[sent].receiver) ||
+        sizeof_packet(msgs[sent].packet) > MSGQ_MSG_MAX) {
+      /* no system call to save */
+      if (msgq_send_(msgq, msgs[sent].receiver, msgs[sent].packet) < 0)
+        break;
+      sent++;
+      continue;
+    }
+
+    n = (count - sent < MSGQ_BATCH) ? count - sent : MSGQ_BATCH;
+
+    for (i = 0; i < n; i++) {
+      const struct msgq_msg *m = msgs + sent + i;
+
+      if (is_shm_address(m->receiver) ||
+          sizeof_packet(m->packet) > MSGQ_MSG_MAX) {
+        n = i;
+        break;
+      }
+
+      addr[i].sun_family = AF_LOCAL;
+      strncpy(addr[i].sun_path, m->receiver, sizeof(addr[i].sun_path) - 1);
+      addr[i].sun_path[sizeof(addr[i].sun_path) - 1] = '\0';
+
+      iov[i].iov_base = (void *)m->packet;
+      iov[i].iov_len = sizeof_packet(m->packet);
+
+      memset(&hdr[i], 0, sizeof(hdr[i]));
+      hdr[i].msg_hdr.msg_name = &addr[i];
+      hdr[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+      hdr[i].msg_hdr.msg_iov = &iov[i];
+      hdr[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ret = sendmmsg(msgq->fd, hdr, n, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      WARN(errno, "sendmmsg(2) failed");
+      msgq_count_send(msgq, -1, 1, 0);
+      break;
+    }
+    for (i = 0, bytes = 0; i < ret; i++)
+      bytes += msgs[sent + i].packet->size;
+    msgq_count_send(msgq, 0, ret, bytes);
+    sent += ret;
+    if (ret < n) {
+      /* sendmmsg(2) stops at the first failure without reporting it;
+       * find out why by sending that packet alone. */
+      if (msgq_send_(msgq, msgs[sent].receiver, msgs[sent].packet) < 0)
+        break;
+      sent++;
+    }
+  }
+
+  if (sent == 0 && count > 0)
+    return -1;
+  return (int)sent;
+}
+
+
+/*
+ * Fragmentation
+ *
+ * A packet larger than MSGQ_MSG_MAX does not fit in one slot of the
+ * receive buffer, so it is sent as a series of datagrams, each with
+ * struct msgq_frag in place of struct msgq_packet.  The top bit of
+ * 'size', which no real packet has, tells a fragment from a packet.
+ * The fragments point into the caller's packet with a second iovec,
+ * and go out MSGQ_BATCH at a time with sendmmsg(2).
+ *
+ * Datagrams between two sockets are reliable and ordered, so the
+ * receiver expects the fragments of one packet in order.  On the first
+ * fragment, it allocates the final node for the whole packet, and
+ * copies each fragment from the receive buffer directly to its place.
+ * The complete node is queued like any other.
+ *
+ * The reassembly state is keyed by the sender address and the sender's
+ * packet id, since unbound senders all have the empty address.  It is
+ * private to the receiver of the MSGQ.  A sender that dies in the
+ * middle leaves an incomplete packet behind, so at most MSGQ_REASM_MAX
+ * packets are kept per MSGQ, and the oldest is dropped beyond that.
+ */
+#define MSGQ_FRAG_BIT   ((size_t)1 << (sizeof(size_t) * CHAR_BIT - 1))
+#define MSGQ_REASM_MAX  16
+
+struct msgq_frag {
+  void *container;              /* unused */
+  size_t size;                  /* MSGQ_FRAG_BIT | size of the packet */
+  uint64_t id;                  /* packet id, unique for the sender */
+  uint64_t offset;              /* offset of this fragment in 'data' */
+  char data[0];
+};
+
+#define MSGQ_FRAG_DATA  (MSGQ_MSG_MAX - sizeof(struct msgq_frag))
+
+struct msgq_reasm {
+  struct msgq_reasm *next;
+  char sender[UNIX_PATH_MAX];
+  uint64_t id;
+  size_t received;              /* bytes of 'node->packet' filled */
+  struct msgq_node *node;       /* the packet being reassembled */
+};
+
+
+static int
+msgq_send_frags(MSGQ *msgq, const struct sockaddr_un *addr,
+                const struct msgq_packet *packet)
+{
+  struct msgq_frag frag[MSGQ_BATCH];
+  struct mmsghdr hdr[MSGQ_BATCH];
+  struct iovec iov[MSGQ_BATCH][2];
+  uint64_t id;
+  size_t offset, next, len;
+  int i, n, ret;
+
+  if (packet->size > MSGQ_PKT_MAX) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  /* Start from the pid, so that unbound senders do not collide. */
+  __atomic_compare_exchange_n(&msgq->frag_id, &(uint64_t){ 0 },
+                              (uint64_t)getpid() << 32, 0,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  id = __atomic_add_fetch(&msgq->frag_id, 1, __ATOMIC_RELAXED);
+
+  offset = 0;
+  while (offset < packet->size) {
+    next = offset;
+    for (n = 0; n < MSGQ_BATCH && next < packet->size; n++) {
+      len = packet->size - next;
+      if (len > MSGQ_FRAG_DATA)
+        len = MSGQ_FRAG_DATA;
+
+      frag[n].container = NULL;
+      frag[n].size = MSGQ_FRAG_BIT | packet->size;
+      frag[n].id = id;
+      frag[n].offset = next;
+
+      iov[n][0].iov_base = &frag[n];
+      iov[n][0].iov_len = sizeof(frag[n]);
+      iov[n][1].iov_base = (void *)(packet->data + next);
+      iov[n][1].iov_len = len;
+
+      memset(&hdr[n], 0, sizeof(hdr[n]));
+      hdr[n].msg_hdr.msg_name = (void *)addr;
+      hdr[n].msg_hdr.msg_namelen = sizeof(*addr);
+      hdr[n].msg_hdr.msg_iov = iov[n];
+      hdr[n].msg_hdr.msg_iovlen = 2;
+      next += len;
+    }
+
+    ret = sendmmsg(msgq->fd, hdr, n, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      WARN(errno, "sendmmsg(2) failed");
+      return -1;
+    }
+    /* On a partial send, the next call reports the error. */
+    for (i = 0; i < ret; i++)
+      offset += iov[i][1].iov_len;
+  }
+  return 0;
+}
+
+
+static void
+msgq_reasm_free(struct msgq_reasm *rp)
+{
+  msgq_node_delete(rp->node);
+  free(rp);
+}
+
+
+/* Drop all incomplete packets.  Called after the receiver stopped. */
+static void
+msgq_reasm_clear(MSGQ *msgq)
+{
+  struct msgq_reasm *rp;
+
+  while ((rp = msgq->reasm) != NULL) {
+    msgq->reasm = rp->next;
+    msgq_reasm_free(rp);
+  }
+  msgq->nreasm = 0;
+}
+
+
+/*
+ * Add the fragment FRAG of LEN bytes from SENDER.  Returns the node of
+ * the packet if FRAG completes it, otherwise NULL.
+ */
+static struct msgq_node *
+msgq_reasm_add(MSGQ *msgq, const char *sender,
+               const struct msgq_frag *frag, size_t len)
+{
+  struct msgq_reasm **pp, *rp;
+  struct msgq_node *np;
+  size_t size = frag->size & ~MSGQ_FRAG_BIT;
+
+  len -= sizeof(*frag);
+
+  for (pp = &msgq->reasm; (rp = *pp) != NULL; pp = &rp->next)
+    if (rp->id == frag->id && strcmp(rp->sender, sender) == 0)
+      break;
+
+  if (!rp) {
+    if (frag->offset != 0 || size > MSGQ_PKT_MAX) {
+      DEBUG(0, "receiver: ignoring stray fragment from %s", sender);
+      return NULL;
+    }
+
+    rp = malloc(sizeof(*rp));
+    if (!rp)
+      return NULL;
+    rp->node = msgq_pool_get(msgq->pool, size);
+    if (!rp->node) {
+      free(rp);
+      return NULL;
+    }
+    np = rp->node;
+    np->packet = (struct msgq_packet *)(np + 1);
+    np->packet->container = np;
+    np->packet->size = size;
+    strncpy(np->sender, sender, UNIX_PATH_MAX - 1);
+    np->sender[UNIX_PATH_MAX - 1] = '\0';
+    np->link.next = NULL;
+
+    strcpy(rp->sender, np->sender);
+    rp->id = frag->id;
+    rp->received = 0;
+    rp->next = msgq->reasm;
+    msgq->reasm = rp;
+    pp = &msgq->reasm;
+
+    if (++msgq->nreasm > MSGQ_REASM_MAX) {
+      struct msgq_reasm **lp;
+
+      for (lp = &msgq->reasm; (*lp)->next; lp = &(*lp)->next)
+        ;
+      DEBUG(0, "receiver: dropping incomplete packet from %s",
+            (*lp)->sender);
+      msgq_reasm_free(*lp);
+      *lp = NULL;
+      msgq->nreasm--;
+    }
+  }
+
+  np = rp->node;
+  if (frag->offset != rp->received || len > size - rp->received) {
+    DEBUG(0, "receiver: dropping corrupted packet from %s", sender);
+    *pp = rp->next;
+    msgq->nreasm--;
+    msgq_reasm_free(rp);
+    return NULL;
+  }
+
+  memcpy(np->packet->data + rp->received, frag->data, len);
+  rp->received += len;
+  if (rp->received < size)
+    return NULL;
+
+  np->packet->data[size] = '\0';
+  *pp = rp->next;
+  msgq->nreasm--;
+  free(rp);
+  return np;
+}
+
+
+#ifdef MSGQ_BROADCAST
+int
+msgq_broadcast_string_wildcard(MSGQ *msgq, const char *pattern,
+                               const char *fmt, ...)
+{
+  va_list ap;
+  int ret;
+  struct msgq_packet *p;
+
+  va_start(ap, fmt);
+  ret = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  p = malloc(sizeof(*p) + ret + 1);
+  if (!p)
+    return -1;
+  va_start(ap, fmt);
+  vsnprintf(p->data, ret + 1, fmt, ap);
+  va_end(ap);
+  p->size = ret + 1;
+  p->container = NULL;
 
   msgq_broadcast_wildcard(msgq, pattern, p);
 
@@ -535,31 +1304,1026 @@ msgq_broadcast_string_wildcard(MSGQ *msgq, const char *pattern,
 }
 
 
+/*
+ * Subscriber registry
+ *
+ * Scanning the directory for every broadcast is expensive, so the
+ * socket list of each recently used pattern is cached in 'bcast_cache'.
+ * Since the list depends only on the filesystem, the cache is shared
+ * by all MSGQs of the process.
+ *
+ * Every cached directory is watched by one inotify(7) instance.
+ * Before each lookup, pending events are read without blocking, and an
+ * entry becomes stale when a file matching its pattern is created,
+ * removed or renamed in its directory, or when the directory itself
+ * goes away.  A stale entry is rescanned on its next use.
+ *
+ * The entries are reference counted, so that a broadcast can send to
+ * a list while another thread replaces it in the cache.  If inotify is
+ * not available, each broadcast scans the directory as before.
+ */
+#define MSGQ_BCAST_CACHE_MAX    32      /* max. number of cached patterns */
+#define MSGQ_BCAST_CHUNK        256     /* packets per sendmmsg(2) call */
+
+#define MSGQ_BCAST_EVENTS       (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                                 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct msgq_bcast_dest {
+  struct sockaddr_un addr;
+  int dead;                     /* nonzero if nobody listens on 'addr' */
+};
+
+struct msgq_bcast_entry {
+  struct msgq_bcast_entry *next;
+  char *pattern;                /* as given to msgq_broadcast_wildcard() */
+  char *base;                   /* filename part of 'pattern' */
+  int wd;                       /* watch descriptor, or -1 if uncached */
+  int stale;
+  long refs;
+
+  size_t count;                 /* number of subscribers */
+  struct msgq_bcast_dest *dests;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  int fd;                       /* inotify(7) instance, -1 if unavailable,
+                                 * -2 if not yet created */
+  int count;
+  struct msgq_bcast_entry *entries; /* most recently used first */
+} bcast_cache = { PTHREAD_MUTEX_INITIALIZER, -2, 0, NULL };
+
+
+static void
+bcast_entry_unref(struct msgq_bcast_entry *ep)
+{
+  if (__atomic_sub_fetch(&ep->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  free(ep->dests);
+  free(ep->pattern);
+  free(ep);
+}
+
+
+/*
+ * Split PATTERN at the last unescaped separator, as sglob() does.  The
+ * directory part is stored in DIR, which has room for PATH_MAX bytes.
+ * Returns the offset of the filename part, or -1 if DIR is too long.
+ */
+static ssize_t
+bcast_split(const char *pattern, char *dir)
+{
+  const char *p;
+  size_t len = strlen(pattern);
+
+  strcpy(dir, ".");
+  while ((p = memrchr(pattern, '/', len)) != NULL) {
+    if (p > pattern && *(p - 1) == '\\') {
+      len = p - pattern;
+      continue;
+    }
+    len = (p == pattern) ? 1 : p - pattern;
+    if (len >= PATH_MAX)
+      return -1;
+    memcpy(dir, pattern, len);
+    dir[len] = '\0';
+    return p + 1 - pattern;
+  }
+  return 0;
+}
+
+
+/* Collect the sockets matching PATTERN into a new, uncached entry. */
+static struct msgq_bcast_entry *
+bcast_scan(const char *pattern)
+{
+  struct msgq_bcast_entry *ep;
+  sglob_t gbuf;
+  char dir[PATH_MAX];
+  ssize_t base;
+  size_t i;
+
+  base = bcast_split(pattern, dir);
+  if (base < 0)
+    return NULL;
+
+  ep = calloc(1, sizeof(*ep));
+  if (!ep)
+    return NULL;
+  ep->pattern = strdup(pattern);
+  if (!ep->pattern)
+    goto err;
+  ep->base = ep->pattern + base;
+  ep->wd = -1;
+  ep->refs = 1;
+
+  gbuf.mask = S_IFSOCK;
+  if (sglob(pattern, SGLOB_MASK, &gbuf) < 0)
+    goto err;
+
+  if (gbuf.pathc > 0) {
+    ep->dests = calloc(gbuf.pathc, sizeof(*ep->dests));
+    if (!ep->dests) {
+      sglobfree(&gbuf);
+      goto err;
+    }
+  }
+  for (i = 0; i < gbuf.pathc; i++) {
+    ep->dests[i].addr.sun_family = AF_LOCAL;
+    strncpy(ep->dests[i].addr.sun_path, gbuf.pathv[i],
+            sizeof(ep->dests[i].addr.sun_path) - 1);
+  }
+  ep->count = gbuf.pathc;
+  sglobfree(&gbuf);
+  return ep;
+
+ err:
+  free(ep->pattern);
+  free(ep);
+  return NULL;
+}
+
+
+/* Mark the entries affected by the pending inotify events stale. */
+static void
+bcast_cache_poll(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  struct msgq_bcast_entry *ep;
+  ssize_t len;
+  char *p;
+
+  while ((len = read(bcast_cache.fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+
+      for (ep = bcast_cache.entries; ep; ep = ep->next) {
+        if (ev->mask & IN_Q_OVERFLOW)
+          ep->stale = 1;
+        else if (ep->wd != ev->wd)
+          continue;
+        else if (ev->len == 0 ||
+                 fnmatch(ep->base, ev->name, FNM_PERIOD) == 0)
+          ep->stale = 1;
+      }
+    }
+  }
+}
+
+
+/* Remove the watch WD unless a cached entry still uses it. */
+static void
+bcast_cache_unwatch(int wd)
+{
+  struct msgq_bcast_entry *ep;
+
+  for (ep = bcast_cache.entries; ep; ep = ep->next)
+    if (ep->wd == wd)
+      return;
+  inotify_rm_watch(bcast_cache.fd, wd);
+}
+
+
+/* Evict the least recently used entry. */
+static void
+bcast_cache_evict(void)
+{
+  struct msgq_bcast_entry **pp, *ep;
+
+  for (pp = &bcast_cache.entries; (*pp)->next; pp = &(*pp)->next)
+    ;
+  ep = *pp;
+  *pp = NULL;
+  bcast_cache.count--;
+
+  bcast_cache_unwatch(ep->wd);
+  bcast_entry_unref(ep);
+}
+
+
+/*
+ * Return the subscriber list for PATTERN, with a reference that the
+ * caller should drop with bcast_entry_unref().  Returns NULL if the
+ * directory cannot be scanned.
+ */
+static struct msgq_bcast_entry *
+bcast_cache_get(const char *pattern)
+{
+  struct msgq_bcast_entry **pp, *ep, *np;
+  char dir[PATH_MAX];
+  int wd;
+
+  LOCK(&bcast_cache.mutex, "bcast");
+
+  if (bcast_cache.fd == -2) {
+    bcast_cache.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (bcast_cache.fd < 0)
+      WARN(errno, "inotify_init1(2) failed, broadcast will not be cached");
+  }
+  if (bcast_cache.fd < 0) {
+    UNLOCK(&bcast_cache.mutex, "bcast");
+    return bcast_scan(pattern);
+  }
+
+  bcast_cache_poll();
+
+  for (pp = &bcast_cache.entries; (ep = *pp) != NULL; pp = &ep->next)
+    if (strcmp(ep->pattern, pattern) == 0)
+      break;
+
+  if (ep && !ep->stale) {
+    /* move to the front */
+    *pp = ep->next;
+    ep->next = bcast_cache.entries;
+    bcast_cache.entries = ep;
+    __atomic_add_fetch(&ep->refs, 1, __ATOMIC_RELAXED);
+    UNLOCK(&bcast_cache.mutex, "bcast");
+    return ep;
+  }
+
+  /* Drop the old entry; a broadcast using it still holds a reference. */
+  if (ep) {
+    *pp = ep->next;
+    bcast_cache.count--;
+    bcast_entry_unref(ep);
+  }
+
+  /* Watch before scanning, so that no change after the scan is lost. */
+  wd = -1;
+  if (bcast_split(pattern, dir) >= 0) {
+    wd = inotify_add_watch(bcast_cache.fd, dir, MSGQ_BCAST_EVENTS | IN_ONLYDIR);
+    if (wd < 0)
+      WARN(errno, "inotify_add_watch(2) failed on %s", dir);
+  }
+  np = bcast_scan(pattern);
+  if (!np || wd < 0) {
+    if (wd >= 0)
+      bcast_cache_unwatch(wd);
+    UNLOCK(&bcast_cache.mutex, "bcast");
+    return np;
+  }
+
+  np->wd = wd;
+  np->refs = 2;                 /* the cache and the caller */
+  np->next = bcast_cache.entries;
+  bcast_cache.entries = np;
+  if (++bcast_cache.count > MSGQ_BCAST_CACHE_MAX)
+    bcast_cache_evict();
+
+  UNLOCK(&bcast_cache.mutex, "bcast");
+  return np;
+}
+
+
 int
 msgq_broadcast_wildcard(MSGQ *msgq, const char *pattern,
                          const struct msgq_packet *packet)
 {
-  sglob_t gbuf;
-  int i;
+  struct msgq_bcast_entry *ep;
+  struct msgq_bcast_dest *dp;
+  struct mmsghdr hdr[MSGQ_BCAST_CHUNK];
+  struct msgq_bcast_dest *dest[MSGQ_BCAST_CHUNK];
+  struct iovec iov;
+  size_t next;
+  int i, n, ret;
+
+  ep = bcast_cache_get(pattern);
+  if (!ep)
+    return -1;
+
+  if (sizeof_packet(packet) > MSGQ_MSG_MAX) {
+    for (next = 0; next < ep->count; next++) {
+      dp = &ep->dests[next];
+      if (__atomic_load_n(&dp->dead, __ATOMIC_RELAXED))
+        continue;
+      ret = msgq_send_frags(msgq, &dp->addr, packet);
+      msgq_count_send(msgq, ret, 1, packet->size);
+      if (ret < 0 && errno == ECONNREFUSED)
+        __atomic_store_n(&dp->dead, 1, __ATOMIC_RELAXED);
+    }
+    bcast_entry_unref(ep);
+    return 0;
+  }
+
+  /* Every subscriber gets the same buffer. */
+  iov.iov_base = (void *)packet;
+  iov.iov_len = sizeof_packet(packet);
+
+  next = 0;
+  n = 0;
+  while (next < ep->count || n > 0) {
+    /* Refill the chunk, skipping the subscribers known to be dead. */
+    for (; n < MSGQ_BCAST_CHUNK && next < ep->count; next++) {
+      dp = &ep->dests[next];
+      if (__atomic_load_n(&dp->dead, __ATOMIC_RELAXED))
+        continue;
+      dest[n] = dp;
+      memset(&hdr[n], 0, sizeof(hdr[n]));
+      hdr[n].msg_hdr.msg_name = &dp->addr;
+      hdr[n].msg_hdr.msg_namelen = sizeof(dp->addr);
+      hdr[n].msg_hdr.msg_iov = &iov;
+      hdr[n].msg_hdr.msg_iovlen = 1;
+      n++;
+    }
+    if (n == 0)
+      break;
+
+    /* sendmmsg(2) fails only if the first packet fails, and stops
+     * before the first failure otherwise. */
+    ret = sendmmsg(msgq->fd, hdr, n, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      DEBUG(errno, "msgq_broadcast_wildcard: failed to send to |%s|",
+            dest[0]->addr.sun_path);
+      /* A socket file left by a dead process.  A new listener would
+       * create a new file, which makes this entry stale. */
+      if (errno == ECONNREFUSED)
+        __atomic_store_n(&dest[0]->dead, 1, __ATOMIC_RELAXED);
+      msgq_count_send(msgq, -1, 1, 0);
+      ret = 1;
+    }
+    else
+      msgq_count_send(msgq, 0, ret, (unsigned long)ret * packet->size);
+
+    n -= ret;
+    for (i = 0; i < n; i++) {
+      hdr[i] = hdr[i + ret];
+      dest[i] = dest[i + ret];
+    }
+  }
+
+  bcast_entry_unref(ep);
+  return 0;
+}
+#endif  /* MSGQ_BROADCAST */
+
+
+/*
+ * Shared-memory transport
+ *
+ * msgq_open("shm:/NAME") creates a ring buffer in the POSIX shared
+ * memory object "/NAME" instead of a UNIX domain socket.  Senders map
+ * the ring on their first msgq_send*() to "shm:/NAME", and write each
+ * packet directly into it; the receiver hands out pointers into the
+ * ring, so a packet is never copied through the kernel.  A record is
+ * released back to the ring by msgq_pkt_delete().
+ *
+ * The ring is a multi-producer, single-owner byte ring, much like the
+ * Aeron many-to-one ring buffer:
+ *
+ *  - A sender reserves a record by advancing 'tail' with CAS.  If the
+ *    record does not fit before the end of the ring, it reserves a
+ *    MSGQ_REC_PAD record up to the end, and starts over at offset 0.
+ *    After filling the record, it publishes it by storing
+ *    MSGQ_REC_READY to its 'state'.
+ *
+ *  - The consumers of the owner process take READY records in order
+ *    at 'rpos' under 'pop_mutex'.  A record whose state is still
+ *    MSGQ_REC_EMPTY is being written, so the consumer waits for it.
+ *
+ *  - Taken records may be deleted in any order.  Releasing advances
+ *    'head' over the deleted records at the front of the ring, and
+ *    zeroes them, so that every unpublished record reads as
+ *    MSGQ_REC_EMPTY.
+ *
+ * Both sides sleep on futex words in the shared header; 'seq' for
+ * the consumers of an empty ring, and 'space_seq' for the senders of a
+ * full one.  futex(2) on shared memory works across processes without
+ * passing any file descriptor, unlike eventfd(2).
+ *
+ * A sender that dies in the middle of writing a record stalls the
+ * ring, since the record never becomes READY.
+ */
+#define MSGQ_SHM_PREFIX         "shm:"
+#define MSGQ_SHM_MAGIC          0x4d534851      /* "MSHQ" */
+
+#define MSGQ_REC_EMPTY          0
+#define MSGQ_REC_READY          1
+#define MSGQ_REC_PAD            2
+#define MSGQ_REC_TAKEN          3
+#define MSGQ_REC_DONE           4
+
+#define MSGQ_REC_ALIGN(x)       (((x) + 7) & ~(size_t)7)
+
+/*
+ * Bit 0 of 'container' tells that the packet lives in a ring.  The
+ * rest points the struct msgq_shm_hdr of the ring while the packet is
+ * reserved by msgq_pkt_reserve(), and the struct msgq_ring of the
+ * owner once the packet is taken.
+ */
+#define MSGQ_CONTAINER_RING     ((uintptr_t)1)
+
+struct msgq_shm_hdr {
+  uint32_t magic;
+  uint32_t size;                /* size of 'data' in bytes, power of two */
+  uint32_t closed;              /* nonzero once the owner closed it */
+
+  uint64_t tail __attribute__((aligned(64)));  /* reserved by senders */
+  uint32_t space_seq;           /* futex word; bumped when 'head' moves */
+  uint32_t space_waiters;
+
+  uint64_t head __attribute__((aligned(64)));  /* released by the owner */
+  uint32_t seq;                 /* futex word; bumped on every commit */
+  uint32_t waiters;
+  int32_t count;                /* committed, but not yet taken */
+
+  char data[] __attribute__((aligned(64)));
+};
+
+struct msgq_shm_rec {
+  uint32_t state;               /* MSGQ_REC_* */
+  uint32_t len;                 /* length of the whole record */
+  uint64_t stamp;               /* CLOCK_MONOTONIC ns of the commit */
+  char sender[UNIX_PATH_MAX];
+  struct msgq_packet packet;
+};
+
+/*
+ * A mapping of a ring, either the one that this MSGQ owns, or the
+ * one of a remote MSGQ that this MSGQ sent to.
+ */
+struct msgq_ring {
+  struct msgq_ring *next;       /* next peer ring */
+  struct msgq_ring *retired;    /* previous mapping of a reopened peer */
+  struct msgq_shm_hdr *hdr;
+  size_t maplen;
+  uint64_t rpos;                /* next record to take, under 'pop_mutex' */
+  pthread_mutex_t free_mutex;   /* serializes advancing 'head' */
+  long refs;                    /* owner ring: the MSGQ + taken packets */
+  char name[UNIX_PATH_MAX];     /* "/NAME" */
+};
+
+
+static int
+is_shm_address(const char *address)
+{
+  return address && strncmp(address, MSGQ_SHM_PREFIX,
+                            sizeof(MSGQ_SHM_PREFIX) - 1) == 0;
+}
+
+
+static long
+futex_wait_shared(uint32_t *addr, uint32_t val, const struct timespec *abstime)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME,
+                 val, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+
+static long
+futex_wake_shared(uint32_t *addr, int count)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+
+/*
+ * Map the ring in the shared memory object NAME.  If CREATE is
+ * nonzero, create the object with a ring of MSGQ_SHM_SIZE bytes,
+ * replacing any stale one.
+ */
+static struct msgq_ring *
+msgq_ring_map(const char *name, int create)
+{
+  struct msgq_ring *ring;
+  struct stat sbuf;
+  void *addr;
+  int fd, saved_errno;
+
+  if (name[0] != '/' || strchr(name + 1, '/') ||
+      strlen(name) >= sizeof(ring->name)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ring = malloc(sizeof(*ring));
+  if (!ring)
+    return NULL;
+  memset(ring, 0, sizeof(*ring));
+  strcpy(ring->name, name);
+
+  if (create) {
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, MSGQ_PERM_DEFAULT);
+    if (fd >= 0 && ftruncate(fd, sizeof(struct msgq_shm_hdr)
+                             + MSGQ_SHM_SIZE) < 0) {
+      saved_errno = errno;
+      close(fd);
+      shm_unlink(name);
+      errno = saved_errno;
+      fd = -1;
+    }
+  }
+  else
+    fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    WARN(errno, "shm_open(3) failed on %s", name);
+    goto err;
+  }
+
+  if (fstat(fd, &sbuf) < 0 ||
+      sbuf.st_size < (off_t)sizeof(struct msgq_shm_hdr)) {
+    saved_errno = errno ? errno : EINVAL;
+    close(fd);
+    errno = saved_errno;
+    goto err;
+  }
+  ring->maplen = sbuf.st_size;
+
+  addr = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  saved_errno = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    errno = saved_errno;
+    WARN(errno, "mmap(2) failed on %s", name);
+    goto err;
+  }
+  ring->hdr = addr;
+
+  if (create) {
+    ring->hdr->size = MSGQ_SHM_SIZE;
+    __atomic_store_n(&ring->hdr->magic, MSGQ_SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+  else if (__atomic_load_n(&ring->hdr->magic,
+                           __ATOMIC_ACQUIRE) != MSGQ_SHM_MAGIC ||
+           ring->hdr->size + sizeof(struct msgq_shm_hdr) > ring->maplen) {
+    munmap(addr, ring->maplen);
+    errno = ECONNREFUSED;
+    goto err;
+  }
+
+  pthread_mutex_init(&ring->free_mutex, NULL);
+  ring->refs = 1;
+  return ring;
+
+ err:
+  saved_errno = errno;
+  free(ring);
+  errno = saved_errno;
+  return NULL;
+}
+
+
+/*
+ * Drop a reference to the ring that a MSGQ owns; the last one unmaps
+ * it.
+ */
+static void
+msgq_ring_unref(struct msgq_ring *ring)
+{
+  if (__atomic_sub_fetch(&ring->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    msgq_ring_unmap(ring);
+}
+
+
+static void
+msgq_ring_unmap(struct msgq_ring *ring)
+{
+  struct msgq_ring *r;
+
+  while (ring) {
+    r = ring->retired;
+    munmap(ring->hdr, ring->maplen);
+    pthread_mutex_destroy(&ring->free_mutex);
+    free(ring);
+    ring = r;
+  }
+}
+
+
+/*
+ * Find the ring of the remote "shm:/NAME" address RECEIVER, mapping
+ * it on the first use.  The list of peers only grows until
+ * msgq_close(), so it is searched without a lock.
+ */
+static struct msgq_ring *
+msgq_ring_peer(MSGQ *msgq, const char *receiver)
+{
+  const char *name = receiver + sizeof(MSGQ_SHM_PREFIX) - 1;
+  struct msgq_ring *ring, *fresh;
+
+  for (ring = __atomic_load_n(&msgq->peers, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+    if (strcmp(ring->name, name) == 0)
+      break;
+
+  if (ring &&
+      !__atomic_load_n(&__atomic_load_n(&ring->hdr, __ATOMIC_ACQUIRE)->closed,
+                       __ATOMIC_ACQUIRE))
+    return ring;
+
+  LOCK(&msgq->peer_mutex, "peer");
+  if (ring) {
+    /* The owner closed the ring; it may have been created again.
+     * Other senders may still use the old mapping, so keep it until
+     * msgq_close(). */
+    if (ring->hdr->closed) {
+      fresh = msgq_ring_map(name, 0);
+      if (!fresh) {
+        UNLOCK(&msgq->peer_mutex, "peer");
+        errno = ECONNREFUSED;
+        return NULL;
+      }
+      fresh->retired = ring->retired;
+      ring->retired = fresh;
+      /* swap the mappings, so that 'ring' stays in the list */
+      {
+        struct msgq_shm_hdr *hdr = fresh->hdr;
+        size_t maplen = fresh->maplen;
+
+        fresh->hdr = ring->hdr;
+        fresh->maplen = ring->maplen;
+        ring->maplen = maplen;
+        __atomic_store_n(&ring->hdr, hdr, __ATOMIC_RELEASE);
+      }
+    }
+  }
+  else {
+    for (ring = msgq->peers; ring != NULL; ring = ring->next)
+      if (strcmp(ring->name, name) == 0)
+        break;
+    if (!ring) {
+      ring = msgq_ring_map(name, 0);
+      if (ring) {
+        ring->next = msgq->peers;
+        __atomic_store_n(&msgq->peers, ring, __ATOMIC_RELEASE);
+      }
+    }
+  }
+  UNLOCK(&msgq->peer_mutex, "peer");
+
+  if (!ring && errno == ENOENT)
+    errno = ECONNREFUSED;
+  return ring;
+}
+
+
+/*
+ * Reserve a record for a packet of SIZE bytes in RING, and fill its
+ * header.  If the ring is full, wait for room unless NONBLOCK is
+ * nonzero, in which case fail with EAGAIN.
+ */
+static struct msgq_shm_rec *
+msgq_ring_reserve(MSGQ *msgq, struct msgq_ring *ring, size_t size,
+                  int nonblock)
+{
+  struct msgq_shm_hdr *hdr = __atomic_load_n(&ring->hdr, __ATOMIC_ACQUIRE);
+  struct msgq_shm_rec *rec;
+  uint64_t tail, head, off, pad;
+  uint32_t space;
+  size_t len;
+
+  len = MSGQ_REC_ALIGN(sizeof(*rec) + size + 1);
+  if (len > hdr->size / 2) {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+
+  while (1) {
+    space = __atomic_load_n(&hdr->space_seq, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+    off = tail & (hdr->size - 1);
+    pad = (off + len > hdr->size) ? hdr->size - off : 0;
+
+    if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+      errno = ECONNREFUSED;
+      return NULL;
+    }
+
+    if (tail + pad + len - head > hdr->size) {
+      if (nonblock) {
+        errno = EAGAIN;
+        return NULL;
+      }
+      __atomic_add_fetch(&hdr->space_waiters, 1, __ATOMIC_SEQ_CST);
+      futex_wait_shared(&hdr->space_seq, space, NULL);
+      __atomic_sub_fetch(&hdr->space_waiters, 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    if (__atomic_compare_exchange_n(&hdr->tail, &tail, tail + pad + len, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (pad) {
+    rec = (struct msgq_shm_rec *)(hdr->data + off);
+    rec->len = pad;
+    __atomic_store_n(&rec->state, MSGQ_REC_PAD, __ATOMIC_RELEASE);
+    off = 0;
+  }
+
+  rec = (struct msgq_shm_rec *)(hdr->data + off);
+  rec->len = len;
+  strncpy(rec->sender, msgq->address, sizeof(rec->sender) - 1);
+  rec->sender[sizeof(rec->sender) - 1] = '\0';
+  rec->packet.container = (void *)((uintptr_t)hdr | MSGQ_CONTAINER_RING);
+  rec->packet.size = size;
+  rec->packet.data[size] = '\0';
+  return rec;
+}
+
+
+/*
+ * Publish the reserved record REC.
+ */
+static void
+msgq_ring_commit(struct msgq_shm_rec *rec)
+{
+  struct msgq_shm_hdr *hdr;
+
+  hdr = (struct msgq_shm_hdr *)((uintptr_t)rec->packet.container
+                                & ~MSGQ_CONTAINER_RING);
+  rec->packet.container = NULL;
+  rec->stamp = msgq_clock();
+  __atomic_store_n(&rec->state, MSGQ_REC_READY, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&hdr->count, 1, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex_wake_shared(&hdr->seq, INT_MAX);
+}
+
+
+static int
+msgq_ring_send(MSGQ *msgq, const char *receiver,
+               const struct msgq_packet *packet, int nonblock)
+{
+  struct msgq_ring *ring;
+  struct msgq_shm_rec *rec;
+
+  ring = msgq_ring_peer(msgq, receiver);
+  if (!ring) {
+    msgq_count_send(msgq, -1, 1, 0);
+    return -1;
+  }
+  rec = msgq_ring_reserve(msgq, ring, packet->size, nonblock);
+  if (!rec) {
+    msgq_count_send(msgq, -1, 1, 0);
+    return -1;
+  }
+  memcpy(rec->packet.data, packet->data, packet->size);
+  msgq_ring_commit(rec);
+  msgq_count_send(msgq, 0, 1, packet->size);
+  return 0;
+}
+
+
+/*
+ * Take up to COUNT packets from the ring that MSGQ owns.  The caller
+ * must hold 'pop_mutex'.
+ */
+static int
+msgq_ring_take(MSGQ *msgq, struct msgq_packet **packets, size_t count)
+{
+  struct msgq_ring *ring = msgq->ring;
+  struct msgq_shm_hdr *hdr = ring->hdr;
+  struct msgq_shm_rec *rec;
+  uint32_t state;
+  unsigned long bytes = 0;
+  long depth;
+  size_t i = 0;
+
+  depth = __atomic_load_n(&hdr->count, __ATOMIC_RELAXED);
+  if (depth > msgq->st_depth_max)
+    __atomic_store_n(&msgq->st_depth_max, depth, __ATOMIC_RELAXED);
+
+  while (i < count) {
+    rec = (struct msgq_shm_rec *)(hdr->data + (ring->rpos & (hdr->size - 1)));
+    state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+
+    if (state == MSGQ_REC_PAD) {
+      /* msgq_ring_release() reads 'rpos' without the pop lock */
+      __atomic_store_n(&ring->rpos, ring->rpos + rec->len, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (state != MSGQ_REC_READY)
+      break;
+
+    __atomic_store_n(&rec->state, MSGQ_REC_TAKEN, __ATOMIC_RELAXED);
+    rec->packet.container = (void *)((uintptr_t)ring | MSGQ_CONTAINER_RING);
+    __atomic_add_fetch(&ring->refs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->rpos, ring->rpos + rec->len, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&hdr->count, 1, __ATOMIC_RELAXED);
+    bytes += rec->packet.size;
+    packets[i++] = &rec->packet;
+  }
+
+  __atomic_store_n(&msgq->st_received, msgq->st_received + i,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&msgq->st_received_bytes, msgq->st_received_bytes + bytes,
+                   __ATOMIC_RELAXED);
+  return (int)i;
+}
+
+
+/*
+ * Release the record of PACKET, which was taken from RING.
+ */
+static void
+msgq_ring_release(struct msgq_ring *ring, struct msgq_packet *packet)
+{
+  struct msgq_shm_hdr *hdr = ring->hdr;
+  struct msgq_shm_rec *rec;
+  uint64_t head, rpos;
+  uint32_t state, len;
+  int moved = 0;
+
+  rec = ELIST_ENTRY(packet, struct msgq_shm_rec, packet);
+  __atomic_store_n(&rec->state, MSGQ_REC_DONE, __ATOMIC_RELEASE);
+
+  LOCK(&ring->free_mutex, "free");
+  head = hdr->head;
+  rpos = __atomic_load_n(&ring->rpos, __ATOMIC_ACQUIRE);
+  while (head < rpos) {
+    rec = (struct msgq_shm_rec *)(hdr->data + (head & (hdr->size - 1)));
+    state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+    if (state != MSGQ_REC_DONE && state != MSGQ_REC_PAD)
+      break;
+    len = rec->len;
+    memset(rec, 0, len);
+    head += len;
+    moved = 1;
+  }
+  if (moved)
+    __atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+  UNLOCK(&ring->free_mutex, "free");
+
+  if (moved) {
+    __atomic_add_fetch(&hdr->space_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->space_waiters, __ATOMIC_SEQ_CST) > 0)
+      futex_wake_shared(&hdr->space_seq, INT_MAX);
+  }
+  msgq_ring_unref(ring);
+}
+
+
+struct msgq_packet *
+msgq_pkt_reserve(MSGQ *msgq, const char *receiver, size_t size)
+{
+  struct msgq_ring *ring;
+  struct msgq_shm_rec *rec;
+
+  if (!is_shm_address(receiver)) {
+    errno = EAFNOSUPPORT;
+    return NULL;
+  }
+  ring = msgq_ring_peer(msgq, receiver);
+  if (!ring)
+    return NULL;
+  rec = msgq_ring_reserve(msgq, ring, size, 0);
+  if (!rec)
+    return NULL;
+  return &rec->packet;
+}
+
+
+static const char *
+msgq_ring_sender(struct msgq_packet *packet)
+{
+  return ELIST_ENTRY(packet, struct msgq_shm_rec, packet)->sender;
+}
+
+
+static uint64_t
+msgq_ring_stamp(struct msgq_packet *packet)
+{
+  return ELIST_ENTRY(packet, struct msgq_shm_rec, packet)->stamp;
+}
+
+
+/* Return nonzero if the ring PACKET was taken by msgq_ring_take(). */
+static int
+msgq_ring_taken(struct msgq_packet *packet)
+{
+  struct msgq_shm_rec *rec = ELIST_ENTRY(packet, struct msgq_shm_rec, packet);
+
+  return __atomic_load_n(&rec->state, __ATOMIC_RELAXED) == MSGQ_REC_TAKEN;
+}
+
+
+static int
+msgq_ring_count(MSGQ *msgq)
+{
+  return __atomic_load_n(&msgq->ring->hdr->count, __ATOMIC_RELAXED);
+}
+
+
+static uint32_t
+msgq_ring_seq(MSGQ *msgq)
+{
+  return __atomic_load_n(&msgq->ring->hdr->seq, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Sleep until a sender commits a record after SEQ was read, or until
+ * ABSTIME.  Returns like futex(2).
+ */
+static long
+msgq_ring_sleep(MSGQ *msgq, uint32_t seq, const struct timespec *abstime)
+{
+  struct msgq_shm_hdr *hdr = msgq->ring->hdr;
+  long ret;
+
+  __atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  ret = futex_wait_shared(&hdr->seq, seq, abstime);
+  __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+
+/*
+ * Set up MSGQ to receive from the ring of ADDRESS ("shm:/NAME")
+ * instead of a UNIX domain socket.  'fd' becomes an unbound socket,
+ * so that MSGQ can still send to socket addresses.
+ */
+static int
+msgq_ring_open(MSGQ *msgq, const char *address)
+{
+  const char *name = address + sizeof(MSGQ_SHM_PREFIX) - 1;
+
+  if (strlen(address) >= sizeof(msgq->address)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  msgq->ring = msgq_ring_map(name, 1);
+  if (!msgq->ring)
+    return -1;
+
+  msgq->fd = socket(AF_LOCAL, SOCK_DGRAM, 0);
+  if (msgq->fd < 0) {
+    WARN(errno, "socket(2) failed");
+    shm_unlink(name);
+    msgq_ring_unmap(msgq->ring);
+    msgq->ring = NULL;
+    return -1;
+  }
+  strcpy(msgq->address, address);
+  return 0;
+}
+
+
+/*
+ * Close the ring that MSGQ owns.  Waiting senders fail with
+ * ECONNREFUSED, and waiting consumers with EADDRNOTAVAIL.  Packets
+ * taken from the ring remain valid until msgq_pkt_delete().
+ */
+static void
+msgq_ring_close(MSGQ *msgq)
+{
+  struct msgq_shm_hdr *hdr = msgq->ring->hdr;
+
+  shm_unlink(msgq->ring->name);
+
+  __atomic_store_n(&hdr->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&hdr->space_seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake_shared(&hdr->space_seq, INT_MAX);
+
+  __atomic_store_n(&msgq->receiver_status, MSGQ_STAT_DEAD, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake_shared(&hdr->seq, INT_MAX);
+
+  msgq_ring_unref(msgq->ring);
+  msgq->ring = NULL;
+}
 
-  gbuf.mask = S_IFSOCK;
 
-  if (sglob(pattern, SGLOB_MASK, &gbuf) < 0)
+int
+msgq_pkt_commit(MSGQ *msgq, struct msgq_packet *packet)
+{
+  struct msgq_shm_rec *rec;
+
+  /*
+   * A reserved record is still MSGQ_REC_EMPTY; a packet taken from a
+   * ring carries the same tag, but must not be committed again.
+   */
+  rec = ELIST_ENTRY(packet, struct msgq_shm_rec, packet);
+  if (!((uintptr_t)packet->container & MSGQ_CONTAINER_RING) ||
+      __atomic_load_n(&rec->state, __ATOMIC_RELAXED) != MSGQ_REC_EMPTY) {
+    errno = EINVAL;
     return -1;
-
-  for (i = 0; i < gbuf.pathc; i++) {
-    DEBUG(0, "msgq_broadcast_wildcard: to |%s|...", gbuf.pathv[i]);
-    msgq_send_(msgq, gbuf.pathv[i], packet);
   }
-
-  sglobfree(&gbuf);
+  msgq_ring_commit(rec);
+  msgq_count_send(msgq, 0, 1, packet->size);
   return 0;
 }
-#endif  /* MSGQ_BROADCAST */
 
 
 MSGQ *
 msgq_open(const char *address)
+{
+  return msgq_open_reactor(NULL, address);
+}
+
+
+MSGQ *
+msgq_open_reactor(MSGQ_REACTOR *reactor, const char *address)
 {
   MSGQ *p;
   pthread_mutexattr_t attr;
@@ -570,17 +2334,29 @@ msgq_open(const char *address)
     return NULL;
 
   memset(p, 0, sizeof(*p));
+  pthread_mutex_init(&p->peer_mutex, NULL);
+
+  if (is_shm_address(address))
+    reactor = NULL;
 
-  p->pkbuf = malloc(MSGQ_MSG_MAX);
-  if (!p->pkbuf) {
+  /* A reactor-served MSGQ receives into the buffer of its loop. */
+  if (!reactor)
+    p->pkbuf = malloc(MSGQ_MSG_MAX * MSGQ_BATCH);
+  p->pool = msgq_pool_new();
+  if ((!reactor && !p->pkbuf) || !p->pool) {
     saved_errno = errno;
+    free(p->pkbuf);
+    free(p->pool);
     free(p);
     errno = saved_errno;
     return NULL;
   }
 
   p->fd = -1;
-  ELIST_INIT(p->recvq);
+  p->qstub.next = NULL;
+  p->qhead = p->qtail = &p->qstub;
+  p->qseq = 0;
+  p->qwaiters = 0;
   p->recvs = 0;
   p->broadcast = 0;
 
@@ -594,8 +2370,8 @@ msgq_open(const char *address)
   }
   pthread_mutexattr_destroy(&attr);
 
-  if ((saved_errno = pthread_cond_init(&p->recv_cond, NULL)) != 0) {
-    WARN(errno, "pthread_cond_init(3) failed");
+  if ((saved_errno = pthread_mutex_init(&p->pop_mutex, NULL)) != 0) {
+    WARN(errno, "pthread_mutex_init(3) failed");
     goto err_cond_recv;
   }
 
@@ -607,10 +2383,30 @@ msgq_open(const char *address)
   MSGQ_LOCK(p);
   p->receiver_status = MSGQ_STAT_INIT;
 
+  if (is_shm_address(address)) {
+    /* No receiver thread; senders write into the ring directly. */
+    if (msgq_ring_open(p, address) < 0) {
+      saved_errno = errno;
+      goto err;
+    }
+    p->receiver_status = MSGQ_STAT_ALIVE;
+    MSGQ_UNLOCK(p);
+    return p;
+  }
+
   if (msgq_get_listener(p, address) < 0) {
     saved_errno = errno;
     goto err;
   }
+  if (reactor) {
+    p->receiver_status = MSGQ_STAT_ALIVE;
+    if (msgq_reactor_attach(reactor, p) < 0) {
+      saved_errno = errno;
+      goto err;
+    }
+    MSGQ_UNLOCK(p);
+    return p;
+  }
   if (msgq_start_receiver(p) < 0) {
     saved_errno = errno;
     goto err;
@@ -623,7 +2419,7 @@ msgq_open(const char *address)
  err:
   pthread_cond_destroy(&p->stat_cond);
  err_cond:
-  pthread_cond_destroy(&p->recv_cond);
+  pthread_mutex_destroy(&p->pop_mutex);
  err_cond_recv:
   MSGQ_UNLOCK(p);
   if (p->fd >= 0)
@@ -632,6 +2428,7 @@ msgq_open(const char *address)
  err_free_livemutex:
   if (p->pkbuf)
     free(p->pkbuf);
+  msgq_pool_unref(p->pool);
   if (p)
     free(p);
   errno = saved_errno;
@@ -643,8 +2440,8 @@ int
 msgq_close(MSGQ *msgq)
 {
   void *retval;
-  struct elist *p;
   struct msgq_node *np;
+  struct msgq_ring *ring;
   int saved_errno;
 
 #if 0
@@ -655,12 +2452,24 @@ msgq_close(MSGQ *msgq)
   }
 #endif  /* 0 */
 
-  msgq_send_string(msgq, msgq->address, "shutdown");
+  if (msgq->ring)
+    msgq_ring_close(msgq);
+  else if (msgq->loop) {
+    /* The loop detaches MSGQ on "shutdown", or by itself on error. */
+    msgq_set_hwm(msgq, 0);
+    if (msgq_wait(msgq, MSGQ_STAT_NONE) != MSGQ_STAT_DEAD)
+      msgq_send_string(msgq, msgq->address, "shutdown");
+    msgq_wait(msgq, MSGQ_STAT_DEAD);
+  }
+  else {
+    msgq_set_hwm(msgq, 0);      /* a paused receiver would not read it */
+    msgq_send_string(msgq, msgq->address, "shutdown");
 
-  if ((saved_errno = pthread_join(msgq->receiver, &retval)) != 0) {
-    WARN(saved_errno, "pthread_join() failed");
-    errno = saved_errno;
-    return -1;
+    if ((saved_errno = pthread_join(msgq->receiver, &retval)) != 0) {
+      WARN(saved_errno, "pthread_join() failed");
+      errno = saved_errno;
+      return -1;
+    }
   }
 
   MSGQ_LOCK(msgq);
@@ -675,21 +2484,32 @@ msgq_close(MSGQ *msgq)
     msgq->pkbuf = NULL;
   }
 
+  MSGQ_UNLOCK(msgq);
+
   /* TODO: delete all remaining packets??? */
-  DEBUG(0, "%u packet(s) will be destroyed", msgq->recvs);
+  DEBUG(0, "%ld packet(s) will be destroyed", msgq->recvs);
 
-  while ((p = edque_pop_front(&msgq->recvq)) != NULL) {
-    np = ELIST_ENTRY(p, struct msgq_node, link);
-    msgq->recvs--;
+  msgq_reasm_clear(msgq);
 
+  LOCK(&msgq->pop_mutex, "pop");
+  while ((np = msgq_queue_pop(msgq)) != NULL) {
     DEBUG(0, "\tdestroying packet from %s...", np->sender);
-    free(np->packet);
-    free(np);
+    msgq_node_delete(np);
   }
+  UNLOCK(&msgq->pop_mutex, "pop");
 
-  MSGQ_UNLOCK(msgq);
+  /* Packets that users still hold keep the pool alive. */
+  msgq_pool_unref(msgq->pool);
+
+  while ((ring = msgq->peers) != NULL) {
+    msgq->peers = ring->next;
+    msgq_ring_unmap(ring);
+  }
 
   /* TODO: possible race condition? */
+  pthread_mutex_destroy(&msgq->peer_mutex);
+  pthread_mutex_destroy(&msgq->pop_mutex);
+  pthread_cond_destroy(&msgq->stat_cond);
   pthread_mutex_destroy(&msgq->recv_mutex);
   free(msgq);
 
@@ -802,8 +2622,13 @@ bind_anonymous(int fd, char address[])
 }
 
 
+/*
+ * Create a thread running START(ARG), with the signals blocked as
+ * described in 'block_all_signals'.  Used for both the receiver
+ * thread of a MSGQ and the reactor loops.
+ */
 static int
-msgq_start_receiver(MSGQ *msgq)
+msgq_create_thread(pthread_t *thread, void *(*start)(void *), void *arg)
 {
   sigset_t cur, old;
   int ret = 0;
@@ -820,7 +2645,7 @@ msgq_start_receiver(MSGQ *msgq)
     SIGTSTP,
   };
   size_t i;
-  int saved_errno;
+  int saved_errno = 0;
 
   sigemptyset(&old);
   sigemptyset(&cur);
@@ -836,8 +2661,7 @@ msgq_start_receiver(MSGQ *msgq)
 
   pthread_sigmask(SIG_SETMASK, &cur, NULL);
 
-  if ((ret = pthread_create(&msgq->receiver, NULL,
-                            msgq_receiver, (void *)msgq)) != 0) {
+  if ((ret = pthread_create(thread, NULL, start, arg)) != 0) {
     WARN(ret, "pthread_create(3) failed");
     saved_errno = ret;
     ret = -1;
@@ -850,6 +2674,13 @@ msgq_start_receiver(MSGQ *msgq)
 }
 
 
+static int
+msgq_start_receiver(MSGQ *msgq)
+{
+  return msgq_create_thread(&msgq->receiver, msgq_receiver, (void *)msgq);
+}
+
+
 #if 0
 static void
 msgq_receiver_cleaner(void *arg)
@@ -862,101 +2693,431 @@ msgq_receiver_cleaner(void *arg)
 #endif  /* 0 */
 
 
-static void *
-msgq_receiver(void *arg)
+/*
+ * Receive one batch of up to VLEN (at most MSGQ_BATCH) packets from the
+ * socket of MSGQ into BUF, which has room for MSGQ_BATCH * MSGQ_MSG_MAX
+ * bytes, and push them to the receive queue.  FLAGS is passed to
+ * recvmmsg(2).
+ *
+ * Returns the number of received datagrams, or -1 with 'errno' set.
+ * If the batch contains the "shutdown" self-control message, *QUIT is
+ * set to nonzero, and the rest of the batch is dropped.
+ */
+static int
+msgq_drain(MSGQ *msgq, unsigned char *buf, unsigned int vlen, int flags,
+           int *quit)
 {
-  int fd;
-  struct sockaddr_un addr;
-  socklen_t addrlen;
-  ssize_t len;
+  struct sockaddr_un addr[MSGQ_BATCH];
+  struct mmsghdr hdr[MSGQ_BATCH];
+  struct iovec iov[MSGQ_BATCH];
+  struct msgq_link *first, *last;
+  uint64_t stamp;
+  unsigned long bytes;
+  size_t pathlen;
+  int i, n, nbatch;
   struct msgq_packet *packet;
   struct msgq_node *np;
+
+  memset(hdr, 0, sizeof(hdr));
+  for (i = 0; i < MSGQ_BATCH; i++) {
+    iov[i].iov_base = buf + i * MSGQ_MSG_MAX;
+    iov[i].iov_len = MSGQ_MSG_MAX;
+    hdr[i].msg_hdr.msg_name = &addr[i];
+    hdr[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+    hdr[i].msg_hdr.msg_iov = &iov[i];
+    hdr[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  n = recvmmsg(msgq->fd, hdr, vlen, flags, NULL);
+  if (n <= 0)
+    return n;
+
+  stamp = msgq_clock();
+  first = last = NULL;
+  nbatch = 0;
+  bytes = 0;
+
+  for (i = 0; i < n; i++) {
+    /* An unbound sender has no address. */
+    pathlen = hdr[i].msg_hdr.msg_namelen - offsetof(struct sockaddr_un,
+                                                    sun_path);
+    if (hdr[i].msg_hdr.msg_namelen <= offsetof(struct sockaddr_un, sun_path))
+      pathlen = 0;
+    if (pathlen < sizeof(addr[i].sun_path))
+      addr[i].sun_path[pathlen] = '\0';
+
+    packet = (struct msgq_packet *)iov[i].iov_base;
+    if (hdr[i].msg_len >= sizeof(struct msgq_frag) &&
+        (packet->size & MSGQ_FRAG_BIT) &&
+        !(hdr[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+      np = msgq_reasm_add(msgq, addr[i].sun_path,
+                          (struct msgq_frag *)packet, hdr[i].msg_len);
+      if (!np)
+        continue;               /* not yet complete */
+    }
+    else {
+      if (validate_packet(packet, hdr[i].msg_len) < 0) {
+        DEBUG(0, "receiver: ignoring invalid(too short) packet from %s",
+              addr[i].sun_path);
+        continue;
+      }
+
+      if (strcmp(addr[i].sun_path, msgq->address) == 0) {
+        /* Self-control message */
+        if (strncmp(packet->data, "shutdown", 8) == 0) {
+          DEBUG(0, "receiver: initiate shutdown sequence");
+          *quit = 1;
+          break;
+        }
+      }
+
+      np = msgq_node_create(msgq->pool, addr[i].sun_path, packet);
+      if (!np) {
+        /* TODO: failed to create msgq_node struct, out of memory? */
+        continue;
+      }
+    }
+    np->stamp = stamp;
+    bytes += np->packet->size;
+    if (last)
+      last->next = &np->link;
+    else
+      first = &np->link;
+    last = &np->link;
+    nbatch++;
+  }
+
+  if (nbatch > 0) {
+    DEBUG(0, "receiver: accepting %d packet(s).", nbatch);
+    __atomic_store_n(&msgq->st_received, msgq->st_received + nbatch,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&msgq->st_received_bytes,
+                     msgq->st_received_bytes + bytes, __ATOMIC_RELAXED);
+    msgq_queue_push(msgq, first, last, nbatch);
+  }
+  return n;
+}
+
+
+/*
+ * Mark the receiver of MSGQ dead, and wake up everyone waiting for
+ * it.  The consumers are woken while 'recv_mutex' is held, because a
+ * reactor-served MSGQ has no thread to join, and msgq_close() may free
+ * it as soon as it sees MSGQ_STAT_DEAD under the mutex.
+ */
+static void
+msgq_receiver_exit(MSGQ *msgq)
+{
+  shutdown(msgq->fd, SHUT_RD);
+
+  /* If you ever want to change from UNIX domain socket to UDP/TCP You
+   * may need to change the way it calls shutdown()/close()
+   * socket!! */
+
+  MSGQ_LOCK(msgq);
+  __atomic_store_n(&msgq->receiver_status, MSGQ_STAT_DEAD, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&msgq->stat_cond);
+  msgq_queue_wake(msgq, INT_MAX);
+  MSGQ_UNLOCK(msgq);
+}
+
+
+static void *
+msgq_receiver(void *arg)
+{
+  int quit = 0;
+  unsigned int vlen;
   MSGQ *msgq = (MSGQ *)arg;
 
   DEBUG(0, "receiver: thread started");
 
   MSGQ_LOCK(msgq);
-  msgq->receiver_status = MSGQ_STAT_ALIVE;
+  __atomic_store_n(&msgq->receiver_status, MSGQ_STAT_ALIVE, __ATOMIC_SEQ_CST);
   pthread_cond_broadcast(&msgq->stat_cond);
-
-  fd = msgq->fd;
   MSGQ_UNLOCK(msgq);
 
-  while (1) {
+  while (!quit) {
     //pthread_testcancel();
 
-    DEBUG(0, "receiver: waiting for incoming packet from fd(%d)", fd);
-    addrlen = sizeof(addr);
-    len = recvfrom(fd, (void *)msgq->pkbuf, MSGQ_MSG_MAX, MSG_WAITALL,
-                   (struct sockaddr *)&addr, &addrlen);
-    if (len < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    DEBUG(0, "receiver: waiting for incoming packet from fd(%d)", msgq->fd);
+
+    vlen = msgq_credit(msgq);
+    if (vlen == 0) {
+      msgq_pause(msgq);
+      continue;
+    }
+
+    /* Block for the first packet, then take whatever is already queued. */
+    if (msgq_drain(msgq, msgq->pkbuf, vlen, MSG_WAITFORONE, &quit) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
         /* Since 'fd' is blocking socket, we will not get these errors */
         continue;
       }
       else {
-        WARN(errno, "recvfrom(2) failed");
+        WARN(errno, "recvmmsg(2) failed");
         break;
       }
     }
+  }
 
-    packet = (struct msgq_packet *)msgq->pkbuf;
-    if (validate_packet(packet, len) < 0) {
-      DEBUG(0, "receiver: ignoring invalid(too short) packet from %s",
-            addr.sun_path);
-      continue;
+  //pthread_cleanup_pop(1);
+
+  msgq_receiver_exit(msgq);
+  return NULL;
+}
+
+
+/*
+ * Reactor
+ *
+ * A reactor is a fixed array of loops.  Each loop is a thread waiting
+ * on its own epoll(7) instance, in which the sockets of its MSGQs are
+ * registered level-triggered, with 'data.ptr' pointing the MSGQ.  On
+ * every readiness, the loop receives one batch with msgq_drain() into
+ * its own buffer, so that a busy MSGQ cannot starve the others on the
+ * same loop; what remains is reported again by the next epoll_wait().
+ *
+ * A MSGQ never moves to another loop, so its pool still has only one
+ * allocating thread.
+ *
+ * The eventfd(2) 'evfd' is registered with a NULL 'data.ptr', and
+ * stops the loop.  A MSGQ is detached by the loop itself, when it
+ * receives the "shutdown" self-control message from msgq_close().
+ * Since epoll_wait() reports a descriptor at most once per call, no
+ * pending event can refer to the MSGQ after that.
+ */
+#define MSGQ_REACTOR_EVENTS     64
+
+struct msgq_loop {
+  int epfd;
+  int evfd;                     /* eventfd(2) to stop the loop */
+  pthread_t thread;
+  unsigned char *pkbuf;         /* receive buffer, as in struct msgq_ */
+  long nqueues;                 /* number of registered MSGQs */
+} __attribute__((aligned(64)));
+
+struct msgq_reactor {
+  int nloops;
+  struct msgq_loop *loops;
+};
+
+
+static void
+msgq_reactor_detach(struct msgq_loop *loop, MSGQ *msgq)
+{
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, msgq->fd, NULL) < 0)
+    WARN(errno, "epoll_ctl(2) failed");
+  __atomic_sub_fetch(&loop->nqueues, 1, __ATOMIC_SEQ_CST);
+
+  msgq_receiver_exit(msgq);     /* MSGQ may be freed from here */
+}
+
+
+static void *
+msgq_reactor_loop(void *arg)
+{
+  struct msgq_loop *loop = (struct msgq_loop *)arg;
+  struct epoll_event ev[MSGQ_REACTOR_EVENTS];
+  MSGQ *msgq;
+  unsigned int vlen;
+  int i, n, quit, stop = 0;
+
+  DEBUG(0, "reactor: loop started");
+
+  while (!stop) {
+    n = epoll_wait(loop->epfd, ev, MSGQ_REACTOR_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      WARN(errno, "epoll_wait(2) failed");
+      break;
     }
 
-    if (strcmp(addr.sun_path, msgq->address) == 0) {
-      /* Self-control message */
-      if (strncmp(packet->data, "shutdown", 8) == 0) {
-        DEBUG(0, "receiver: initiate shutdown sequence");
-        break;
+    for (i = 0; i < n; i++) {
+      msgq = (MSGQ *)ev[i].data.ptr;
+      if (!msgq) {
+        stop = 1;
+        continue;
       }
-    }
 
-    np = msgq_node_create(addr.sun_path, packet);
-    if (!np) {
-      /* TODO: failed to create msgq_node struct, out of memory? */
-      continue;
+      vlen = msgq_credit(msgq);
+      if (vlen == 0) {
+        msgq_pause(msgq);
+        continue;
+      }
+
+      quit = 0;
+      if (msgq_drain(msgq, loop->pkbuf, vlen, MSG_DONTWAIT, &quit) < 0 &&
+          errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        WARN(errno, "recvmmsg(2) failed");
+        quit = 1;
+      }
+      if (quit)
+        msgq_reactor_detach(loop, msgq);
     }
+  }
 
-    MSGQ_LOCK(msgq);
-    edque_push_back(&msgq->recvq, &np->link);
-    msgq->recvs++;
-    DEBUG(0, "receiver: accepting a packet.");
+  DEBUG(0, "reactor: loop stopped");
+  return NULL;
+}
 
-    if (msgq->broadcast) {
-      DEBUG(0, "receiver: broadcast!");
-      pthread_cond_broadcast(&msgq->recv_cond);
-    }
-    else {
-      DEBUG(0, "receiver: signal!");
-      pthread_cond_signal(&msgq->recv_cond);
-    }
 
-    MSGQ_UNLOCK(msgq);
+/* Take MSGQ out of the epoll set while it is paused. */
+static void
+msgq_reactor_pause(MSGQ *msgq)
+{
+  if (epoll_ctl(msgq->loop->epfd, EPOLL_CTL_DEL, msgq->fd, NULL) < 0)
+    WARN(errno, "epoll_ctl(2) failed");
+}
+
+
+/* Put a paused MSGQ back; called by whoever resumed it. */
+static void
+msgq_reactor_rearm(MSGQ *msgq)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = msgq;
+  if (epoll_ctl(msgq->loop->epfd, EPOLL_CTL_ADD, msgq->fd, &ev) < 0)
+    WARN(errno, "epoll_ctl(2) failed");
+}
+
+
+static int
+msgq_reactor_attach(MSGQ_REACTOR *reactor, MSGQ *msgq)
+{
+  struct msgq_loop *loop;
+  struct epoll_event ev;
+  int i;
+
+  loop = &reactor->loops[0];
+  for (i = 1; i < reactor->nloops; i++)
+    if (__atomic_load_n(&reactor->loops[i].nqueues, __ATOMIC_RELAXED) <
+        __atomic_load_n(&loop->nqueues, __ATOMIC_RELAXED))
+      loop = &reactor->loops[i];
+
+  __atomic_add_fetch(&loop->nqueues, 1, __ATOMIC_SEQ_CST);
+  msgq->loop = loop;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = msgq;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, msgq->fd, &ev) < 0) {
+    WARN(errno, "epoll_ctl(2) failed");
+    __atomic_sub_fetch(&loop->nqueues, 1, __ATOMIC_SEQ_CST);
+    msgq->loop = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Stop LOOP if it is running, and release its resources. */
+static void
+msgq_loop_destroy(struct msgq_loop *loop, int running)
+{
+  uint64_t one = 1;
+
+  if (running) {
+    if (write(loop->evfd, &one, sizeof(one)) != sizeof(one))
+      WARN(errno, "write(2) to eventfd failed");
+    pthread_join(loop->thread, NULL);
   }
+  if (loop->evfd >= 0)
+    close(loop->evfd);
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  free(loop->pkbuf);
+}
 
-  //pthread_cleanup_pop(1);
 
-  shutdown(fd, SHUT_RD);
+MSGQ_REACTOR *
+msgq_reactor_new(int nthreads)
+{
+  MSGQ_REACTOR *reactor;
+  struct msgq_loop *loop;
+  struct epoll_event ev;
+  int saved_errno;
 
-  MSGQ_LOCK(msgq);
-  msgq->receiver_status = MSGQ_STAT_DEAD;
-  pthread_cond_broadcast(&msgq->recv_cond);
-  pthread_cond_broadcast(&msgq->stat_cond);
-  MSGQ_UNLOCK(msgq);
+  if (nthreads <= 0)
+    nthreads = 1;
 
-  /* If you ever want to change from UNIX domain socket to UDP/TCP You
-   * may need to change the way it calls shutdown()/close()
-   * socket!! */
+  reactor = malloc(sizeof(*reactor));
+  if (!reactor)
+    return NULL;
+  reactor->nloops = 0;
+  if (posix_memalign((void **)&reactor->loops, 64,
+                     sizeof(*reactor->loops) * nthreads) != 0) {
+    free(reactor);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  while (reactor->nloops < nthreads) {
+    loop = &reactor->loops[reactor->nloops];
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = loop->evfd = -1;
+
+    loop->pkbuf = malloc(MSGQ_MSG_MAX * MSGQ_BATCH);
+    if (!loop->pkbuf)
+      goto err;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+      WARN(errno, "epoll_create1(2) failed");
+      goto err;
+    }
+
+    loop->evfd = eventfd(0, EFD_CLOEXEC);
+    if (loop->evfd < 0) {
+      WARN(errno, "eventfd(2) failed");
+      goto err;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0) {
+      WARN(errno, "epoll_ctl(2) failed");
+      goto err;
+    }
 
+    if (msgq_create_thread(&loop->thread, msgq_reactor_loop, loop) < 0)
+      goto err;
+    reactor->nloops++;
+  }
+  return reactor;
 
+ err:
+  saved_errno = errno;
+  msgq_loop_destroy(&reactor->loops[reactor->nloops], 0);
+  msgq_reactor_delete(reactor);
+  errno = saved_errno;
   return NULL;
 }
 
 
+int
+msgq_reactor_delete(MSGQ_REACTOR *reactor)
+{
+  int i;
+
+  for (i = 0; i < reactor->nloops; i++)
+    if (__atomic_load_n(&reactor->loops[i].nqueues, __ATOMIC_SEQ_CST) > 0) {
+      errno = EBUSY;
+      return -1;
+    }
+
+  for (i = 0; i < reactor->nloops; i++)
+    msgq_loop_destroy(&reactor->loops[i], 1);
+  free(reactor->loops);
+  free(reactor);
+  return 0;
+}
+
+
 /*
  * Validate given PACKET.   The PACKET points the message buffer that
  * contains the data just received from the remote.
@@ -983,58 +3144,154 @@ validate_packet(struct msgq_packet *packet, ssize_t len)
 }
 
 
+static struct msgq_pool *
+msgq_pool_new(void)
+{
+  struct msgq_pool *pool;
+
+  if (posix_memalign((void **)&pool, 64, sizeof(*pool)) != 0)
+    return NULL;
+  memset(pool, 0, sizeof(*pool));
+  pool->refs = 1;
+  return pool;
+}
+
+
+static void
+msgq_pool_unref(struct msgq_pool *pool)
+{
+  struct msgq_node *p, *q;
+  int i;
+
+  if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  for (i = 0; i < MSGQ_POOL_CLASSES; i++) {
+    for (p = pool->cls[i].freed; p != NULL; p = q) {
+      q = p->next;
+      free(p);
+    }
+    for (p = pool->cls[i].local; p != NULL; p = q) {
+      q = p->next;
+      free(p);
+    }
+  }
+  free(pool);
+}
+
+
 /*
- * Copy(duplicate) the given PACKET.
+ * Allocate a node for a packet of SIZE bytes from POOL.  Only the
+ * receiver thread may call this function.
  */
-static struct msgq_packet *
-msgq_copy_packet(const struct msgq_packet *packet)
+static struct msgq_node *
+msgq_pool_get(struct msgq_pool *pool, size_t size)
 {
-  struct msgq_packet *p;
-  size_t size, newsize;
+  struct msgq_pool_class *pc;
+  struct msgq_node *p;
+  size_t total;
+  long n;
+  int cls;
+
+  /* One more byte for the '\0' added by msgq_node_create(). */
+  total = sizeof(*p) + sizeof(struct msgq_packet) + size + 1;
+  for (cls = 0; cls < MSGQ_POOL_CLASSES; cls++)
+    if (total <= ((size_t)1 << (cls + MSGQ_POOL_SHIFT)))
+      break;
 
-  size = sizeof(*packet) + packet->size;
-  newsize = size;
+  if (cls == MSGQ_POOL_CLASSES) {
+    /* Too large for the pool */
+    p = malloc(total);
+    if (!p)
+      return NULL;
+    __atomic_store_n(&pool->misses, pool->misses + 1, __ATOMIC_RELAXED);
+    p->pool = NULL;
+    return p;
+  }
 
-  if (packet->data[packet->size - 1] != '\0') {
-    /* To make easy/safe debugging, If the last byte in the packet
-     * is not '\0',  Add '\0' to the copied packet.  Since 'size' member
-     * of the copied will not be changed,  it is okay for the sensitive
-     * receiver. */
-    newsize = size + 1;
+  pc = &pool->cls[cls];
+  if (!pc->local && __atomic_load_n(&pc->freed, __ATOMIC_RELAXED)) {
+    pc->local = __atomic_exchange_n(&pc->freed, NULL, __ATOMIC_ACQUIRE);
+    for (n = 0, p = pc->local; p != NULL; p = p->next)
+      n++;
+    __atomic_sub_fetch(&pc->cached, n, __ATOMIC_RELAXED);
   }
-  p = malloc(newsize);
-  if (!p)
-    return NULL;
-  memcpy(p, packet, size);
 
-  if (newsize > size) {
-    p->data[p->size] = '\0';
+  p = pc->local;
+  if (p) {
+    pc->local = p->next;
+    __atomic_store_n(&pool->hits, pool->hits + 1, __ATOMIC_RELAXED);
+  }
+  else {
+    p = malloc((size_t)1 << (cls + MSGQ_POOL_SHIFT));
+    if (!p)
+      return NULL;
+    __atomic_store_n(&pool->misses, pool->misses + 1, __ATOMIC_RELAXED);
   }
 
+  __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+  p->pool = pool;
+  p->cls = cls;
   return p;
 }
 
 
 /*
- * Create new struct msgq_node instance using given PACKET's duplicate.
+ * Release the node NP.  Any thread may call this function.
+ */
+static void
+msgq_node_delete(struct msgq_node *np)
+{
+  struct msgq_pool *pool = np->pool;
+  struct msgq_pool_class *pc;
+
+  if (!pool) {
+    free(np);
+    return;
+  }
+
+  pc = &pool->cls[np->cls];
+  if (__atomic_load_n(&pc->cached, __ATOMIC_RELAXED) >= MSGQ_POOL_CACHE_MAX) {
+    free(np);
+    __atomic_add_fetch(&pool->releases, 1, __ATOMIC_RELAXED);
+  }
+  else {
+    __atomic_add_fetch(&pc->cached, 1, __ATOMIC_RELAXED);
+    np->next = __atomic_load_n(&pc->freed, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pc->freed, &np->next, np, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  msgq_pool_unref(pool);
+}
+
+
+/*
+ * Create new struct msgq_node instance from POOL, with a copy of
+ * given PACKET.
  */
 static struct msgq_node *
-msgq_node_create(const char *sender, const struct msgq_packet *packet)
+msgq_node_create(struct msgq_pool *pool,
+                 const char *sender, const struct msgq_packet *packet)
 {
   struct msgq_node *p;
 
-  p = malloc(sizeof(*p));
+  p = msgq_pool_get(pool, packet->size);
   if (!p)
     return NULL;
 
-  p->packet = msgq_copy_packet(packet);
-  if (!p->packet) {
-    free(p);
-    return NULL;
-  }
+  p->packet = (struct msgq_packet *)(p + 1);
+  memcpy(p->packet, packet, sizeof(*packet) + packet->size);
+
+  /* To make easy/safe debugging, add '\0' to the copied packet.
+   * Since 'size' member of the copied will not be changed, it is okay
+   * for the sensitive receiver. */
+  p->packet->data[p->packet->size] = '\0';
+
   p->packet->container = p;
   strncpy(p->sender, sender, UNIX_PATH_MAX - 1);
-  ELIST_INIT(p->link);
+  p->sender[UNIX_PATH_MAX - 1] = '\0';
+  p->link.next = NULL;
 
   return p;
 }
@@ -1155,3 +3412,4 @@ main(int argc, char *argv[])
   return 0;
 }
 #endif  /* TEST_MSGQ */
+
@@ -55,6 +55,9 @@
  * $ cc -D_GNU_SOURCE -DTEST_MSGQ msgq.c -lpthread -lrt
  *
  * See the comments for main() in msgq.c for using the test server.
+ *
+ * The throughput and latency benchmark lives in bench/msgq; see its
+ * README.md.
  */
 
 /*
@@ -89,6 +92,20 @@ BEGIN_C_DECLS
 #define MSGQ_PERM_DEFAULT       (S_IRUSR | S_IWUSR | S_IXUSR | \
                                  S_IRGRP | S_IROTH)
 
+/*
+ * Largest packet data accepted by a socket MSGQ.  A packet larger than
+ * MSGQ_MSG_MAX is split into fragments by the sender, and reassembled
+ * into one packet by the receiver.
+ */
+#ifndef MSGQ_PKT_MAX
+#define MSGQ_PKT_MAX    (16 << 20)
+#endif
+
+/* Size of the ring of a "shm:" MSGQ.  It must be a power of two. */
+#ifndef MSGQ_SHM_SIZE
+#define MSGQ_SHM_SIZE   (1 << 20)
+#endif
+
 struct msgq_packet {
   void *container;              /* internal purpose only.  Do not change. */
   size_t size;                  /* size of data in bytes */
@@ -98,6 +115,9 @@ struct msgq_packet {
 struct msgq_;
 typedef struct msgq_ MSGQ;
 
+struct msgq_reactor;
+typedef struct msgq_reactor MSGQ_REACTOR;
+
 /*
  * Create new message queue.
  *
@@ -111,6 +131,16 @@ typedef struct msgq_ MSGQ;
  * This function will not return until the listening thread is
  * running.  Thus, once msgq_open() returns, you may directly call any
  * of msgq_recv*().
+ *
+ * If ADDRESS is "shm:/NAME", the queue receives through a ring buffer
+ * of MSGQ_SHM_SIZE bytes in the POSIX shared memory object "/NAME"
+ * instead of a socket, and no listening thread is created.  Processes
+ * on the same host send to it with the same "shm:/NAME" address.
+ * Packets are written directly into the ring, and msgq_recv*() return
+ * pointers into it; they are not copied through the kernel, and are
+ * not limited by the socket buffer size, but by MSGQ_SHM_SIZE / 2.
+ * Such a queue can still send to socket addresses, but from an unbound
+ * socket, so those receivers cannot reply.
  */
 extern MSGQ *msgq_open(const char *address);
 
@@ -126,12 +156,58 @@ extern MSGQ *msgq_open(const char *address);
 extern int msgq_close(MSGQ *msgq);
 
 
+/*
+ * Create a reactor, a fixed pool of NTHREADS epoll(7) loops that
+ * receive packets for many message queues.
+ *
+ * Normally, each msgq_open() creates its own listening thread.  A
+ * MSGQ opened with msgq_open_reactor() is registered to the loop of
+ * REACTOR that serves the fewest queues, and that loop receives its
+ * packets instead.  Such a MSGQ owns no thread and no receive buffer,
+ * so a process can open thousands of them; the limit is the number of
+ * file descriptors (RLIMIT_NOFILE).
+ *
+ * If NTHREADS is zero or negative, one loop is created.
+ *
+ * On error, msgq_reactor_new() returns NULL and sets 'errno'.
+ */
+extern MSGQ_REACTOR *msgq_reactor_new(int nthreads);
+
+/*
+ * Stop and destroy REACTOR.
+ *
+ * All message queues registered to REACTOR must be closed before.
+ * Otherwise, msgq_reactor_delete() returns -1 with 'errno' set to
+ * EBUSY, and REACTOR is left untouched.  On success, it returns zero.
+ */
+extern int msgq_reactor_delete(MSGQ_REACTOR *reactor);
+
+/*
+ * Same as msgq_open(), except that the new MSGQ is served by REACTOR
+ * rather than its own listening thread.  If REACTOR is NULL, or
+ * ADDRESS is a "shm:" address, which does not need a listener, it is
+ * the same as msgq_open().
+ *
+ * The returned MSGQ is used exactly as any other MSGQ, and is
+ * destroyed by msgq_close().
+ */
+extern MSGQ *msgq_open_reactor(MSGQ_REACTOR *reactor, const char *address);
+
+
 /*
  * Send a packet to the remote.
  *
  * RECEIVER is the remote address.
  * PACKET is the packet data, and SIZE is the length of PACKET.
  *
+ * If the packet does not fit in one datagram of MSGQ_MSG_MAX bytes,
+ * it is sent as a series of fragments, and the receiver delivers it
+ * as one packet once all fragments arrived.  In that case, this
+ * function returns when the last fragment is queued to the receiving
+ * socket.  SIZE may be up to MSGQ_PKT_MAX bytes.  (Sets 'errno' to
+ * EMSGSIZE if larger.)  A "shm:" receiver takes no fragments; the
+ * size of its packets is limited by MSGQ_SHM_SIZE.
+ *
  * On success, returns zero.  Otherwise -1.
  */
 extern int msgq_send(MSGQ *msgq, const char *receiver,
@@ -158,6 +234,7 @@ extern int msgq_send_string(MSGQ *msgq, const char *receiver,
  *
  * You need to construct struct msgq_packet by yourself.
  * You need to fill only 'size' and 'data' members of struct msgq_packet.
+ * Large packets are fragmented as described in msgq_send().
  *
  * On success, returns zero, otherwise -1.
  */
@@ -165,6 +242,66 @@ extern int msgq_send_(MSGQ *msgq, const char *receiver,
                const struct msgq_packet *packet);
 
 
+/*
+ * Same as msgq_send_(), but never waits.
+ *
+ * If the receiving socket (or the ring of a "shm:" receiver) has no
+ * room for PACKET, msgq_try_send() fails with 'errno' set to EAGAIN,
+ * so that the caller can tell congestion from other errors, and decide
+ * whether to retry, drop or slow down.  A receiver stays congested
+ * while its MSGQ is above its high-water mark; see msgq_set_hwm().
+ *
+ * A packet that needs fragmentation (larger than MSGQ_MSG_MAX) cannot
+ * be sent without waiting, and fails with EMSGSIZE.
+ *
+ * On success, returns zero, otherwise -1.
+ */
+extern int msgq_try_send(MSGQ *msgq, const char *receiver,
+                         const struct msgq_packet *packet);
+
+
+/*
+ * One message for msgq_send_batch().
+ */
+struct msgq_msg {
+  const char *receiver;         /* the remote address */
+  const struct msgq_packet *packet;
+};
+
+/*
+ * Send COUNT packets in MSGS, with as few system calls as possible.
+ *
+ * Each packet is sent to its own receiver, in the order of MSGS.  The
+ * packets are constructed in the same way as msgq_send_().
+ *
+ * Returns the number of packets sent.  If it is less than COUNT, the
+ * packet at the returned index failed, and 'errno' is set accordingly.
+ * If no packet could be sent, returns -1.
+ */
+extern int msgq_send_batch(MSGQ *msgq, const struct msgq_msg *msgs,
+                           size_t count);
+
+
+/*
+ * Build a packet in place in the ring of a "shm:" RECEIVER.
+ *
+ * msgq_pkt_reserve() returns a packet of SIZE bytes of 'data' inside
+ * the ring of RECEIVER, waiting for room if the ring is full.  Fill
+ * 'data', then publish it with msgq_pkt_commit().  Do not change
+ * 'size' or 'container', and do not call msgq_pkt_delete() on it.
+ * Every reserved packet must be committed, since the receiver takes
+ * packets in order.
+ *
+ * msgq_pkt_reserve() returns NULL on error; with EAFNOSUPPORT if
+ * RECEIVER is not a "shm:" address.  msgq_pkt_commit() returns zero,
+ * or -1 with EINVAL if PACKET is not a reserved, uncommitted packet.
+ */
+extern struct msgq_packet *msgq_pkt_reserve(MSGQ *msgq, const char *receiver,
+                                            size_t size);
+
+extern int msgq_pkt_commit(MSGQ *msgq, struct msgq_packet *packet);
+
+
 #ifdef MSGQ_BROADCAST
 /*
  * Broadcast a packet to the addresses that satisfies the given filename
@@ -173,6 +310,12 @@ extern int msgq_send_(MSGQ *msgq, const char *receiver,
  * Note that msgq_broadcast_wildcard() does not care for success of
  * sending a packet.  If this function fails to allocate/prepare for
  * broadcasting, it returns -1.  Otherwise returns zero.
+ *
+ * The matching addresses of recently used patterns are cached per
+ * process, and the cache is refreshed through inotify(7) when a
+ * matching file is created or removed in the directory of PATTERN.
+ * Thus, only the first broadcast to a pattern scans the directory, and
+ * the packets are sent with as few sendmmsg(2) calls as possible.
  */
 extern int msgq_broadcast_wildcard(MSGQ *msgq, const char *pattern,
                                    const struct msgq_packet *packet);
@@ -240,6 +383,27 @@ extern struct msgq_packet *msgq_recv_timedwait(MSGQ *msgq,
 extern struct msgq_packet *msgq_recv_wait(MSGQ *msgq);
 
 
+/*
+ * Get up to COUNT packets at once.
+ *
+ * These functions store the received packets in PACKETS, in the
+ * order of arrival, and return the number of packets stored.
+ * Every packet must be released with msgq_pkt_delete().  Taking N
+ * packets costs one locking of the queue instead of N.
+ *
+ * msgq_recv_batch() never blocks; it returns zero if there is no
+ * packet.  msgq_recv_batch_timedwait() waits like
+ * msgq_recv_timedwait() until at least one packet is available, and
+ * returns -1 on timeout or on error.  ABSTIME may be NULL to wait
+ * forever.
+ */
+extern int msgq_recv_batch(MSGQ *msgq, struct msgq_packet **packets,
+                           size_t count);
+
+extern int msgq_recv_batch_timedwait(MSGQ *msgq, struct msgq_packet **packets,
+                                     size_t count, struct timespec *abstime);
+
+
 /*
  * Returns the number of received packets which is not processed.
  *
@@ -252,6 +416,92 @@ extern struct msgq_packet *msgq_recv_wait(MSGQ *msgq);
  */
 extern int msgq_message_count(MSGQ *msgq);
 
+/*
+ * Set the high-water mark of MSGQ to HWM packets.
+ *
+ * By default, the receiver of MSGQ queues every packet it gets, however
+ * slow the consumers are.  Once HWM packets are waiting in the queue,
+ * the receiver stops reading the socket until the consumers bring the
+ * queue down to HWM / 2.  Meanwhile, the kernel queues further packets
+ * in the socket, and when that is full, msgq_send*() to MSGQ block, and
+ * msgq_try_send() fails with EAGAIN.
+ *
+ * If HWM is zero, the queue is unlimited.  A "shm:" MSGQ ignores this;
+ * its ring is already bounded by MSGQ_SHM_SIZE.
+ *
+ * On success, returns zero.  Otherwise -1 with 'errno' set.
+ */
+extern int msgq_set_hwm(MSGQ *msgq, long hwm);
+
+
+/*
+ * Statistics of the packet pool.
+ *
+ * Received packets are allocated from a per-MSGQ pool of recycled
+ * buffers, so that msgq does not call malloc(3)/free(3) per packet
+ * once the pool is warmed up.
+ */
+struct msgq_pool_stat {
+  unsigned long hits;           /* packets allocated from the pool */
+  unsigned long misses;         /* packets allocated via malloc(3) */
+  unsigned long releases;       /* packets free(3)ed since the pool was full */
+  unsigned long cached;         /* free buffers in the pool now */
+};
+
+/*
+ * Fill STAT with the current statistics of the packet pool of MSGQ.
+ *
+ * This function takes no lock; the numbers are approximate while
+ * packets are being received.  Returns zero.
+ */
+extern int msgq_pool_stat(MSGQ *msgq, struct msgq_pool_stat *stat);
+
+
+/*
+ * Counters of a MSGQ, for monitoring.
+ *
+ * All counters start from zero at msgq_open(), and only grow, except
+ * 'depth'.  'latency' is a histogram of the time from the enqueueing
+ * of a packet by the receiver (or the commit by the sender, for a
+ * "shm:" MSGQ) to its dequeueing by msgq_recv*(); latency[i] counts
+ * the packets that waited from 2^i up to 2^(i+1) nanoseconds.  The
+ * last bucket also counts anything longer.
+ */
+#define MSGQ_LAT_BUCKETS        40
+
+struct msgq_stat {
+  unsigned long sent;           /* packets sent from this MSGQ */
+  unsigned long sent_bytes;     /* data bytes of 'sent' */
+  unsigned long send_failures;  /* sends failed, except for EAGAIN */
+  unsigned long send_eagain;    /* sends failed with EAGAIN (congestion) */
+
+  unsigned long received;       /* packets queued for msgq_recv*() */
+  unsigned long received_bytes; /* data bytes of 'received' */
+  unsigned long dequeued;       /* packets returned by msgq_recv*() */
+  long depth;                   /* packets in the queue now */
+  long depth_max;               /* the highest 'depth' so far */
+
+  unsigned long latency[MSGQ_LAT_BUCKETS];
+};
+
+/*
+ * Fill STAT with the current counters of MSGQ.
+ *
+ * This function takes no lock, and does not disturb the senders, the
+ * receiver or the consumers, so it is cheap enough to be polled by a
+ * metrics exporter.  Each counter is exact, but they are not read at
+ * the same instant.  Returns zero.
+ */
+extern int msgq_stat(MSGQ *msgq, struct msgq_stat *stat);
+
+/*
+ * Returns the upper bound, in nanoseconds, of the latency bucket that
+ * holds the Q-quantile (0 <= Q <= 1) of 'latency' in STAT.  For
+ * example, Q = 0.99 gives the p99 latency, rounded up to a power of
+ * two.  Returns zero if no packet is counted.
+ */
+extern unsigned long msgq_stat_latency(const struct msgq_stat *stat, double q);
+
 
 /*
  * Returns a sender address of given PACKET.
@@ -269,7 +519,8 @@ extern const char *msgq_pkt_sender(struct msgq_packet *packet);
  * when the packet is no longer needed.
  *
  * If you construct struct msgq_packet instance by yourself, DO NOT
- * call this function.
+ * call this function.  For a packet reserved by msgq_pkt_reserve(),
+ * it fails with EINVAL; commit it instead.
  */
 extern int msgq_pkt_delete(struct msgq_packet *packet);
 
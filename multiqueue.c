@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * See multiqueue.h for the license.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "multiqueue.h"
+
+/*
+ * Each heap keeps 16-byte items in a 4-ary DHEAP, so the children of
+ * a node fill one cache line.  The key of its top is mirrored in
+ * 'top', which multiqueue_pop() reads without the lock to choose
+ * between two heaps; it is MQ_EMPTY when the heap is empty.  As
+ * MQ_EMPTY is also a valid key, the number of items is mirrored in
+ * 'size' as well, and mq_empty() reads that.  Both are written with
+ * atomic stores under the lock, and read without it.
+ */
+struct mq_item {
+  uint64_t key;
+  void *data;
+};
+
+DHEAP_DECL_TYPE(struct mq_item, mq_heap_t, 4);
+#define mq_heap_t_cmp(x, y)     \
+  (((y)->key > (x)->key) - ((y)->key < (x)->key))
+
+#define MQ_EMPTY        UINT64_MAX
+
+/* Number of random picks before multiqueue_pop() scans all heaps */
+#define MQ_POP_TRIES    4
+
+struct mq_queue {
+  pthread_mutex_t lock;
+  uint64_t top;                 /* key of the top, or MQ_EMPTY */
+  long size;                    /* number of items in 'heap' */
+  mq_heap_t heap;
+} __attribute__((aligned(64)));
+
+struct multiqueue {
+  int nqueues;
+  struct mq_queue *queues;
+};
+
+static __thread uint64_t mq_seed;
+
+
+/* xorshift64*; each thread has its own state */
+static __inline__ unsigned
+mq_random(unsigned n)
+{
+  uint64_t x = mq_seed;
+
+  if (x == 0)
+    x = (uint64_t)(uintptr_t)&mq_seed * 0x9E3779B97F4A7C15ULL | 1;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  mq_seed = x;
+  /* scale the high 32 bits to [0, n) without a division */
+  return (unsigned)((((x * 0x2545F4914F6CDD1DULL) >> 32) * n) >> 32);
+}
+
+
+/* Return nonzero if QP looks empty; no lock needed. */
+static __inline__ int
+mq_empty(struct mq_queue *qp)
+{
+  return __atomic_load_n(&qp->size, __ATOMIC_RELAXED) == 0;
+}
+
+
+/* Refresh the mirrored top and size of QP.  The caller holds the lock. */
+static __inline__ void
+mq_update_top(struct mq_queue *qp)
+{
+  struct mq_item *top = DHEAP_TOP(&qp->heap);
+
+  __atomic_store_n(&qp->top, top ? top->key : MQ_EMPTY, __ATOMIC_RELAXED);
+  __atomic_store_n(&qp->size, DHEAP_COUNT(&qp->heap), __ATOMIC_RELAXED);
+}
+
+
+multiqueue_t *
+multiqueue_new(int nqueues)
+{
+  multiqueue_t *mq;
+  mq_heap_t empty = DHEAP_INITIALIZER(0);
+  int i;
+
+  if (nqueues <= 0) {
+    nqueues = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (nqueues < 2)
+      nqueues = 2;
+  }
+
+  mq = malloc(sizeof(*mq));
+  if (!mq)
+    return NULL;
+  if (posix_memalign((void **)&mq->queues, 64,
+                     sizeof(*mq->queues) * nqueues) != 0) {
+    free(mq);
+    return NULL;
+  }
+  mq->nqueues = nqueues;
+
+  for (i = 0; i < nqueues; i++) {
+    pthread_mutex_init(&mq->queues[i].lock, NULL);
+    mq->queues[i].top = MQ_EMPTY;
+    mq->queues[i].size = 0;
+    mq->queues[i].heap = empty;
+  }
+  return mq;
+}
+
+
+void
+multiqueue_delete(multiqueue_t *mq)
+{
+  int i;
+
+  for (i = 0; i < mq->nqueues; i++) {
+    pthread_mutex_destroy(&mq->queues[i].lock);
+    DHEAP_FREE(mq_heap_t, &mq->queues[i].heap);
+  }
+  free(mq->queues);
+  free(mq);
+}
+
+
+int
+multiqueue_push(multiqueue_t *mq, uint64_t key, void *data)
+{
+  struct mq_item item = { key, data };
+  struct mq_queue *qp;
+  int ret;
+
+  /* Any heap will do; skip the ones that are busy. */
+  do {
+    qp = &mq->queues[mq_random(mq->nqueues)];
+  } while (pthread_mutex_trylock(&qp->lock) != 0);
+
+  DHEAP_INSERT_(mq_heap_t, &qp->heap, item, ret);
+  if (ret == 0) {
+    if (key < qp->top)
+      __atomic_store_n(&qp->top, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&qp->size, qp->size + 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&qp->lock);
+
+  return ret ? -1 : 0;
+}
+
+
+/* Pop the top of QP, if any.  The caller holds the lock. */
+static int
+mq_pop_locked(struct mq_queue *qp, uint64_t *key, void **data)
+{
+  struct mq_item item;
+  int popped;
+
+  DHEAP_POP_(mq_heap_t, &qp->heap, &item, popped);
+  if (!popped)
+    return -1;
+  mq_update_top(qp);
+
+  if (key)
+    *key = item.key;
+  if (data)
+    *data = item.data;
+  return 0;
+}
+
+
+int
+multiqueue_pop(multiqueue_t *mq, uint64_t *key, void **data)
+{
+  struct mq_queue *qp, *qp2;
+  int tries = 0, i, start;
+
+  while (tries < MQ_POP_TRIES) {
+    qp = &mq->queues[mq_random(mq->nqueues)];
+    qp2 = &mq->queues[mq_random(mq->nqueues)];
+    if (__atomic_load_n(&qp2->top, __ATOMIC_RELAXED) <
+        __atomic_load_n(&qp->top, __ATOMIC_RELAXED))
+      qp = qp2;
+
+    if (mq_empty(qp)) {
+      tries++;
+      continue;
+    }
+    if (pthread_mutex_trylock(&qp->lock) != 0)
+      continue;                 /* busy; pick another pair */
+    if (mq_pop_locked(qp, key, data) == 0) {
+      pthread_mutex_unlock(&qp->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&qp->lock);
+    tries++;                    /* emptied since we looked */
+  }
+
+  /* Few elements are left, if any; look at every heap in turn. */
+  start = mq_random(mq->nqueues);
+  for (i = 0; i < mq->nqueues; i++) {
+    qp = &mq->queues[(start + i) % mq->nqueues];
+    if (mq_empty(qp))
+      continue;
+    pthread_mutex_lock(&qp->lock);
+    if (mq_pop_locked(qp, key, data) == 0) {
+      pthread_mutex_unlock(&qp->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&qp->lock);
+  }
+  return -1;
+}
+
+
+long
+multiqueue_count(multiqueue_t *mq)
+{
+  long count = 0;
+  int i;
+
+  for (i = 0; i < mq->nqueues; i++)
+    count += __atomic_load_n(&mq->queues[i].size, __ATOMIC_RELAXED);
+  return count;
+}
@@ -0,0 +1,97 @@
+#ifndef MULTIQUEUE_H__
+#define MULTIQUEUE_H__
+
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * Copyright (C) 2014 Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * Everyone is permitted to copy and distribute verbatim or modified
+ * copies of this license document, and changing it is allowed as long
+ * as the name is changed.
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ * This program is free software. It comes without any warranty, to the
+ * extent permitted by applicable law. You can redistribute it and/or
+ * modify it under the terms of the Do What The Fuck You Want To Public
+ * License, Version 2, as published by Sam Hocevar. See
+ * http://www.wtfpl.net/ for more details.
+ */
+
+#include <stdint.h>
+
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * multiqueue -- concurrent, relaxed min-priority queue.
+ *
+ * A multiqueue is a set of ordinary heaps (DHEAP_DECL_TYPE in heap.h),
+ * each behind its own lock.  multiqueue_push() inserts into a random
+ * heap.  multiqueue_pop() looks at the tops of two random heaps, and
+ * pops from the one with the smaller key.  A thread that finds a
+ * heap locked simply tries another one, so threads rarely wait for
+ * each other, and there is no lock that every operation takes.
+ *
+ * The price is that the order is relaxed: multiqueue_pop() returns
+ * one of the smallest keys, not always the smallest.  With NQUEUES
+ * heaps, the returned key ranks O(NQUEUES) on average among the keys
+ * present.  This suits a scheduler, which needs the timers to go out
+ * roughly, not exactly, in order.
+ *
+ * Sharing one multiqueue among T threads, use 2 * T heaps or so.
+ */
+
+struct multiqueue;
+typedef struct multiqueue multiqueue_t;
+
+/*
+ * Create a multiqueue of NQUEUES heaps.  If NQUEUES is zero, it uses
+ * twice the number of online CPUs.  Returns NULL on error.
+ */
+extern multiqueue_t *multiqueue_new(int nqueues);
+
+/*
+ * Delete MQ.  The data pointers still in MQ are not released.
+ */
+extern void multiqueue_delete(multiqueue_t *mq);
+
+/*
+ * Insert DATA with the priority KEY; smaller keys go out first.
+ * Returns zero on success, -1 if out of memory.
+ */
+extern int multiqueue_push(multiqueue_t *mq, uint64_t key, void *data);
+
+/*
+ * Pop one of the smallest keys to *KEY and its data to *DATA.
+ * Either may be NULL.  Returns zero on success, -1 if MQ was empty.
+ *
+ * MQ is reported empty only after every heap was seen empty, but
+ * another thread may push right after that.
+ */
+extern int multiqueue_pop(multiqueue_t *mq, uint64_t *key, void **data);
+
+/*
+ * Return the number of elements in MQ.  The count is exact only when
+ * no other thread is using MQ.
+ */
+extern long multiqueue_count(multiqueue_t *mq);
+
+END_C_DECLS
+
+#endif  /* MULTIQUEUE_H__ */
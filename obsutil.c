@@ -86,12 +86,10 @@ obsutil_thread_init_once(void)
 
 
 void
-obsutil_set_errno(int errno)
+obsutil_set_errno(int err)
 {
-  char errbuf[ERRBUF_LEN] = { 0, };
-
   int *p = obsutil_errno_();
-  *p = errno;
+  *p = err;
 }
 
 
@@ -99,7 +97,10 @@ int *
 obsutil_errno_(void)
 {
   int ret;
-  int *p = pthread_getspecific(obsutil_key_errno);
+  int *p;
+
+  obsutil_thread_init();
+  p = pthread_getspecific(obsutil_key_errno);
 
   if (!p) {
     p = malloc(sizeof(int));
@@ -101,10 +101,10 @@ BEGIN_C_DECLS
 
 #ifdef _PTHREAD
 
-extern int *obs_errno_(void);
-extern void obs_thread_init(void);
+extern int *obsutil_errno_(void);
+extern void obsutil_thread_init(void);
 
-#define obs_errno   (*(obs_errno_()))
+#define obs_errno   (*(obsutil_errno_()))
 
 #else
 extern int obs_errno;
@@ -21,9 +21,15 @@
 
 #include <iterator>
 #include <cstdlib>
+#include <new>
 #include <errno.h>
 #include <poll.h>
 
+#ifdef POLLXX_TWHEEL
+#include <climits>
+#include "twheel.h"
+#endif
+
 #ifndef BEGIN_NAMESPACE
 #define BEGIN_NAMESPACE(x)      namespace x {
 #define END_NAMESPACE(x)        }
@@ -44,6 +50,12 @@ public:
 };
 
 
+//
+// If POLLXX_TWHEEL is defined before including this header, a timer
+// wheel (see twheel.h; link twheel.c) can be attached with timers().
+// Then poll() waits no longer than until the next timer of the wheel
+// is due, and runs the expired timers before it returns.
+//
 template<class PollHandler = PollHandlerBase>
 class Poll {
 public:
@@ -52,6 +64,9 @@ public:
   Poll(PollHandler *handlers = NULL)
     : grow_size(POLL_GROW_SIZE), handlers_(handlers),
       pfds_(0), pfds_end_(0), pfds_capacity_(0), handler_args_(0)
+#ifdef POLLXX_TWHEEL
+    , timers_(0)
+#endif
   {
   }
   ~Poll() { free(pfds_); }
@@ -85,9 +100,28 @@ public:
     ++pfds_end_;
   }
 
+#ifdef POLLXX_TWHEEL
+  void timers(twheel_t *timers) { timers_ = timers; }
+  twheel_t *timers() const { return timers_; }
+#endif
+
   bool poll(int milleseconds = 0, void *args = 0) {
     handler_args_ = args;
+#ifdef POLLXX_TWHEEL
+    if (timers_) {
+      long due = twheel_timeout(timers_, twheel_clock());
+      if (due >= 0 && (milleseconds < 0 || due < milleseconds))
+        milleseconds = due > INT_MAX ? INT_MAX : due;
+    }
+#endif
     int ret = ::poll(pfds_, pfds_end_, milleseconds);
+#ifdef POLLXX_TWHEEL
+    if (timers_) {
+      int saved_errno = errno;
+      twheel_advance(timers_, twheel_clock());
+      errno = saved_errno;
+    }
+#endif
     if (ret == -1)
       if (errno != EINTR)
         return false;
@@ -128,7 +162,7 @@ private:
     pollfd *p;
     size_t newsize = pfds_capacity_ + grow_size;
 
-    p = static_cast<pollfd *>(std::realloc(pfds_, newsize));
+    p = static_cast<pollfd *>(std::realloc(pfds_, newsize * sizeof(*p)));
     if (!p)
       throw std::bad_alloc();
 
@@ -143,6 +177,9 @@ private:
   size_t pfds_capacity_;
 
   void *handler_args_;
+#ifdef POLLXX_TWHEEL
+  twheel_t *timers_;
+#endif
 };
 
 
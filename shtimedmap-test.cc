@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+
+#include "shtimedmap.hh"
+
+STMAP_TYPE_DECL(intmap, std::string, int);
+
+static int failed;
+
+static void
+check(bool cond, const char *what)
+{
+  printf("%s: %s\n", cond ? "ok" : "FAIL", what);
+  if (!cond)
+    failed++;
+}
+
+static bool
+found(intmap &m, const std::string &key)
+{
+  TMAP_GET(intmap, m, key, g) {
+    return (bool)g;
+  }
+  return false;
+}
+
+int
+main(void)
+{
+  intmap m(100, 1, intmap::EXPIRE_SLIDING);
+
+  m.set("a", 1);
+  TMAP_GET(intmap, m, std::string("a"), g) {
+    check(g, "get after set");
+    if (g)
+      g.refresh(1000);
+  }
+
+  // A hit on a sliding entry must not pull the expiration of a
+  // refresh() back to now + TTL.
+  usleep(300 * 1000);
+  check(found(m, "a"), "get after refresh");
+  usleep(300 * 1000);
+  check(found(m, "a"), "refresh survives a sliding hit");
+
+  // Without hits, it expires after the refreshed life-time.
+  usleep(1000 * 1000);
+  check(!found(m, "a"), "expired after the refreshed life-time");
+
+  // A getter keeps a reaped entry alive, but refresh() must not bring
+  // it back into the map.
+  m.set("b", 2, 50);
+  TMAP_GET(intmap, m, std::string("b"), g) {
+    usleep(300 * 1000);
+    check(g && !g.refresh(), "refresh after the entry was reaped");
+  }
+  check(!found(m, "b"), "reaped entry stays out of the map");
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,1263 @@
+#ifndef SHTIMEDMAP_HH__
+#define SHTIMEDMAP_HH__
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/functional/hash.hpp>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xerror.h"
+
+//
+// sharded_timedmap is a variant of timedmap (see timedmap.hh) for
+// maps that are shared by many threads.  The interface is the same,
+// but internally the keys are hashed into N shards, and each shard
+// has its own mutex, its own hash table, and its own timer wheel.
+// Two threads that touch keys in different shards never contend.
+//
+// Declare the type with STMAP_TYPE_DECL, and access the values with
+// the usual TMAP_GET macro:
+//
+//   STMAP_TYPE_DECL(foomap, std::string, Foo);
+//
+//   foomap fmap(5000);       // 5 seconds life-time, default # of shards
+//   fmap.set(key, Foo(...));
+//   fmap.set(key2, Foo(...), 250);     // this one lives for 250ms
+//
+//   TMAP_GET(foomap, fmap, key, g) {
+//     if (g)
+//       g->what();
+//   }
+//
+// The key type must be usable with boost::hash, and comparable with
+// operator==.
+//
+// Unlike timedmap, all durations are in milliseconds, and each entry
+// keeps the life-time it was set() with.  The map never calls time(2)
+// or clock_gettime(2) on the get/set path; the reaper reads
+// CLOCK_MONOTONIC_COARSE once per tick (TICK_MS) and caches it, so an
+// entry may outlive its life-time by up to one tick.
+//
+// If CAPACITY is given, each shard holds at most CAPACITY / N units,
+// where the size of an entry is measured by the size functor, S.  The
+// default, tm_unit_size, counts entries; pass a functor that returns
+// the bytes of a (key, value) pair to bound the memory instead.  When a
+// set() would exceed the limit, the shard evicts entries in CLOCK
+// order: expired entries go first, and an entry that was hit since the
+// clock hand passed it last gets a second chance.  Hits only set a bit
+// in the entry, so the read path stays lock-free.
+//
+// Callers that look up or register many keys at once should use
+// get_many() and set_many().  They sort the keys by shard, so that
+// set_many() takes each shard lock once per batch, and get_many() runs
+// the whole batch in one read section.  Neither allocates memory for
+// the batch itself; get_many() stores the results in an array of ref,
+// a copyable counterpart of timedmap_getter.
+//
+// stats() returns the counters of hits, misses, expirations and
+// evictions, and the current number and size of the entries.  They are
+// updated with relaxed atomic operations and may be polled at any time.
+//
+// With EXPIRE_SLIDING policy, every successful lookup extends the
+// life-time of the entry by its TTL, as if the getter called
+// refresh().  A lookup never shortens a life-time that refresh() set
+// further away.  The default, EXPIRE_FIXED, never extends it
+// implicitly.
+//
+// Readers never take a lock.  The hash chains of a shard are updated
+// RCU-style under the shard mutex: set() on an existing key does not
+// modify the value in place, but publishes a new entry that replaces
+// the old one.  A getter pins the entry it found with a reference
+// count, so the value it sees stays alive (and unchanged) until the
+// getter goes out of scope, even if the key is overwritten, erased or
+// expired in the meantime.  Unlinked entries are reclaimed through
+// tm_epoch (see below) once no reader can still be looking at them.
+// Since values are shared by readers, the getter only gives const
+// access to the value; use set() to change it.
+//
+// Expiration is driven by a hierarchical timer wheel per shard instead
+// of scanning the whole map.  The reaper thread wakes up every tick
+// and only visits the wheel slot that is due, so the cost of a tick is
+// proportional to the number of entries that expire in that tick, not
+// to the size of the map.  An entry whose life-time is extended (by
+// refresh()) stays in its old slot; when the slot fires, the entry is
+// simply re-linked to the slot of its new expiration time.  refresh()
+// synchronizes with the reaper through the shard lock, so it is never
+// lost, but it cannot resurrect an entry that was already reaped.  The
+// lock-free extension of EXPIRE_SLIDING may still lose that race for
+// an entry hit in the very tick it expires.
+//
+
+#ifndef STMAP_TICK_MS
+#define STMAP_TICK_MS   10      // resolution of the reaper and the clock
+#endif
+
+#ifndef TM_EPOCH_SLOTS
+#define TM_EPOCH_SLOTS  1024    // max. # of threads that read at once
+#endif
+
+// Return CLOCK_MONOTONIC_COARSE in milliseconds.
+static inline long long
+tm_clock_ms(void)
+{
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+//
+// tm_epoch is a process-wide epoch-based reclamation domain.  A
+// reader calls enter() before it loads a pointer from a shared
+// structure and leave() when it is done with the pointer.  A writer
+// tags an unlinked object with current() and may free it once
+// current() has advanced twice, i.e. every reader that could have seen
+// the object has left.  Each thread grabs one of TM_EPOCH_SLOTS slots
+// on its first enter(), and releases it when it exits.
+//
+class tm_epoch {
+  struct slot {
+    unsigned long epoch_;       // (epoch << 1) | 1 while in a read section
+    int used_;
+    char pad_[64 - sizeof(unsigned long) - sizeof(int)];
+  };
+
+  unsigned long global_;
+  char pad_[64 - sizeof(unsigned long)];
+  slot slots_[TM_EPOCH_SLOTS];
+  int nslots_;                  // high-water mark of the used slots
+  pthread_key_t key_;
+
+  tm_epoch(const tm_epoch &);
+  tm_epoch &operator=(const tm_epoch &);
+
+  tm_epoch() : global_(1), nslots_(0) {
+    memset(slots_, 0, sizeof(slots_));
+    int ret = pthread_key_create(&key_, release_slot);
+    if (ret)
+      xerror(1, ret, "pthread_key_create failed");
+  }
+
+  static void release_slot(void *p) {
+    slot *s = &domain().slots_[(long)p - 1];
+    __atomic_store_n(&s->epoch_, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->used_, 0, __ATOMIC_RELEASE);
+  }
+
+  slot *my_slot() {
+    static __thread long idx = -1;
+
+    if (idx >= 0)
+      return &slots_[idx];
+
+    for (long i = 0; i < TM_EPOCH_SLOTS; i++) {
+      int unused = 0;
+      if (__atomic_compare_exchange_n(&slots_[i].used_, &unused, 1, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        int hw = __atomic_load_n(&nslots_, __ATOMIC_RELAXED);
+        while (hw < i + 1 &&
+               !__atomic_compare_exchange_n(&nslots_, &hw, i + 1, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED))
+          ;
+        pthread_setspecific(key_, (void *)(i + 1));
+        idx = i;
+        return &slots_[i];
+      }
+    }
+    xerror(1, 0, "tm_epoch: more than %d threads; raise TM_EPOCH_SLOTS",
+           TM_EPOCH_SLOTS);
+    return 0;
+  }
+
+public:
+  ~tm_epoch() {
+    pthread_key_delete(key_);
+  }
+
+  static tm_epoch &domain() {
+    static tm_epoch d;
+    return d;
+  }
+
+  void enter() {
+    slot *s = my_slot();
+    unsigned long e = __atomic_load_n(&global_, __ATOMIC_RELAXED);
+
+    while (1) {
+      __atomic_store_n(&s->epoch_, (e << 1) | 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      unsigned long e2 = __atomic_load_n(&global_, __ATOMIC_RELAXED);
+      if (e2 == e)
+        break;
+      e = e2;
+    }
+  }
+
+  void leave() {
+    __atomic_store_n(&my_slot()->epoch_, 0, __ATOMIC_RELEASE);
+  }
+
+  unsigned long current() const {
+    return __atomic_load_n(&global_, __ATOMIC_SEQ_CST);
+  }
+
+  // Advance the global epoch if every active reader has observed the
+  // current one.  Returns the (possibly new) current epoch.
+  unsigned long try_advance() {
+    unsigned long e = current();
+    int n = __atomic_load_n(&nslots_, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++) {
+      unsigned long v = __atomic_load_n(&slots_[i].epoch_, __ATOMIC_ACQUIRE);
+      if ((v & 1) && (v >> 1) != e)
+        return e;
+    }
+    __atomic_compare_exchange_n(&global_, &e, e + 1, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return current();
+  }
+};
+
+
+// Default size functor of sharded_timedmap; every entry weighs one,
+// so that the capacity is counted in entries.
+struct tm_unit_size {
+  template <class K, class V>
+  size_t operator()(const K &, const V &) const { return 1; }
+};
+
+
+template <class K, class V, class H = boost::hash<K>, class S = tm_unit_size>
+class sharded_timedmap {
+public:
+  enum expire_policy {
+    EXPIRE_FIXED,               // life-time is extended only by set/refresh
+    EXPIRE_SLIDING,             // every hit extends the life-time
+  };
+
+  struct statistics {
+    uint64_t hits;              // lookups that found a live entry
+    uint64_t misses;            // lookups that found nothing or expired one
+    uint64_t expirations;       // entries removed since they were expired
+    uint64_t evictions;         // live entries removed to make room
+    uint64_t locks;             // shard lock acquisitions by set/erase
+    size_t entries;             // # of entries, including unreaped ones
+    size_t weight;              // sum of S(key, value) of the entries
+  };
+
+private:
+
+  class Mutex {
+    pthread_mutex_t mtx_;
+    Mutex(const Mutex &);            // can't copied
+    Mutex &operator=(const Mutex &); // can't assigned
+  public:
+    Mutex(int type = PTHREAD_MUTEX_ERRORCHECK) {
+      pthread_mutexattr_t attr;
+
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_settype(&attr, type);
+      pthread_mutex_init(&mtx_, &attr);
+      pthread_mutexattr_destroy(&attr);
+    }
+
+    ~Mutex() {
+      int ret = pthread_mutex_destroy(&mtx_);
+      if (ret)
+        xerror(0, ret, "pthread_mutex_destroy failed");
+    }
+
+    void lock() {
+      int ret = pthread_mutex_lock(&mtx_);
+      if (ret)
+        xerror(0, ret, "pthread_mutex_lock failed");
+    }
+    void unlock() {
+      int ret = pthread_mutex_unlock(&mtx_);
+      if (ret)
+        xerror(0, ret, "pthread_mutex_unlock failed");
+    }
+
+    bool trylock() {
+      int ret = pthread_mutex_trylock(&mtx_);
+
+      if (!ret)
+        return true;
+      else {
+        if (ret != EBUSY)
+          xerror(0, ret, "pthread_mutex_trylock failed errno = %d", ret);
+        return false;
+      }
+    }
+  };
+
+  // Each wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots.  Level N
+  // slot covers WHEEL_SIZE^N ticks, so four levels of 64 slots cover
+  // 2^24 ticks (about 46 hours with 10ms ticks).  Entries that expire
+  // even later are parked in the farthest slot and re-linked when it
+  // fires.
+  enum {
+    TICK_MS = STMAP_TICK_MS,
+    WHEEL_BITS = 6,
+    WHEEL_SIZE = 1 << WHEEL_BITS,
+    WHEEL_MASK = WHEEL_SIZE - 1,
+    WHEEL_LEVELS = 4,
+  };
+
+  // # of the initial hash buckets per shard, # of retired entries that
+  // makes a writer try to reclaim them without waiting the reaper, and
+  // # of keys that get_many()/set_many() sort by shard at once.
+  enum {
+    INITIAL_BUCKETS = 16,
+    RECLAIM_THRESHOLD = 128,
+    BATCH_CHUNK = 256,
+    COUNTING_SORT_MAX = 1024,   // sort_batch() falls back to std::sort
+  };
+
+  // A key of a batch, to be sorted by its shard.
+  struct batch_key {
+    uint64_t hash_;
+    unsigned shard_;
+    unsigned idx_;              // index in the caller's array
+
+    bool operator<(const batch_key &rhs) const {
+      return shard_ < rhs.shard_ || (shard_ == rhs.shard_ && idx_ < rhs.idx_);
+    }
+  };
+
+  struct wlink {
+    wlink *prev_;
+    wlink *next_;
+
+    wlink() : prev_(this), next_(this) {}
+
+    bool linked() const { return next_ != this; }
+
+    void unlink() {
+      prev_->next_ = next_;
+      next_->prev_ = prev_;
+      prev_ = next_ = this;
+    }
+
+    void push_back(wlink *p) {
+      p->prev_ = prev_;
+      p->next_ = this;
+      prev_->next_ = p;
+      prev_ = p;
+    }
+
+    // move all elements of this list to the (empty) list, DST.
+    void splice_to(wlink *dst) {
+      if (!linked())
+        return;
+      dst->next_ = next_;
+      dst->prev_ = prev_;
+      next_->prev_ = dst;
+      prev_->next_ = dst;
+      prev_ = next_ = this;
+    }
+  };
+
+  // An entry of the map.  KEY_ and VAL_ never change once the entry is
+  // published; HNEXT_, EXP_ and REFERENCED_ are accessed by readers
+  // without the shard lock, so they are always accessed atomically.
+  // The wheel links, the clock links and RNEXT_ are only touched with
+  // the shard lock held.
+  struct TMENT : public wlink {
+    TMENT *hnext_;              // next entry in the hash chain
+    const K key_;
+    const V val_;               // user provided value
+    uint64_t hash_;
+    long long exp_;             // TMENT is invalid after exp_ (absolute ms)
+    long ttl_;                  // life-time in ms, used by refresh()
+    size_t size_;               // S(key_, val_)
+    int refs_;                  // one for the map, plus one per getter
+    int referenced_;            // hit since the clock hand passed
+    TMENT *cprev_;              // clock ring
+    TMENT *cnext_;
+    TMENT *rnext_;              // next entry in the retired list
+    unsigned long retired_;     // tm_epoch when it was unlinked
+
+    TMENT(const K &key, const V &val, uint64_t hash, long long now, long ttl,
+          size_t size)
+      : wlink(), hnext_(0), key_(key), val_(val), hash_(hash),
+        exp_(now + ttl), ttl_(ttl), size_(size), refs_(1), referenced_(0),
+        cprev_(this), cnext_(this), rnext_(0), retired_(0) {}
+
+    void hold() {
+      __atomic_add_fetch(&refs_, 1, __ATOMIC_RELAXED);
+    }
+
+    void release() {
+      if (__atomic_sub_fetch(&refs_, 1, __ATOMIC_ACQ_REL) == 0)
+        delete this;
+    }
+
+    long long expire() const {
+      return __atomic_load_n(&exp_, __ATOMIC_RELAXED);
+    }
+
+    void expire(long long exp) {
+      __atomic_store_n(&exp_, exp, __ATOMIC_RELAXED);
+    }
+
+    void touch() {
+      if (!__atomic_load_n(&referenced_, __ATOMIC_RELAXED))
+        __atomic_store_n(&referenced_, 1, __ATOMIC_RELAXED);
+    }
+  };
+
+  struct table {
+    size_t mask_;
+    TMENT *bucket_[1];          // actually, mask_ + 1 buckets
+
+    static table *create(size_t nbuckets) {
+      size_t sz = sizeof(table) + sizeof(TMENT *) * (nbuckets - 1);
+      table *t = (table *)operator new(sz);
+      memset(t, 0, sz);
+      t->mask_ = nbuckets - 1;
+      return t;
+    }
+
+    static void destroy(table *t) {
+      operator delete(t);
+    }
+  };
+
+  // A bucket array replaced by resize(); it can be freed after two
+  // epochs, like the entries.
+  struct oldtable {
+    table *tab_;
+    unsigned long retired_;
+    oldtable *next_;
+  };
+
+  struct shard {
+    Mutex mtx_;                 // serializes writers, protects wheel_
+    table *tab_;
+    unsigned seq_;              // odd while tab_ is being resized
+    size_t count_;
+    size_t weight_;             // sum of size_ of the entries
+    TMENT *hand_;               // clock hand; null if the shard is empty
+    wlink wheel_[WHEEL_LEVELS][WHEEL_SIZE];
+    long long now_;             // last tick processed by the wheel
+
+    TMENT *rhead_;              // retired entries, oldest first
+    TMENT *rtail_;
+    size_t nretired_;
+    oldtable *oldtabs_;
+
+    // Readers update the counters too, so keep them away from the
+    // fields above.
+    char pad_[64];
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t expirations_;
+    uint64_t evictions_;
+    uint64_t locks_;
+
+    explicit shard(long long tick)
+      : mtx_(), tab_(table::create(INITIAL_BUCKETS)), seq_(0), count_(0),
+        weight_(0), hand_(0), now_(tick), rhead_(0), rtail_(0),
+        nretired_(0), oldtabs_(0), hits_(0), misses_(0), expirations_(0),
+        evictions_(0), locks_(0) {}
+
+    ~shard() {
+      for (size_t i = 0; i <= tab_->mask_; i++) {
+        TMENT *p = tab_->bucket_[i];
+        while (p) {
+          TMENT *next = p->hnext_;
+          p->release();
+          p = next;
+        }
+      }
+      table::destroy(tab_);
+
+      while (rhead_) {
+        TMENT *next = rhead_->rnext_;
+        rhead_->release();
+        rhead_ = next;
+      }
+      while (oldtabs_) {
+        oldtable *next = oldtabs_->next_;
+        table::destroy(oldtabs_->tab_);
+        delete oldtabs_;
+        oldtabs_ = next;
+      }
+    }
+  };
+
+  shard **shards_;
+  unsigned nshards_;            // always power of two
+  unsigned shard_bits_;
+  long duration_;               // default lifetime of new element in ms
+  expire_policy policy_;
+  size_t capacity_;             // per shard, zero if unbounded
+  H hash_;
+  S size_;
+  tm_epoch &epoch_;
+  long long now_;               // cached clock, updated by the reaper
+
+  sharded_timedmap(const sharded_timedmap &);
+  sharded_timedmap &operator=(const sharded_timedmap &);
+
+  static void *reaper_main(void *arg);
+  pthread_t reaper_;
+
+  long long now() const {
+#ifdef NOREAP
+    return tm_clock_ms();
+#else
+    return __atomic_load_n(&now_, __ATOMIC_RELAXED);
+#endif
+  }
+
+  uint64_t hash_of(const K &k) const {
+    return (uint64_t)hash_(k);
+  }
+
+  unsigned shard_index(uint64_t h) const {
+    if (shard_bits_ == 0)
+      return 0;
+    // Use the upper bits of the mixed hash, so that shard selection
+    // does not correlate with the bucket selection of the shard.
+    return (h * 0x9E3779B97F4A7C15ULL) >> (64 - shard_bits_);
+  }
+
+  shard *shard_of(uint64_t h) const {
+    return shards_[shard_index(h)];
+  }
+
+  static void lock(shard *s) {
+    s->mtx_.lock();
+    __atomic_store_n(&s->locks_, s->locks_ + 1, __ATOMIC_RELAXED);
+  }
+
+  // Fill BK with the keys KEYS[0..N), sorted by shard, and by index
+  // within a shard.  N must not exceed BATCH_CHUNK.
+  void sort_batch(batch_key *bk, const K *keys, size_t n) const {
+    if (nshards_ > COUNTING_SORT_MAX) {
+      for (size_t i = 0; i < n; i++) {
+        bk[i].hash_ = hash_of(keys[i]);
+        bk[i].shard_ = shard_index(bk[i].hash_);
+        bk[i].idx_ = i;
+      }
+      std::sort(bk, bk + n);
+      return;
+    }
+
+    // counting sort; stable, so the indices stay in order.
+    batch_key tmp[BATCH_CHUNK];
+    unsigned pos[COUNTING_SORT_MAX + 1];
+
+    memset(pos, 0, sizeof(pos[0]) * (nshards_ + 1));
+    for (size_t i = 0; i < n; i++) {
+      tmp[i].hash_ = hash_of(keys[i]);
+      tmp[i].shard_ = shard_index(tmp[i].hash_);
+      tmp[i].idx_ = i;
+      pos[tmp[i].shard_ + 1]++;
+    }
+    for (unsigned i = 1; i <= nshards_; i++)
+      pos[i] += pos[i - 1];
+    for (size_t i = 0; i < n; i++)
+      bk[pos[tmp[i].shard_]++] = tmp[i];
+  }
+
+  // Find the entry of K without any lock.  The caller must be in a
+  // tm_epoch read section.  A miss is only trusted if no resize was in
+  // progress during the walk, since resize() moves the entries between
+  // chains.
+  static TMENT *lookup(shard *s, const K &k, uint64_t h) {
+    while (1) {
+      unsigned seq = __atomic_load_n(&s->seq_, __ATOMIC_ACQUIRE);
+      table *t = __atomic_load_n(&s->tab_, __ATOMIC_ACQUIRE);
+      TMENT *p = __atomic_load_n(&t->bucket_[h & t->mask_], __ATOMIC_ACQUIRE);
+
+      for (; p; p = __atomic_load_n(&p->hnext_, __ATOMIC_ACQUIRE))
+        if (p->hash_ == h && p->key_ == k)
+          return p;
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (!(seq & 1) && __atomic_load_n(&s->seq_, __ATOMIC_RELAXED) == seq)
+        return 0;
+    }
+  }
+
+  // Return the link that points ENT in its chain.  Shard lock required.
+  static TMENT **link_of(shard *s, TMENT *ent) {
+    TMENT **pp = &s->tab_->bucket_[ent->hash_ & s->tab_->mask_];
+    while (*pp != ent)
+      pp = &(*pp)->hnext_;
+    return pp;
+  }
+
+  // Return the link that points the entry of K, or the terminating
+  // null link of the chain.  Shard lock required.
+  static TMENT **find_link(shard *s, const K &k, uint64_t h) {
+    TMENT **pp = &s->tab_->bucket_[h & s->tab_->mask_];
+    while (*pp && !((*pp)->hash_ == h && (*pp)->key_ == k))
+      pp = &(*pp)->hnext_;
+    return pp;
+  }
+
+  static void resize(shard *s) {
+    table *old = s->tab_;
+    table *t = table::create((old->mask_ + 1) * 2);
+
+    __atomic_store_n(&s->seq_, s->seq_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (size_t i = 0; i <= old->mask_; i++) {
+      TMENT *p = old->bucket_[i];
+      while (p) {
+        TMENT *next = p->hnext_;
+        TMENT **head = &t->bucket_[p->hash_ & t->mask_];
+        __atomic_store_n(&p->hnext_, *head, __ATOMIC_RELEASE);
+        *head = p;
+        p = next;
+      }
+    }
+    __atomic_store_n(&s->tab_, t, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->seq_, s->seq_ + 1, __ATOMIC_RELEASE);
+
+    oldtable *ot = new oldtable;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ot->tab_ = old;
+    ot->retired_ = tm_epoch::domain().current();
+    ot->next_ = s->oldtabs_;
+    s->oldtabs_ = ot;
+  }
+
+  // Put ENT, which is already unlinked from its chain, to the retired
+  // list.  Shard lock required.
+  static void retire(shard *s, TMENT *ent) {
+    ent->unlink();
+    // The epoch must be read after the unlink is visible to readers.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ent->retired_ = tm_epoch::domain().current();
+    ent->rnext_ = 0;
+    if (s->rtail_)
+      s->rtail_->rnext_ = ent;
+    else
+      s->rhead_ = ent;
+    s->rtail_ = ent;
+    s->nretired_++;
+  }
+
+  static void count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+  }
+
+  // Put ENT in the clock ring, right behind the hand, so that it is
+  // the last one the hand visits.  Shard lock required.
+  static void clock_link(shard *s, TMENT *ent) {
+    if (!s->hand_) {
+      ent->cprev_ = ent->cnext_ = ent;
+      s->hand_ = ent;
+    }
+    else {
+      ent->cnext_ = s->hand_;
+      ent->cprev_ = s->hand_->cprev_;
+      ent->cprev_->cnext_ = ent;
+      s->hand_->cprev_ = ent;
+    }
+    __atomic_store_n(&s->weight_, s->weight_ + ent->size_, __ATOMIC_RELAXED);
+  }
+
+  static void clock_unlink(shard *s, TMENT *ent) {
+    if (ent->cnext_ == ent)
+      s->hand_ = 0;
+    else {
+      if (s->hand_ == ent)
+        s->hand_ = ent->cnext_;
+      ent->cprev_->cnext_ = ent->cnext_;
+      ent->cnext_->cprev_ = ent->cprev_;
+    }
+    ent->cprev_ = ent->cnext_ = ent;
+    __atomic_store_n(&s->weight_, s->weight_ - ent->size_, __ATOMIC_RELAXED);
+  }
+
+  static void remove(shard *s, TMENT **link) {
+    TMENT *ent = *link;
+    __atomic_store_n(link, ent->hnext_, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&s->count_, 1, __ATOMIC_RELAXED);
+    clock_unlink(s, ent);
+    retire(s, ent);
+  }
+
+  // Evict the entries other than KEEP in CLOCK order until the shard
+  // fits in its capacity.  Shard lock required.
+  void make_room(shard *s, TMENT *keep, long long now) {
+    // Every entry may get a second chance once, so after two rounds
+    // the hand evicts whatever it points, even if readers keep setting
+    // the bits behind it.
+    size_t chances = s->count_ * 2;
+
+    while (s->weight_ > capacity_ && s->count_ > 1) {
+      TMENT *ent = s->hand_;
+
+      if (ent == keep) {
+        s->hand_ = ent->cnext_;
+        continue;
+      }
+      if (ent->expire() < now)
+        count(&s->expirations_);
+      else if (chances > 0 &&
+               __atomic_load_n(&ent->referenced_, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ent->referenced_, 0, __ATOMIC_RELAXED);
+        s->hand_ = ent->cnext_;
+        chances--;
+        continue;
+      }
+      else
+        count(&s->evictions_);
+      remove(s, link_of(s, ent));
+    }
+  }
+
+  // Drop the map's reference of the retired entries (and bucket
+  // arrays) that no reader can see anymore.  Shard lock required.
+  static void reclaim(shard *s, unsigned long epoch) {
+    while (s->rhead_ && s->rhead_->retired_ + 2 <= epoch) {
+      TMENT *ent = s->rhead_;
+      s->rhead_ = ent->rnext_;
+      s->nretired_--;
+      ent->release();
+    }
+    if (!s->rhead_)
+      s->rtail_ = 0;
+
+    oldtable **pp = &s->oldtabs_;
+    while (*pp) {
+      oldtable *ot = *pp;
+      if (ot->retired_ + 2 <= epoch) {
+        *pp = ot->next_;
+        table::destroy(ot->tab_);
+        delete ot;
+      }
+      else
+        pp = &ot->next_;
+    }
+  }
+
+  static void wheel_link(shard *s, TMENT *ent) {
+    // An entry is still valid at exp_, so it is due at the next tick.
+    uint64_t now = (uint64_t)s->now_;
+    uint64_t due = (uint64_t)(ent->expire() / TICK_MS) + 1;
+    if (due <= now)
+      due = now + 1;
+
+    uint64_t delta = due - now;
+    int lv;
+    for (lv = 0; lv < WHEEL_LEVELS - 1; lv++)
+      if (delta < (1ULL << ((lv + 1) * WHEEL_BITS)))
+        break;
+    if (delta >= (1ULL << (WHEEL_LEVELS * WHEEL_BITS)))
+      due = now + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+    s->wheel_[lv][(due >> (lv * WHEEL_BITS)) & WHEEL_MASK].push_back(ent);
+  }
+
+  // Re-link every entries in the higher level slots that became due
+  // in the current tick into the lower levels.
+  static void wheel_cascade(shard *s) {
+    uint64_t t = (uint64_t)s->now_;
+
+    for (int lv = 1; lv < WHEEL_LEVELS; lv++) {
+      if (((t >> ((lv - 1) * WHEEL_BITS)) & WHEEL_MASK) != 0)
+        break;
+
+      wlink head;
+      s->wheel_[lv][(t >> (lv * WHEEL_BITS)) & WHEEL_MASK].splice_to(&head);
+      while (head.linked()) {
+        TMENT *ent = static_cast<TMENT *>(head.next_);
+        ent->unlink();
+        wheel_link(s, ent);
+      }
+    }
+  }
+
+  static void wheel_expire(shard *s) {
+    wlink head;
+    s->wheel_[0][s->now_ & WHEEL_MASK].splice_to(&head);
+
+    while (head.linked()) {
+      TMENT *ent = static_cast<TMENT *>(head.next_);
+      ent->unlink();
+
+      if (ent->expire() < s->now_ * TICK_MS) {
+        xdebug(0, "reaper: remove key");
+        // getters that still hold ENT keep it alive.
+        remove(s, link_of(s, ent));
+        count(&s->expirations_);
+      }
+      else                      // the life-time was extended
+        wheel_link(s, ent);
+    }
+  }
+
+  static void wheel_advance(shard *s, long long tick) {
+    while (s->now_ < tick) {
+      s->now_++;
+      wheel_cascade(s);
+      wheel_expire(s);
+    }
+  }
+
+  static unsigned default_shards() {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+      ncpu = 1;
+    return (unsigned)ncpu * 4;
+  }
+
+public:
+
+  // NSHARDS is rounded up to the power of two.  If NSHARDS is zero,
+  // four times the number of online CPUs are used.  CAPACITY is
+  // measured with S, and zero means unbounded.
+  explicit sharded_timedmap(long duration = 5000, unsigned nshards = 0,
+                            expire_policy policy = EXPIRE_FIXED,
+                            size_t capacity = 0)
+    : shards_(0), nshards_(1), shard_bits_(0), duration_(duration),
+      policy_(policy), capacity_(0), hash_(), size_(),
+      epoch_(tm_epoch::domain()), now_(tm_clock_ms()) {
+    if (nshards == 0)
+      nshards = default_shards();
+    while (nshards_ < nshards) {
+      nshards_ <<= 1;
+      shard_bits_++;
+    }
+    if (capacity)
+      capacity_ = (capacity + nshards_ - 1) / nshards_;
+
+    shards_ = new shard *[nshards_];
+    for (unsigned i = 0; i < nshards_; i++)
+      shards_[i] = new shard(now_ / TICK_MS);
+
+#ifndef NOREAP
+    int ret = pthread_create(&reaper_, 0, reaper_main, (void *)this);
+    if (ret != 0)
+      xerror(0, ret, "pthread_create failed");
+#endif  // NOREAP
+  }
+
+  ~sharded_timedmap() {
+#ifndef NOREAP
+    int ret;
+    ret = pthread_cancel(reaper_);
+    if (ret != 0)
+      xerror(0, ret, "pthread_cancel failed");
+
+    ret = pthread_join(reaper_, 0);
+    if (ret != 0)
+      xerror(0, ret, "pthread_join failed");
+#endif  // NOREAP
+    for (unsigned i = 0; i < nshards_; i++)
+      delete shards_[i];
+    delete [] shards_;
+  }
+
+  long duration() const { return duration_; }
+  unsigned shards() const { return nshards_; }
+
+  // Register V with the key, K, for DURATION ms.  If DURATION is zero,
+  // the default life-time of the map is used.  If the map is bounded,
+  // this may evict other entries.  An entry that is larger than the
+  // capacity of a shard is still stored, alone.
+  void set(const K &k, const V &v, long duration = 0) {
+    uint64_t h = hash_of(k);
+    shard *s = shard_of(h);
+    long long ts = now();
+    TMENT *ent = new TMENT(k, v, h, ts, duration ? duration : duration_,
+                           size_(k, v));
+    lock(s);
+    insert(s, ent, ts);
+
+    if (s->nretired_ > RECLAIM_THRESHOLD)
+      reclaim(s, epoch_.try_advance());
+    s->mtx_.unlock();
+  }
+
+  // Register VALS[i] with KEYS[i] for 0 <= i < N, all with the same
+  // DURATION.  This is the same as calling set() N times, except that
+  // each shard is locked once per BATCH_CHUNK keys.
+  void set_many(const K *keys, const V *vals, size_t n, long duration = 0) {
+    batch_key bk[BATCH_CHUNK];
+    TMENT *ents[BATCH_CHUNK];
+    long long ts = now();
+    long ttl = duration ? duration : duration_;
+
+    for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+      size_t cnt = std::min(n - base, (size_t)BATCH_CHUNK);
+
+      sort_batch(bk, keys + base, cnt);
+      for (size_t i = 0; i < cnt; i++) {
+        const K &k = keys[base + bk[i].idx_];
+        const V &v = vals[base + bk[i].idx_];
+        ents[i] = new TMENT(k, v, bk[i].hash_, ts, ttl, size_(k, v));
+      }
+
+      for (size_t i = 0; i < cnt; ) {
+        shard *s = shards_[bk[i].shard_];
+        size_t end = i;
+
+        lock(s);
+        // Keys of a shard are sorted by their index, so duplicated
+        // keys are applied in order, as set() would.
+        for (; end < cnt && bk[end].shard_ == bk[i].shard_; end++)
+          insert(s, ents[end], ts);
+        if (s->nretired_ > RECLAIM_THRESHOLD)
+          reclaim(s, epoch_.try_advance());
+        s->mtx_.unlock();
+        i = end;
+      }
+    }
+  }
+
+private:
+  // Link ENT, which was created at TS, to the shard, replacing the
+  // entry of the same key if any.  Shard lock required.
+  void insert(shard *s, TMENT *ent, long long ts) {
+    uint64_t h = ent->hash_;
+    TMENT **link = find_link(s, ent->key_, h);
+    TMENT *old = *link;
+
+    if (old) {
+      ent->hnext_ = old->hnext_;
+      __atomic_store_n(link, ent, __ATOMIC_RELEASE);
+      clock_unlink(s, old);
+      retire(s, old);
+    }
+    else {
+      ent->hnext_ = s->tab_->bucket_[h & s->tab_->mask_];
+      __atomic_store_n(&s->tab_->bucket_[h & s->tab_->mask_], ent,
+                       __ATOMIC_RELEASE);
+      if (__atomic_add_fetch(&s->count_, 1, __ATOMIC_RELAXED) >
+          s->tab_->mask_ + 1)
+        resize(s);
+    }
+    wheel_link(s, ent);
+    clock_link(s, ent);
+    if (capacity_)
+      make_room(s, ent, ts);
+  }
+
+public:
+
+
+  class timedmap_getter {
+    TMENT *ent_;
+
+    mutable bool once_;
+    sharded_timedmap &tmap_;
+
+    timedmap_getter(const timedmap_getter &);
+
+  public:
+    // The duration is accepted for TMAP_GET compatibility; each entry
+    // carries its own life-time.
+    explicit timedmap_getter(sharded_timedmap &tmap, const K &key,
+                             long /* duration */ = 0)
+      : ent_(0), once_(true), tmap_(tmap) {
+      uint64_t h = tmap.hash_of(key);
+      shard *s = tmap.shard_of(h);
+      long long now = tmap.now();
+
+      tmap.epoch_.enter();
+      TMENT *ent = lookup(s, key, h);
+      if (ent && !(ent->expire() < now)) {
+        ent->hold();
+        ent_ = ent;
+      }
+      tmap.epoch_.leave();
+
+      if (!ent_) {
+        count(&s->misses_);
+        return;
+      }
+      count(&s->hits_);
+      ent_->touch();
+
+      // The cached clock moves once per tick, so most hits find the
+      // expiration already up to date and do not write to the entry.
+      // Never move it backward; refresh() may have extended it beyond
+      // the TTL.
+      if (tmap.policy_ == EXPIRE_SLIDING &&
+          ent_->expire() < now + ent_->ttl_)
+        ent_->expire(now + ent_->ttl_);
+    }
+
+    ~timedmap_getter() {
+      if (ent_)
+        ent_->release();
+    }
+
+    operator bool() const {
+      return (ent_ != 0);
+    }
+
+    bool once(void) const {
+      if (once_) {
+        once_ = false;
+        return true;
+      }
+      return false;
+    }
+
+    void erase(void) {
+      if (ent_)
+        ent_->expire(0);
+    }
+
+    // Extend the life-time by DURATION ms from now.  If DURATION is
+    // zero, the TTL of the entry is used.  Return false if the entry
+    // is no longer in the map, i.e. it was already reaped, evicted,
+    // erased or overwritten; refresh() never brings it back.
+    //
+    // Unlike the lookup, this takes the shard lock.  The reaper reads
+    // the expiration and unlinks the entry under the same lock, so it
+    // either sees the new expiration and re-links the entry, or has
+    // already retired it.
+    bool refresh(long duration = 0) {
+      if (!ent_)
+        return false;
+
+      shard *s = tmap_.shard_of(ent_->hash_);
+      bool alive;
+      lock(s);
+      alive = (ent_->retired_ == 0);
+      if (alive)
+        ent_->expire(tmap_.now() + (duration ? duration : ent_->ttl_));
+      s->mtx_.unlock();
+      return alive;
+    }
+
+    const V *operator->() const {
+      if (ent_)
+        return &ent_->val_;
+      throw std::out_of_range("not found");
+    }
+
+    const V &operator*() const {
+      if (ent_)
+        return ent_->val_;
+      throw std::out_of_range("not found");
+    }
+  };
+
+  // ref is a reference-counted, read-only view of a value, like
+  // timedmap_getter, but it can be copied, stored in arrays, and
+  // outlive a block.  A default-constructed ref is empty.
+  class ref {
+    TMENT *ent_;
+
+    friend class sharded_timedmap;
+
+    // ENT must be already held for this ref.
+    void reset(TMENT *ent) {
+      if (ent_)
+        ent_->release();
+      ent_ = ent;
+    }
+
+  public:
+    ref() : ent_(0) {}
+
+    ref(const ref &r) : ent_(r.ent_) {
+      if (ent_)
+        ent_->hold();
+    }
+
+    ref &operator=(const ref &r) {
+      if (r.ent_)
+        r.ent_->hold();
+      reset(r.ent_);
+      return *this;
+    }
+
+    ~ref() {
+      if (ent_)
+        ent_->release();
+    }
+
+    void reset() { reset(0); }
+
+    operator bool() const {
+      return (ent_ != 0);
+    }
+
+    const V *operator->() const {
+      if (ent_)
+        return &ent_->val_;
+      throw std::out_of_range("not found");
+    }
+
+    const V &operator*() const {
+      if (ent_)
+        return ent_->val_;
+      throw std::out_of_range("not found");
+    }
+  };
+
+  // Look up KEYS[0..N) and store the results in OUT[0..N); OUT[i] is
+  // empty if KEYS[i] is not found or expired.  Returns # of hits.
+  size_t get_many(const K *keys, size_t n, ref *out) {
+    batch_key bk[BATCH_CHUNK];
+    long long ts = now();
+    size_t hits = 0;
+
+    for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+      size_t cnt = std::min(n - base, (size_t)BATCH_CHUNK);
+
+      sort_batch(bk, keys + base, cnt);
+
+      epoch_.enter();
+      for (size_t i = 0; i < cnt; ) {
+        shard *s = shards_[bk[i].shard_];
+        size_t end = i;
+        uint64_t found = 0;
+
+        for (; end < cnt && bk[end].shard_ == bk[i].shard_; end++) {
+          size_t idx = base + bk[end].idx_;
+          TMENT *ent = lookup(s, keys[idx], bk[end].hash_);
+
+          if (ent && !(ent->expire() < ts)) {
+            ent->hold();
+            found++;
+          }
+          else
+            ent = 0;
+          out[idx].reset(ent);
+        }
+        if (found)
+          __atomic_add_fetch(&s->hits_, found, __ATOMIC_RELAXED);
+        if (end - i > found)
+          __atomic_add_fetch(&s->misses_, end - i - found, __ATOMIC_RELAXED);
+        hits += found;
+        i = end;
+      }
+      epoch_.leave();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      TMENT *ent = out[i].ent_;
+      if (!ent)
+        continue;
+      ent->touch();
+      if (policy_ == EXPIRE_SLIDING && ent->expire() < ts + ent->ttl_)
+        ent->expire(ts + ent->ttl_);
+    }
+    return hits;
+  }
+
+  typedef size_t size_type;
+
+  // Note that the result may include the expired entries that are not
+  // yet reaped.
+  size_type size() const {
+    size_type sz = 0;
+    for (unsigned i = 0; i < nshards_; i++)
+      sz += __atomic_load_n(&shards_[i]->count_, __ATOMIC_RELAXED);
+    return sz;
+  }
+
+  statistics stats() const {
+    statistics st;
+
+    memset(&st, 0, sizeof(st));
+    for (unsigned i = 0; i < nshards_; i++) {
+      shard *s = shards_[i];
+      st.hits += __atomic_load_n(&s->hits_, __ATOMIC_RELAXED);
+      st.misses += __atomic_load_n(&s->misses_, __ATOMIC_RELAXED);
+      st.expirations += __atomic_load_n(&s->expirations_, __ATOMIC_RELAXED);
+      st.evictions += __atomic_load_n(&s->evictions_, __ATOMIC_RELAXED);
+      st.locks += __atomic_load_n(&s->locks_, __ATOMIC_RELAXED);
+      st.entries += __atomic_load_n(&s->count_, __ATOMIC_RELAXED);
+      st.weight += __atomic_load_n(&s->weight_, __ATOMIC_RELAXED);
+    }
+    return st;
+  }
+
+  void erase(const K &k) {
+    uint64_t h = hash_of(k);
+    shard *s = shard_of(h);
+
+    lock(s);
+    TMENT **link = find_link(s, k, h);
+    if (*link)
+      remove(s, link);
+    s->mtx_.unlock();
+  }
+
+  bool exist(const K &k) const {
+    uint64_t h = hash_of(k);
+    shard *s = shard_of(h);
+    bool ret;
+
+    epoch_.enter();
+    TMENT *ent = lookup(s, k, h);
+    ret = (ent && !(ent->expire() < now()));
+    epoch_.leave();
+
+    return ret;
+  }
+};
+
+
+template <class K, class V, class H, class S>
+void *
+sharded_timedmap<K, V, H, S>::reaper_main(void *arg)
+{
+  sharded_timedmap *tmap = (sharded_timedmap *)arg;
+  int ret, cstate, ctype;
+  xthread_set_name("reaper");
+  xdebug(0, "reaper: start");
+
+  ret = pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &ctype);
+  if (ret != 0)
+    xerror(0, ret, "pthread_setcanceltype failed");
+
+  while (1) {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cstate);
+    usleep(TICK_MS * 1000);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cstate);
+
+    long long now = tm_clock_ms();
+    __atomic_store_n(&tmap->now_, now, __ATOMIC_RELAXED);
+    unsigned long epoch = tmap->epoch_.try_advance();
+
+    // Each shard is locked only while its due slots are processed,
+    // so the other shards are never blocked by the reaper.
+    for (unsigned i = 0; i < tmap->nshards_; i++) {
+      shard *s = tmap->shards_[i];
+      s->mtx_.lock();
+      wheel_advance(s, now / TICK_MS);
+      reclaim(s, epoch);
+      s->mtx_.unlock();
+    }
+  }
+  return 0;
+}
+
+
+#define STMAP_TYPE_DECL(mtype, ktype, vtype)                            \
+  typedef sharded_timedmap<ktype, vtype> mtype;                         \
+  typedef sharded_timedmap<ktype, vtype>::timedmap_getter mtype##getter;
+
+#ifndef TMAP_GET
+#define TMAP_GET(mtype, tmap, key, gter)     \
+  for (mtype##getter gter((tmap), (key), (tmap).duration()); (gter).once(); )
+#endif
+
+#endif  // SHTIMEDMAP_HH__
@@ -1,11 +1,37 @@
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "symtable.h"
 
+#ifndef OBSTACK_STR_COPY
+#define OBSTACK_STR_COPY(s, str)        OBSTACK_COPY0((s), (str), strlen(str))
+#endif
+
+/*
+ * Open addressing (SYMTABLE_OPT_OPENADDR) parameters.
+ *
+ * The slot array is probed SYMTABLE_GROUP slots at a time; one control
+ * byte per slot holds either SYMTABLE_CTRL_EMPTY, SYMTABLE_CTRL_DELETED,
+ * or the low 7 bits of the hash of the name in the slot.  Names shorter
+ * than SYMTABLE_INLINE_KEY are copied into the slot, so that a lookup
+ * touches only the control bytes and the slot itself.
+ */
+#define SYMTABLE_GROUP          16
+#define SYMTABLE_INLINE_KEY     16
+
+#define SYMTABLE_CTRL_EMPTY     ((signed char)0x80)
+#define SYMTABLE_CTRL_DELETED   ((signed char)0xFE)
+
 struct symtable_ {
   unsigned flags;               /* options */
 
@@ -17,18 +43,59 @@ struct symtable_ {
   struct snode **table;         /* bucket table */
   size_t size_table;            /* size of TABLE */
 
+  signed char *ctrl;            /* control bytes of SLOT (open addressing) */
+  struct sslot *slot;           /* slot array (open addressing) */
+  size_t size_slot;             /* size of SLOT, power of 2 */
+  size_t used;                  /* number of slots in use */
+  size_t tomb;                  /* number of SYMTABLE_CTRL_DELETED slots */
+
+  struct symtable_atom_ **atoms; /* registry of the interned names */
+  size_t size_atoms;            /* size of ATOMS */
+  size_t natoms;                /* number of interned names */
+
+  unsigned long gen;            /* the last frame generation */
+  struct snode *stale;          /* nodes of the left frames, linked by
+                                   `flnk', not yet reclaimed */
+
   symtable_free_t free_func;    /* user-provided free function */
 
   struct obstack _pool;
   struct obstack *pool;
+
+  /* SYMTABLE_CONCURRENT only */
+  pthread_key_t key;            /* struct sthread of the calling thread */
+  pthread_mutex_t wlock;        /* serializes writers */
+  pthread_mutex_t tlock;        /* protects THREADS */
+  struct sthread *threads;      /* all threads that used the table */
+  int writer;                   /* nonzero while a writer is active */
 };
 
+/*
+ * Per-thread state of a SYMTABLE_CONCURRENT table.
+ *
+ * Readers do not share any cache line: a reader announces itself in its
+ * own READING, and a writer waits until READING of every thread becomes
+ * zero.  POOL is the scratch arena of the thread, which replaces
+ * symtable_t::pool for symtable_string_substitute().
+ */
+struct sthread {
+  int reading;                  /* nonzero while in a read section */
+  int depth;                    /* nesting level of the lock */
+  int writing;                  /* nonzero if holding the write lock */
+  symtable_t *st;
+  struct sthread *next;         /* link of symtable_t::threads */
+  struct obstack pool;          /* per-thread arena */
+} __attribute__((aligned(64)));
+
 struct sframe {
   void *base;                   /* dummy for recording the current
                                    point in the symtable_t::pool */
   const char *name;             /* name of the current frame (optional?) */
   struct snode *link;           /* list of all (key, value) pair for
                                    the current frame */
+  struct snode *tail;           /* the last node of LINK */
+  unsigned long gen;            /* generation of the frame */
+  struct sfrozen *frozen;       /* read-only copy for snapshots, or NULL */
 };
 
 struct snode {
@@ -40,12 +107,39 @@ struct snode {
   struct snode *prev;           /* previous ptr of the bucket chain */
   struct snode *next;           /* next ptr of the bucket chain */
 
+  unsigned long gen;            /* generation of FRAME when created */
+  unsigned hash;                /* hash of NAME, symtable_hash_oa() for
+                                   open addressing, symtable_hash()
+                                   otherwise */
+  struct snode *shadow;         /* the same name in the outer frame
+                                   (open addressing, or interned NAME) */
+  struct symtable_atom_ *atom;  /* atom of NAME if interned, or NULL */
+
   int valid;                    /* if zero, this (key, value) is invalid */
 
   size_t size_val;              /* size of the VAL */
 
   void *val;                    /* value of (key, value) pair.
                                  * This points the malloc-ed memory area */
+
+  char name_[1];                /* storage of NAME, unless interned */
+};
+
+struct symtable_atom_ {
+  struct symtable_atom_ *next;  /* next atom in the registry bucket */
+  struct snode *head;           /* the innermost node of NAME, or NULL */
+  unsigned hash;                /* symtable_hash_oa() of NAME */
+  unsigned chash;               /* symtable_hash() of NAME */
+  unsigned len;                 /* length of NAME */
+  char name[1];
+};
+
+struct sslot {
+  struct snode *node;           /* the innermost node of the name */
+  unsigned hash;                /* hash of the name */
+  unsigned len;                 /* length of the name */
+  char key[SYMTABLE_INLINE_KEY]; /* copy of the name, if LEN is shorter
+                                    than SYMTABLE_INLINE_KEY */
 };
 
 /*
@@ -62,7 +156,20 @@ struct snode {
  *
  * Note that this bug fix may cause symtable module little bit slower.
  * I'll deal with it later -- cinsk
+ *
+ * symtable_leave() no longer walks the frame.  Each frame has a
+ * generation number, assigned by symtable_enter(), and each node records
+ * the generation of its frame.  A node is stale when its frame is left,
+ * or re-entered with a new generation; lookups just skip stale nodes.
+ * The nodes of the left frame are moved to symtable_t::stale at once,
+ * and a few of them are unlinked and freed on every symtable_enter() and
+ * registration.  For that reason, nodes are malloc()ed rather than
+ * allocated in symtable_t::pool, which still rolls back on leave.
  */
+#define SYMTABLE_RECLAIM_STEP   2
+
+#define SYMTABLE_STALE(st, p)   ((p)->frame > (st)->depth ||            \
+                                 (st)->frame[(p)->frame].gen != (p)->gen)
 #define symtable_hash(s)        symtable_hash_from_gcc(s)
 
 static unsigned long symtable_hash_from_glib(const char *s);
@@ -70,6 +177,175 @@ static unsigned int symtable_hash_from_gcc(const char *str);
 static struct snode *symtable_lookup_node(symtable_t *st,
                                           const char *key, unsigned flags);
 
+static unsigned symtable_hash_oa(const char *s, unsigned *len);
+static int symtable_oa_init(symtable_t *st, size_t size);
+static struct snode *symtable_oa_lookup_node(symtable_t *st,
+                                             const char *key, unsigned flags);
+static int symtable_oa_insert(symtable_t *st, struct snode *p,
+                              struct symtable_atom_ *atom);
+static long symtable_oa_slot_of(symtable_t *st, struct snode *p);
+static struct symtable_atom_ *symtable_atom_find(symtable_t *st,
+                                                 const char *name,
+                                                 unsigned hash, unsigned len);
+static struct snode *symtable_shadow_find(symtable_t *st, struct snode *p,
+                                          unsigned flags);
+static void symtable_oa_unlink(symtable_t *st, struct snode *p);
+static int symtable_rdlock(symtable_t *st);
+static int symtable_wrlock(symtable_t *st);
+static void symtable_unlock(symtable_t *st);
+static void symtable_thread_exit(void *arg);
+
+#define SYMTABLE_RDLOCK(st)     (((st)->flags & SYMTABLE_CONCURRENT) ?  \
+                                 symtable_rdlock(st) : 0)
+#define SYMTABLE_WRLOCK(st)     (((st)->flags & SYMTABLE_CONCURRENT) ?  \
+                                 symtable_wrlock(st) : 0)
+#define SYMTABLE_UNLOCK(st)     do {                                    \
+    if ((st)->flags & SYMTABLE_CONCURRENT)                              \
+      symtable_unlock(st);                                              \
+  } while (0)
+static void symtable_reclaim(symtable_t *st, size_t count);
+static void symtable_frozen_release(struct sfrozen *fz);
+
+
+/*
+ * Locking of SYMTABLE_CONCURRENT tables
+ *
+ * The lock is recursive for the thread that holds it, so that the public
+ * functions may call each other.  A thread that holds the read lock
+ * cannot take the write lock; symtable_wrlock() fails with EDEADLK.
+ */
+static struct sthread *
+symtable_thread(symtable_t *st)
+{
+  struct sthread *t;
+
+  t = pthread_getspecific(st->key);
+  if (t)
+    return t;
+
+  if (posix_memalign((void **)&t, sizeof(*t), sizeof(*t)) != 0)
+    return NULL;
+  memset(t, 0, sizeof(*t));
+  if (OBSTACK_INIT(&t->pool) < 0) {
+    free(t);
+    return NULL;
+  }
+  t->st = st;
+
+  pthread_mutex_lock(&st->tlock);
+  t->next = st->threads;
+  st->threads = t;
+  pthread_mutex_unlock(&st->tlock);
+
+  pthread_setspecific(st->key, t);
+  return t;
+}
+
+
+static void
+symtable_thread_exit(void *arg)
+{
+  struct sthread *t = arg;
+  struct sthread **pp;
+  symtable_t *st = t->st;
+
+  pthread_mutex_lock(&st->tlock);
+  for (pp = &st->threads; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  pthread_mutex_unlock(&st->tlock);
+
+  OBSTACK_FREE(&t->pool, NULL);
+  free(t);
+}
+
+
+static int
+symtable_rdlock(symtable_t *st)
+{
+  struct sthread *t = symtable_thread(st);
+
+  if (!t)
+    return -1;
+  if (t->depth++ > 0)
+    return 0;
+
+  for (;;) {
+    __atomic_store_n(&t->reading, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&st->writer, __ATOMIC_SEQ_CST))
+      return 0;
+
+    /* A writer is active; wait for it without spinning */
+    __atomic_store_n(&t->reading, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&st->wlock);
+    pthread_mutex_unlock(&st->wlock);
+  }
+}
+
+
+static int
+symtable_wrlock(symtable_t *st)
+{
+  struct sthread *t = symtable_thread(st);
+  struct sthread *r;
+
+  if (!t)
+    return -1;
+  if (t->depth > 0) {
+    if (!t->writing) {
+      errno = EDEADLK;
+      return -1;
+    }
+    t->depth++;
+    return 0;
+  }
+
+  pthread_mutex_lock(&st->wlock);
+  __atomic_store_n(&st->writer, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&st->tlock);
+  for (r = st->threads; r != NULL; r = r->next)
+    while (__atomic_load_n(&r->reading, __ATOMIC_ACQUIRE))
+      sched_yield();
+  pthread_mutex_unlock(&st->tlock);
+
+  t->writing = 1;
+  t->depth = 1;
+  return 0;
+}
+
+
+static void
+symtable_unlock(symtable_t *st)
+{
+  struct sthread *t = pthread_getspecific(st->key);
+
+  if (--t->depth > 0)
+    return;
+
+  if (t->writing) {
+    t->writing = 0;
+    __atomic_store_n(&st->writer, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&st->wlock);
+  }
+  else
+    __atomic_store_n(&t->reading, 0, __ATOMIC_RELEASE);
+}
+
+
+int
+symtable_read_lock(symtable_t *st)
+{
+  return SYMTABLE_RDLOCK(st);
+}
+
+
+void
+symtable_read_unlock(symtable_t *st)
+{
+  SYMTABLE_UNLOCK(st);
+}
+
 
 symtable_t *
 symtable_new(size_t table_size, size_t max_frame, unsigned flags)
@@ -80,6 +356,8 @@ symtable_new(size_t table_size, size_t max_frame, unsigned flags)
   p = malloc(sizeof(*p));
   if (!p)
     return NULL;
+  p->ctrl = NULL;
+  p->slot = NULL;
 
   p->pool = &p->_pool;
   if (OBSTACK_INIT(p->pool) < 0) {
@@ -92,26 +370,53 @@ symtable_new(size_t table_size, size_t max_frame, unsigned flags)
   for (i = 0; i < max_frame; i++) {
     p->frame[i].base = NULL;
     p->frame[i].link = NULL;
+    p->frame[i].tail = NULL;
+    p->frame[i].gen = 0;
+    p->frame[i].frozen = NULL;
   }
   p->size_frame = max_frame;
 
-  p->table = OBSTACK_ALLOC(p->pool, sizeof(*p->table) * table_size);
-  if (!p->table)
-    goto err;
-  for (i = 0; i < table_size; i++)
-    p->table[i] = NULL;
-  p->size_table = table_size;
+  p->table = NULL;
+  p->size_table = 0;
+  p->atoms = NULL;
+  p->size_atoms = 0;
+  p->natoms = 0;
+
+  if (flags & SYMTABLE_OPT_OPENADDR) {
+    if (symtable_oa_init(p, table_size) < 0)
+      goto err;
+  }
+  else {
+    p->table = OBSTACK_ALLOC(p->pool, sizeof(*p->table) * table_size);
+    if (!p->table)
+      goto err;
+    for (i = 0; i < table_size; i++)
+      p->table[i] = NULL;
+    p->size_table = table_size;
+  }
+
+  if (flags & SYMTABLE_CONCURRENT) {
+    if (pthread_key_create(&p->key, symtable_thread_exit) != 0)
+      goto err;
+    pthread_mutex_init(&p->wlock, NULL);
+    pthread_mutex_init(&p->tlock, NULL);
+    p->threads = NULL;
+    p->writer = 0;
+  }
 
   p->flags = flags;
   p->depth = -1;
+  p->gen = 0;
+  p->stale = NULL;
+  p->free_func = NULL;
 
   symtable_enter(p, "*BASE*");
 
-  p->free_func = NULL;
-
   return p;
 
  err:
+  free(p->ctrl);
+  free(p->slot);
   OBSTACK_FREE(p->pool, 0);
   free(p);
   return NULL;
@@ -121,58 +426,106 @@ symtable_new(size_t table_size, size_t max_frame, unsigned flags)
 void
 symtable_delete(symtable_t *st)
 {
+  struct symtable_atom_ *a, *next;
+  struct sthread *t;
+  size_t i;
+
   while (symtable_leave(st) != -1)
     ;
+  symtable_reclaim(st, (size_t)-1);
+
+  if (st->flags & SYMTABLE_CONCURRENT) {
+    /* No other thread may use ST at this point. */
+    pthread_key_delete(st->key);
+    while ((t = st->threads) != NULL) {
+      st->threads = t->next;
+      OBSTACK_FREE(&t->pool, NULL);
+      free(t);
+    }
+    pthread_mutex_destroy(&st->wlock);
+    pthread_mutex_destroy(&st->tlock);
+  }
+
+  for (i = 0; i < st->size_atoms; i++) {
+    for (a = st->atoms[i]; a != NULL; a = next) {
+      next = a->next;
+      free(a);
+    }
+  }
+  free(st->atoms);
 
   OBSTACK_FREE(st->pool, NULL);
+  free(st->ctrl);
+  free(st->slot);
   free(st);
 }
 
 
-int
-symtable_register_frame(symtable_t *st, int frame,
-                        const char *name, const void *data, int len)
+/* Drop the snapshot copy of FRAME, since it is about to change. */
+static __inline__ void
+symtable_touch(symtable_t *st, int frame)
 {
-  int index;
-  struct snode *p, *q, *r;
+  if (st->frame[frame].frozen) {
+    symtable_frozen_release(st->frame[frame].frozen);
+    st->frame[frame].frozen = NULL;
+  }
+}
 
-  if (frame < 0) {
-    frame = st->depth;
-    p = symtable_lookup_node(st, name, SYMTABLE_OPT_CFRAME);
+
+static int
+symtable_set_value(struct snode *p, const void *data, int len)
+{
+  if (len < 0)
+    len = strlen(data) + 1;
+
+  if (len > 0) {
+    p->val = realloc(p->val, len);
+    if (!p->val)
+      return -1;
+    memcpy(p->val, data, len);
   }
   else
-    p = symtable_lookup_node(st, name, SYMTABLE_OPT_FRAME + frame);
-  if (p) {
-    if (len < 0)
-      len = strlen(data) + 1;
+    p->val = NULL;
+  p->size_val = len;
+  return 0;
+}
 
-    if (len > 0) {
-      p->val = realloc(p->val, len);
-      if (!p->val)
-        return -1;
-      memcpy(p->val, data, len);
-    }
-    else
-      p->val = NULL;
-    p->size_val = len;
-    return 0;
-  }
 
-  if (frame != st->depth)
-    return -1;
+/*
+ * Add new node of NAME in the current frame.  If ATOM is not NULL, it
+ * should be the atom of NAME.
+ */
+static int
+symtable_add_node(symtable_t *st, const char *name,
+                  struct symtable_atom_ *atom, const void *data, int len)
+{
+  int index;
+  int frame = st->depth;
+  struct snode *p, *q, *r;
+  unsigned hlen, hash;
 
-  index = symtable_hash(name) % st->size_table;
+  symtable_reclaim(st, SYMTABLE_RECLAIM_STEP);
 
-  p = OBSTACK_ALLOC(st->pool, sizeof(*p));
-  if (!p)
-    return -1;
-  p->valid = 0;
+  if (!atom && st->natoms > 0) {
+    hash = symtable_hash_oa(name, &hlen);
+    atom = symtable_atom_find(st, name, hash, hlen);
+  }
 
-  p->name = OBSTACK_STR_COPY(st->pool, name);
-  if (!p->name) {
-    OBSTACK_FREE(st->pool, p);
-    return -1;
+  if (atom) {
+    p = malloc(sizeof(*p));
+    if (!p)
+      return -1;
+    p->name = atom->name;       /* atoms live until symtable_delete() */
+  }
+  else {
+    hlen = strlen(name);
+    p = malloc(offsetof(struct snode, name_) + hlen + 1);
+    if (!p)
+      return -1;
+    memcpy(p->name_, name, hlen + 1);
+    p->name = p->name_;
   }
+  p->valid = 0;
 
   if (len < 0)
     len = strlen(data) + 1;
@@ -180,7 +533,7 @@ symtable_register_frame(symtable_t *st, int frame,
   if (len > 0) {
     p->val = malloc(len);
     if (!p->val) {
-      OBSTACK_FREE(st->pool, p);
+      free(p);
       return -1;
     }
     memcpy(p->val, data, len);
@@ -188,34 +541,94 @@ symtable_register_frame(symtable_t *st, int frame,
   else
     p->val = NULL;
   p->size_val = len;
-
-  p->flnk = st->frame[frame].link;
-  st->frame[frame].link = p;
   p->frame = frame;
+  p->gen = st->frame[frame].gen;
 
-  for (r = NULL, q = st->table[index]; q != NULL; q = q->next) {
-    if (frame > q->frame)
-      break;
-    r = q;
+  if (st->flags & SYMTABLE_OPT_OPENADDR) {
+    if (symtable_oa_insert(st, p, atom) < 0) {
+      free(p->val);
+      free(p);
+      return -1;
+    }
   }
+  else {
+    p->hash = atom ? atom->chash : symtable_hash(name);
+    index = p->hash % st->size_table;
 
-  p->next = q;
-  p->prev = r;
+    for (r = NULL, q = st->table[index]; q != NULL; q = q->next) {
+      if (frame > q->frame)
+        break;
+      r = q;
+    }
 
-  if (q)
-    q->prev = p;
+    p->next = q;
+    p->prev = r;
 
-  if (r)
-    r->next = p;
-  else
-    st->table[index] = p;
+    if (q)
+      q->prev = p;
+
+    if (r)
+      r->next = p;
+    else
+      st->table[index] = p;
+  }
+
+  p->atom = atom;
+  if (atom) {
+    p->shadow = atom->head;
+    atom->head = p;
+  }
+
+  if (!st->frame[frame].link)
+    st->frame[frame].tail = p;
+  p->flnk = st->frame[frame].link;
+  st->frame[frame].link = p;
 
   p->valid = 1;
+  symtable_touch(st, frame);
 
   return 0;
 }
 
 
+static int
+symtable_register_frame_unlocked(symtable_t *st, int frame,
+                                 const char *name, const void *data, int len)
+{
+  struct snode *p;
+
+  if (frame < 0) {
+    frame = st->depth;
+    p = symtable_lookup_node(st, name, SYMTABLE_OPT_CFRAME);
+  }
+  else
+    p = symtable_lookup_node(st, name, SYMTABLE_OPT_FRAME + frame);
+  if (p) {
+    symtable_touch(st, p->frame);
+    return symtable_set_value(p, data, len);
+  }
+
+  if (frame != st->depth)
+    return -1;
+
+  return symtable_add_node(st, name, NULL, data, len);
+}
+
+
+int
+symtable_register_frame(symtable_t *st, int frame,
+                        const char *name, const void *data, int len)
+{
+  int ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return -1;
+  ret = symtable_register_frame_unlocked(st, frame, name, data, len);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
 int
 symtable_register(symtable_t *st, const char *name, const void *data, int len)
 {
@@ -279,8 +692,8 @@ symtable_register(symtable_t *st, const char *name, const void *data, int len)
 #endif  /* 0 */
 
 
-int
-symtable_unregister_frame(symtable_t *st, int frame, const char *key)
+static int
+symtable_unregister_frame_unlocked(symtable_t *st, int frame, const char *key)
 {
   struct snode *p;
 
@@ -292,6 +705,8 @@ symtable_unregister_frame(symtable_t *st, int frame, const char *key)
   if (!p)
     return -1;
 
+  symtable_touch(st, p->frame);
+
   if (st->free_func)
     st->free_func(p->name, p->val, p->size_val);
 
@@ -305,6 +720,19 @@ symtable_unregister_frame(symtable_t *st, int frame, const char *key)
 }
 
 
+int
+symtable_unregister_frame(symtable_t *st, int frame, const char *key)
+{
+  int ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return -1;
+  ret = symtable_unregister_frame_unlocked(st, frame, key);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
 int
 symtable_unregister(symtable_t *st, const char *key)
 {
@@ -318,9 +746,12 @@ symtable_lookup_node(symtable_t *st, const char *key, unsigned flags)
   int index;
   struct snode *p;
 
+  if (st->flags & SYMTABLE_OPT_OPENADDR)
+    return symtable_oa_lookup_node(st, key, flags);
+
   index = symtable_hash(key) % st->size_table;
   for (p = st->table[index]; p != NULL; p = p->next) {
-    if (p->valid && strcmp(key, p->name) == 0) {
+    if (p->valid && !SYMTABLE_STALE(st, p) && strcmp(key, p->name) == 0) {
       if (flags & SYMTABLE_OPT_CFRAME) {
         if (p->frame == st->depth)
           return p;
@@ -343,8 +774,9 @@ symtable_lookup_node(symtable_t *st, const char *key, unsigned flags)
 }
 
 
-void *
-symtable_lookup(symtable_t *st, const char *key, size_t *size, unsigned flags)
+static void *
+symtable_lookup_unlocked(symtable_t *st, const char *key, size_t *size,
+                         unsigned flags)
 {
   struct snode *p;
 
@@ -359,60 +791,83 @@ symtable_lookup(symtable_t *st, const char *key, size_t *size, unsigned flags)
 }
 
 
+void *
+symtable_lookup(symtable_t *st, const char *key, size_t *size, unsigned flags)
+{
+  void *ret;
+
+  if (SYMTABLE_RDLOCK(st) < 0)
+    return NULL;
+  ret = symtable_lookup_unlocked(st, key, size, flags);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
 /* Enter new frame */
-int
-symtable_enter(symtable_t *st, const char *name)
+static int
+symtable_enter_unlocked(symtable_t *st, const char *name)
 {
-  if (st->depth > (int)st->size_frame)
+  struct sframe *f;
+
+  if (st->depth + 1 >= (int)st->size_frame)
     return -1;
 
+  symtable_reclaim(st, SYMTABLE_RECLAIM_STEP);
+
   st->depth++;
+  f = st->frame + st->depth;
 
-  st->frame[st->depth].base = OBSTACK_ALLOC(st->pool, 1);
+  f->base = OBSTACK_ALLOC(st->pool, 1);
   if (name)
-    st->frame[st->depth].name = OBSTACK_STR_COPY(st->pool, name);
+    f->name = OBSTACK_STR_COPY(st->pool, name);
   else
-    st->frame[st->depth].name = NULL;
+    f->name = NULL;
 
-  st->frame[st->depth].link = NULL;
+  f->link = NULL;
+  f->tail = NULL;
+  f->gen = ++st->gen;
 
   return st->depth;
 }
 
 
 int
-symtable_leave(symtable_t *st)
+symtable_enter(symtable_t *st, const char *name)
 {
-  struct snode *p;
-  int index = -1;
+  int ret;
 
-  if (st->depth < -1)
+  if (SYMTABLE_WRLOCK(st) < 0)
     return -1;
+  ret = symtable_enter_unlocked(st, name);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
 
-  for (p = st->frame[st->depth].link; p != NULL; p = p->flnk) {
-    index = symtable_hash(p->name) % st->size_table;
-
-    if (p->valid) {
-      if (st->free_func)
-        st->free_func(p->name, p->val, p->size_val);
-
-      p->valid = 0;
 
-      free(p->val);
-      p->val = NULL;
-      p->size_val = 0;
-    }
+/*
+ * Leaving a frame does not touch the nodes of the frame; the new
+ * generation of the next symtable_enter() makes them stale.  The frame
+ * list is moved to symtable_t::stale as a whole, and the nodes are
+ * released later by symtable_reclaim().
+ */
+static int
+symtable_leave_unlocked(symtable_t *st)
+{
+  struct sframe *f;
 
-    if (p->prev != NULL)
-      p->prev->next = p->next;
-    else
-      st->table[index] = p->next;
+  if (st->depth < 0)
+    return -1;
 
-    if (p->next != NULL)
-      p->next->prev = p->prev;
+  f = st->frame + st->depth;
+  if (f->link) {
+    f->tail->flnk = st->stale;
+    st->stale = f->link;
+    f->link = f->tail = NULL;
   }
+  symtable_touch(st, st->depth);
 
-  OBSTACK_FREE(st->pool, st->frame[st->depth].base);
+  OBSTACK_FREE(st->pool, f->base);
 
   st->depth--;
   return st->depth;
@@ -420,9 +875,64 @@ symtable_leave(symtable_t *st)
 
 
 int
-symtable_current_frame(symtable_t *table)
+symtable_leave(symtable_t *st)
 {
-  return table->depth;
+  int ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return -1;
+  ret = symtable_leave_unlocked(st);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+/*
+ * Unlink and free at most COUNT stale nodes.
+ */
+static void
+symtable_reclaim(symtable_t *st, size_t count)
+{
+  struct snode *p, **pp;
+  size_t index;
+
+  while (count-- > 0 && (p = st->stale) != NULL) {
+    st->stale = p->flnk;
+
+    if (p->valid) {
+      if (st->free_func)
+        st->free_func(p->name, p->val, p->size_val);
+      free(p->val);
+    }
+
+    if (st->flags & SYMTABLE_OPT_OPENADDR)
+      symtable_oa_unlink(st, p);
+    else {
+      index = p->hash % st->size_table;
+
+      if (p->prev != NULL)
+        p->prev->next = p->next;
+      else
+        st->table[index] = p->next;
+
+      if (p->next != NULL)
+        p->next->prev = p->prev;
+
+      if (p->atom) {
+        for (pp = &p->atom->head; *pp != p; pp = &(*pp)->shadow)
+          ;
+        *pp = p->shadow;
+      }
+    }
+    free(p);
+  }
+}
+
+
+int
+symtable_current_frame(symtable_t *table)
+{
+  return table->depth;
 }
 
 
@@ -433,17 +943,43 @@ symtable_get_frame_name(symtable_t *table, int frame_id)
 }
 
 
+static void *
+symtable_alloc_unlocked(symtable_t *table, size_t size)
+{
+  return OBSTACK_ALLOC(table->pool, size);
+}
+
+
 void *
 symtable_alloc(symtable_t *table, size_t size)
 {
-  return OBSTACK_ALLOC(table->pool, size);
+  void *ret;
+
+  if (SYMTABLE_WRLOCK(table) < 0)
+    return NULL;
+  ret = symtable_alloc_unlocked(table, size);
+  SYMTABLE_UNLOCK(table);
+  return ret;
+}
+
+
+static char *
+symtable_strdup_unlocked(symtable_t *table, const char *s)
+{
+  return OBSTACK_STR_COPY(table->pool, s);
 }
 
 
 char *
 symtable_strdup(symtable_t *table, const char *s)
 {
-  return OBSTACK_STR_COPY(table->pool, s);
+  char *ret;
+
+  if (SYMTABLE_WRLOCK(table) < 0)
+    return NULL;
+  ret = symtable_strdup_unlocked(table, s);
+  SYMTABLE_UNLOCK(table);
+  return ret;
 }
 
 
@@ -452,13 +988,13 @@ symtable_strdup(symtable_t *table, const char *s)
  * "name" in the symbol table.
  *
  * Note that this function is poorly designed: S should point the
- * growing object in st->pool, which seems useless, since we can
+ * growing object in POOL, which seems useless, since we can
  * generate it anywhere by calling OBSTACK_BASE(st->pool).
  *
  * On success, this function returns zero.  Otherwise returns -1.
  */
 static int
-symtable_var_substitute(symtable_t *st)
+symtable_var_substitute(symtable_t *st, struct obstack *pool)
 {
   /*
    * All the operations rely on `s', which is returned by
@@ -472,10 +1008,10 @@ symtable_var_substitute(symtable_t *st)
   char *name, *val;
   int var_found = 0;
 
-  s = OBSTACK_BASE(st->pool);
-  len = strlen(s);
+  s = OBSTACK_BASE(pool);
 
  again:
+  len = strlen(s);
   for (i = len - 1; i >= 0; i--) {
     if (s[i] == '$') {
       if (i > 0 && s[i - 1] == '\\')
@@ -496,14 +1032,14 @@ symtable_var_substitute(symtable_t *st)
         val = symtable_lookup(st, name, NULL, 0);
 
         if (!val)
-          strcpy(s + i, s + j + 1);
+          memmove(s + i, s + j + 1, strlen(s + j + 1) + 1);
         else {
           size_t val_len = strlen(val);
           size_t remained = strlen(s + j + 1);
-          if (OBSTACK_BLANK(st->pool, val_len) < 0)
+          if (OBSTACK_BLANK(pool, val_len) < 0)
             return -1;
           /* `s' changed to new location. */
-          s = OBSTACK_BASE(st->pool);
+          s = OBSTACK_BASE(pool);
           memmove(s + i + val_len, s + j + 1, remained + 1);
           memcpy(s + i, val, val_len);
         }
@@ -575,9 +1111,9 @@ symtable_var_substitute(symtable_t *st)
 }
 #endif  /* 0 */
 
-int
-symtable_register_substitute_frame(symtable_t *st, int frame,
-                                   const char *name, const char *data)
+static int
+symtable_register_substitute_frame_unlocked(symtable_t *st, int frame,
+                                            const char *name, const char *data)
 {
   struct snode *snptr;
   int size;
@@ -601,7 +1137,8 @@ symtable_register_substitute_frame(symtable_t *st, int frame,
 
   size = strlen(data) + 1;
   OBSTACK_GROW(st->pool, data, size);
-  if (symtable_var_substitute(st) < 0) {
+  if (symtable_var_substitute(st, st->pool) < 0) {
+    OBSTACK_FREE(st->pool, OBSTACK_FINISH(st->pool));
     return -1;
   }
 
@@ -621,6 +1158,20 @@ symtable_register_substitute_frame(symtable_t *st, int frame,
 }
 
 
+int
+symtable_register_substitute_frame(symtable_t *st, int frame,
+                                   const char *name, const char *data)
+{
+  int ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return -1;
+  ret = symtable_register_substitute_frame_unlocked(st, frame, name, data);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
 int
 symtable_register_substitute(symtable_t *st,
                              const char *name, const char *data)
@@ -629,27 +1180,286 @@ symtable_register_substitute(symtable_t *st,
 }
 
 
-char *
-symtable_string_substitute(symtable_t *st, const char *data)
+static char *
+symtable_string_substitute_unlocked(symtable_t *st, const char *data)
 {
+  struct obstack *pool = st->pool;
+  struct sthread *t;
   char *p, *q;
   int size;
 
-  assert(OBSTACK_OBJECT_SIZE(st->pool) == 0);
+  if (st->flags & SYMTABLE_CONCURRENT) {
+    /* readers may run at the same time; use the arena of this thread */
+    t = pthread_getspecific(st->key);
+    if (!t->writing)
+      pool = &t->pool;
+  }
+
+  assert(OBSTACK_OBJECT_SIZE(pool) == 0);
 
   size = strlen(data) + 1;
-  OBSTACK_GROW(st->pool, data, size);
-  if (symtable_var_substitute(st) < 0) {
+  OBSTACK_GROW(pool, data, size);
+  if (symtable_var_substitute(st, pool) < 0) {
+    OBSTACK_FREE(pool, OBSTACK_FINISH(pool));
     return NULL;
   }
-  q = OBSTACK_FINISH(st->pool);
+  q = OBSTACK_FINISH(pool);
   p = strdup(q);
 
-  OBSTACK_FREE(st->pool, q);
+  OBSTACK_FREE(pool, q);
   return p;
 }
 
 
+char *
+symtable_string_substitute(symtable_t *st, const char *data)
+{
+  char *ret;
+
+  if (SYMTABLE_RDLOCK(st) < 0)
+    return NULL;
+  ret = symtable_string_substitute_unlocked(st, data);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+/*
+ * Compiled templates
+ *
+ * A template is compiled into a list of literal spans, each followed by
+ * an atom of the variable, so that symtable_template_expand() does no
+ * parsing, no hashing, and computes the result size before it allocates.
+ *
+ * The interpreter, symtable_var_substitute(), parses the string from the
+ * right, and repeats the whole pass while it finds a variable, so that
+ * a value may contain another "${name}".  The compiler follows the same
+ * right-to-left parse; a template whose parse would depend on substituted
+ * text (e.g. "${a${b}}") is kept as is and expanded by the interpreter.
+ * After the expansion, if a value introduced a new "${", the result is
+ * passed to the interpreter for the remaining passes.
+ */
+#define SYMTABLE_TMPL_CACHE     32
+
+struct symtable_tmpl_ref {
+  size_t off;                   /* offset of the literal span in TEXT */
+  size_t len;                   /* length of the literal span */
+  symtable_atom_t atom;         /* the variable after the literal span,
+                                   or NULL for the last span */
+};
+
+struct symtable_template_ {
+  symtable_t *st;               /* the table that owns the atoms */
+  int interp;                   /* if nonzero, use the interpreter */
+  int nrefs;                    /* number of REF */
+  struct symtable_tmpl_ref *ref;
+
+  char text[1];                 /* copy of the template string */
+};
+
+
+static symtable_template_t *
+symtable_template_compile_unlocked(symtable_t *st, const char *data)
+{
+  symtable_template_t *t;
+  size_t len = strlen(data);
+  size_t end = len;             /* start of the text parsed so far */
+  size_t nmax = 1;
+  size_t i, j, size;
+  const char *ptr;
+  int n;
+
+  for (ptr = data; (ptr = strchr(ptr, '$')) != NULL; ptr++)
+    nmax++;
+
+  size = offsetof(symtable_template_t, text) + len + 1;
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  t = malloc(size + nmax * sizeof(*t->ref));
+  if (!t)
+    return NULL;
+  memcpy(t->text, data, len + 1);
+  t->ref = (struct symtable_tmpl_ref *)((char *)t + size);
+  t->st = st;
+  t->interp = 0;
+
+  /* REF is filled from the end, as the parse goes from right to left. */
+  n = nmax - 1;
+  t->ref[n].atom = NULL;
+
+  for (i = len; i-- > 0;) {
+    if (data[i] != '$' || (i > 0 && data[i - 1] == '\\'))
+      continue;
+    if (i + 1 == end && end < len) {
+      /* The interpreter would see the substituted text after '$' */
+      t->interp = 1;
+      return t;
+    }
+    if (data[i + 1] != '{')
+      continue;
+
+    ptr = strchr(data + i + 1, '}');
+    if (!ptr) {
+      /* error: closing '}' is not found */
+      free(t);
+      return NULL;
+    }
+    j = ptr - data;
+    if (j >= end) {
+      /* The name would include the substituted text */
+      t->interp = 1;
+      return t;
+    }
+
+    t->ref[n].off = j + 1;
+    t->ref[n].len = end - (j + 1);
+    n--;
+
+    t->text[j] = '\0';
+    t->ref[n].atom = symtable_intern(st, t->text + i + 2);
+    t->text[j] = '}';
+    if (!t->ref[n].atom) {
+      free(t);
+      return NULL;
+    }
+    end = i;
+  }
+  t->ref[n].off = 0;
+  t->ref[n].len = end;
+
+  /* Move REF to the front */
+  t->nrefs = nmax - n;
+  memmove(t->ref, t->ref + n, sizeof(*t->ref) * t->nrefs);
+
+  return t;
+}
+
+
+symtable_template_t *
+symtable_template_compile(symtable_t *st, const char *data)
+{
+  symtable_template_t *ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return NULL;
+  ret = symtable_template_compile_unlocked(st, data);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+void
+symtable_template_free(symtable_template_t *tmpl)
+{
+  free(tmpl);
+}
+
+
+/* Returns nonzero if S has "${" that the interpreter will substitute. */
+static int
+symtable_has_var(const char *s)
+{
+  const char *p;
+
+  for (p = s; (p = strstr(p, "${")) != NULL; p++)
+    if (p == s || *(p - 1) != '\\')
+      return 1;
+  return 0;
+}
+
+
+static char *
+symtable_template_expand_unlocked(symtable_t *st, symtable_template_t *tmpl)
+{
+  struct symtable_tmpl_ref *r;
+  size_t size = 0, vsize, n;
+  const char *v;
+  char *out, *q, *p;
+  char prev = '\0';
+  int recheck = 0;
+  int i;
+  /* values of the first references; the rest are looked up twice */
+  const char *val[SYMTABLE_TMPL_CACHE];
+  size_t vlen[SYMTABLE_TMPL_CACHE];
+
+  assert(tmpl->st == st);
+
+  if (tmpl->interp)
+    return symtable_string_substitute(st, tmpl->text);
+
+  /* First pass: resolve the variables and compute the size */
+  for (i = 0; i < tmpl->nrefs; i++) {
+    r = tmpl->ref + i;
+    if (r->len > 0) {
+      if (prev == '$' && tmpl->text[r->off] == '{')
+        recheck = 1;
+      prev = tmpl->text[r->off + r->len - 1];
+      size += r->len;
+    }
+    if (!r->atom)
+      continue;
+
+    v = symtable_lookup_atom(st, r->atom, &vsize, 0);
+    n = v ? strnlen(v, vsize) : 0;
+    if (i < SYMTABLE_TMPL_CACHE) {
+      val[i] = v;
+      vlen[i] = n;
+    }
+    if (n > 0) {
+      if ((prev == '$' && v[0] == '{') || memchr(v, '$', n))
+        recheck = 1;
+      prev = v[n - 1];
+      size += n;
+    }
+  }
+
+  out = malloc(size + 1);
+  if (!out)
+    return NULL;
+
+  for (q = out, i = 0; i < tmpl->nrefs; i++) {
+    r = tmpl->ref + i;
+    memcpy(q, tmpl->text + r->off, r->len);
+    q += r->len;
+    if (!r->atom)
+      continue;
+
+    if (i < SYMTABLE_TMPL_CACHE) {
+      v = val[i];
+      n = vlen[i];
+    }
+    else {
+      v = symtable_lookup_atom(st, r->atom, &vsize, 0);
+      n = v ? strnlen(v, vsize) : 0;
+    }
+    if (n > 0) {
+      memcpy(q, v, n);
+      q += n;
+    }
+  }
+  *q = '\0';
+
+  if (recheck && symtable_has_var(out)) {
+    p = symtable_string_substitute(st, out);
+    free(out);
+    return p;
+  }
+  return out;
+}
+
+
+char *
+symtable_template_expand(symtable_t *st, symtable_template_t *tmpl)
+{
+  char *ret;
+
+  if (SYMTABLE_RDLOCK(st) < 0)
+    return NULL;
+  ret = symtable_template_expand_unlocked(st, tmpl);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
 char *
 symtable_esc_substitute(symtable_t *st, const char *key)
 {
@@ -722,9 +1532,8 @@ symtable_hash_from_gcc(const char *str)
   unsigned long r = 0;
   const unsigned char *s = (const unsigned char *) str;
 
-  do
+  while (n--)
     r = r * 67 + (*s++ - 113);
-  while (--n);
 
   return r + len;
 }
@@ -747,9 +1556,745 @@ symtable_hash_from_glib(const char *s)
 }
 
 
+/*
+ * Open addressing backend (SYMTABLE_OPT_OPENADDR).
+ *
+ * Each name has exactly one slot, which points to the node of the
+ * innermost frame.  Nodes of the same name in the outer frames are
+ * reachable through `shadow' link, in descending frame order, the same
+ * order that the chained backend keeps in a bucket.
+ */
+static unsigned
+symtable_hash_oa(const char *s, unsigned *len)
+{
+  /* FNV-1a with the finalizer of MurmurHash3 */
+  const unsigned char *p = (const unsigned char *)s;
+  unsigned h = 2166136261U;
+
+  while (*p) {
+    h ^= *p++;
+    h *= 16777619U;
+  }
+  *len = p - (const unsigned char *)s;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+
+#define SYMTABLE_H2(hash)       ((signed char)((hash) & 0x7F))
+
+
+/* Returns the bitmask of control bytes in the group CTRL that equal to C. */
+static __inline__ unsigned
+symtable_group_match(const signed char *ctrl, signed char c)
+{
+#ifdef __SSE2__
+  __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+  unsigned m = 0;
+  int i;
+
+  for (i = 0; i < SYMTABLE_GROUP; i++)
+    if (ctrl[i] == c)
+      m |= 1U << i;
+  return m;
+#endif
+}
+
+
+/* Returns the bitmask of empty or deleted slots in the group CTRL. */
+static __inline__ unsigned
+symtable_group_free(const signed char *ctrl)
+{
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+  unsigned m = 0;
+  int i;
+
+  for (i = 0; i < SYMTABLE_GROUP; i++)
+    if (ctrl[i] < 0)
+      m |= 1U << i;
+  return m;
+#endif
+}
+
+
+static int
+symtable_oa_alloc(symtable_t *st, size_t size)
+{
+  size_t n = SYMTABLE_GROUP;
+  signed char *ctrl;
+  struct sslot *slot;
+
+  while (n < size)
+    n <<= 1;
+
+  /* ST is left untouched on error */
+  ctrl = malloc(n);
+  slot = malloc(sizeof(*slot) * n);
+  if (!ctrl || !slot) {
+    free(ctrl);
+    free(slot);
+    return -1;
+  }
+  memset(ctrl, SYMTABLE_CTRL_EMPTY, n);
+  st->ctrl = ctrl;
+  st->slot = slot;
+  st->size_slot = n;
+  st->used = 0;
+  st->tomb = 0;
+  return 0;
+}
+
+
+static int
+symtable_oa_init(symtable_t *st, size_t size)
+{
+  /* TABLE_SIZE is the expected number of names; keep the load under 7/8 */
+  return symtable_oa_alloc(st, size + size / 7 + 1);
+}
+
+
+/*
+ * Returns the index of the slot of KEY, or -1 if not found.
+ */
+static __inline__ long
+symtable_oa_find(symtable_t *st, const char *key, unsigned hash, unsigned len)
+{
+  size_t mask = st->size_slot / SYMTABLE_GROUP - 1;
+  size_t g = (hash >> 7) & mask;
+  size_t step = 0;
+  const signed char *ctrl;
+  struct sslot *s;
+  unsigned m;
+
+  for (;;) {
+    ctrl = st->ctrl + g * SYMTABLE_GROUP;
+
+    for (m = symtable_group_match(ctrl, SYMTABLE_H2(hash)); m; m &= m - 1) {
+      s = st->slot + g * SYMTABLE_GROUP + __builtin_ctz(m);
+      if (s->hash == hash && s->len == len &&
+          (len < SYMTABLE_INLINE_KEY ?
+           memcmp(s->key, key, len) == 0 :
+           strcmp(s->node->name, key) == 0))
+        return s - st->slot;
+    }
+    if (symtable_group_match(ctrl, SYMTABLE_CTRL_EMPTY))
+      return -1;
+
+    /* triangular probing visits every group since # of groups is 2^n */
+    g = (g + ++step) & mask;
+  }
+}
+
+
+/*
+ * Returns the index of the first free slot in the probe sequence of HASH.
+ */
+static size_t
+symtable_oa_free_slot(symtable_t *st, unsigned hash)
+{
+  size_t mask = st->size_slot / SYMTABLE_GROUP - 1;
+  size_t g = (hash >> 7) & mask;
+  size_t step = 0;
+  unsigned m;
+
+  while ((m = symtable_group_free(st->ctrl + g * SYMTABLE_GROUP)) == 0)
+    g = (g + ++step) & mask;
+
+  return g * SYMTABLE_GROUP + __builtin_ctz(m);
+}
+
+
+static int
+symtable_oa_rehash(symtable_t *st, size_t size)
+{
+  signed char *octrl = st->ctrl;
+  struct sslot *oslot = st->slot;
+  size_t osize = st->size_slot;
+  size_t used = st->used;
+  size_t i, j;
+
+  if (symtable_oa_alloc(st, size) < 0) {
+    st->ctrl = octrl;
+    st->slot = oslot;
+    return -1;
+  }
+
+  for (i = 0; i < osize; i++) {
+    if (octrl[i] < 0)
+      continue;
+    j = symtable_oa_free_slot(st, oslot[i].hash);
+    st->ctrl[j] = octrl[i];
+    st->slot[j] = oslot[i];
+  }
+  st->used = used;
+
+  free(octrl);
+  free(oslot);
+  return 0;
+}
+
+
+static int
+symtable_oa_insert(symtable_t *st, struct snode *p,
+                   struct symtable_atom_ *atom)
+{
+  unsigned len;
+  long i;
+  struct sslot *s;
+
+  if (atom) {
+    /* No need to compare the name; the slot, if any, holds ATOM->HEAD */
+    p->hash = atom->hash;
+    len = atom->len;
+    i = atom->head ? symtable_oa_slot_of(st, atom->head) : -1;
+  }
+  else {
+    p->hash = symtable_hash_oa(p->name, &len);
+    i = symtable_oa_find(st, p->name, p->hash, len);
+  }
+  if (i >= 0) {
+    p->shadow = st->slot[i].node;
+    st->slot[i].node = p;
+    return 0;
+  }
+
+  if ((st->used + st->tomb + 1) * 8 > st->size_slot * 7) {
+    /* grow if live slots occupy more than half, otherwise just
+     * sweep the tombstones */
+    if (symtable_oa_rehash(st, (st->used + 1) * 2 > st->size_slot ?
+                           st->size_slot * 2 : st->size_slot) < 0)
+      return -1;
+  }
+
+  i = symtable_oa_free_slot(st, p->hash);
+  if (st->ctrl[i] == SYMTABLE_CTRL_DELETED)
+    st->tomb--;
+  st->ctrl[i] = SYMTABLE_H2(p->hash);
+  st->used++;
+
+  s = st->slot + i;
+  s->node = p;
+  s->hash = p->hash;
+  s->len = len;
+  if (len < SYMTABLE_INLINE_KEY)
+    memcpy(s->key, p->name, len);
+
+  p->shadow = NULL;
+  return 0;
+}
+
+
+/*
+ * Returns the index of the slot that points P.  P must be the innermost
+ * node of its name.
+ */
+static long
+symtable_oa_slot_of(symtable_t *st, struct snode *p)
+{
+  size_t mask = st->size_slot / SYMTABLE_GROUP - 1;
+  size_t g = (p->hash >> 7) & mask;
+  size_t step = 0;
+  const signed char *ctrl;
+  unsigned m;
+  size_t i;
+
+  for (;;) {
+    ctrl = st->ctrl + g * SYMTABLE_GROUP;
+    for (m = symtable_group_match(ctrl, SYMTABLE_H2(p->hash)); m; m &= m - 1) {
+      i = g * SYMTABLE_GROUP + __builtin_ctz(m);
+      if (st->slot[i].node == p)
+        return i;
+    }
+    assert(symtable_group_match(ctrl, SYMTABLE_CTRL_EMPTY) == 0);
+    g = (g + ++step) & mask;
+  }
+}
+
+
+/*
+ * Remove P from the shadow chain of its name, and the slot of the name
+ * if P was the last one.
+ */
+static void
+symtable_oa_unlink(symtable_t *st, struct snode *p)
+{
+  struct snode **pp;
+  signed char *ctrl;
+  long i;
+
+  i = symtable_oa_find(st, p->name, p->hash, strlen(p->name));
+  assert(i >= 0);
+
+  for (pp = &st->slot[i].node; *pp != p; pp = &(*pp)->shadow)
+    ;
+  *pp = p->shadow;
+  if (p->atom)
+    p->atom->head = st->slot[i].node;
+  if (st->slot[i].node)
+    return;
+
+  /* If the group has an empty slot, no probe sequence has ever
+   * passed this group, so the slot can be emptied directly. */
+  ctrl = st->ctrl + (i & ~(long)(SYMTABLE_GROUP - 1));
+  if (symtable_group_match(ctrl, SYMTABLE_CTRL_EMPTY))
+    st->ctrl[i] = SYMTABLE_CTRL_EMPTY;
+  else {
+    st->ctrl[i] = SYMTABLE_CTRL_DELETED;
+    st->tomb++;
+  }
+  st->used--;
+}
+
+
+/*
+ * Returns the first valid node that matches FLAGS in the shadow chain P.
+ */
+static struct snode *
+symtable_shadow_find(symtable_t *st, struct snode *p, unsigned flags)
+{
+  for (; p != NULL; p = p->shadow) {
+    if (!p->valid || SYMTABLE_STALE(st, p))
+      continue;
+    if (flags & SYMTABLE_OPT_CFRAME)
+      return (p->frame == st->depth) ? p : NULL;
+    if (flags & SYMTABLE_OPT_FRAME) {
+      if (p->frame == (flags & SYMTABLE_OPT_FRAME_MASK))
+        return p;
+      continue;
+    }
+    return p;
+  }
+  return NULL;
+}
+
+
+static struct snode *
+symtable_oa_lookup_node(symtable_t *st, const char *key, unsigned flags)
+{
+  unsigned hash, len;
+  long i;
+
+  hash = symtable_hash_oa(key, &len);
+  i = symtable_oa_find(st, key, hash, len);
+  if (i < 0)
+    return NULL;
+
+  return symtable_shadow_find(st, st->slot[i].node, flags);
+}
+
+
+/*
+ * Interned names (atoms).
+ *
+ * An atom keeps the innermost node of its name in HEAD, and all nodes
+ * of the name are linked through `shadow', regardless of the backend.
+ * Hence symtable_lookup_atom() never hashes or compares the name.
+ */
+static struct symtable_atom_ *
+symtable_atom_find(symtable_t *st, const char *name,
+                   unsigned hash, unsigned len)
+{
+  struct symtable_atom_ *a;
+
+  if (st->size_atoms == 0)
+    return NULL;
+
+  for (a = st->atoms[hash & (st->size_atoms - 1)]; a != NULL; a = a->next)
+    if (a->hash == hash && a->len == len && memcmp(a->name, name, len) == 0)
+      return a;
+  return NULL;
+}
+
+
+static int
+symtable_atom_grow(symtable_t *st)
+{
+  struct symtable_atom_ **atoms, *a, *next;
+  size_t size = st->size_atoms ? st->size_atoms * 2 : 64;
+  size_t i;
+
+  atoms = calloc(size, sizeof(*atoms));
+  if (!atoms)
+    return -1;
+
+  for (i = 0; i < st->size_atoms; i++) {
+    for (a = st->atoms[i]; a != NULL; a = next) {
+      next = a->next;
+      a->next = atoms[a->hash & (size - 1)];
+      atoms[a->hash & (size - 1)] = a;
+    }
+  }
+  free(st->atoms);
+  st->atoms = atoms;
+  st->size_atoms = size;
+  return 0;
+}
+
+
+/* Link the nodes of A->NAME, registered before A was interned, to A. */
+static void
+symtable_atom_adopt(symtable_t *st, struct symtable_atom_ *a)
+{
+  struct snode *p, **pp;
+  long i;
+
+  if (st->flags & SYMTABLE_OPT_OPENADDR) {
+    i = symtable_oa_find(st, a->name, a->hash, a->len);
+    if (i < 0)
+      return;
+    a->head = st->slot[i].node;
+    for (p = a->head; p != NULL; p = p->shadow)
+      p->atom = a;
+    return;
+  }
+
+  /*
+   * The bucket is sorted in descending frame order, but the older node
+   * comes first in the same frame.  The shadow chain needs the newer
+   * node first, so that symtable_leave() can pop it.
+   */
+  for (p = st->table[a->chash % st->size_table]; p != NULL; p = p->next) {
+    if (strcmp(p->name, a->name) != 0)
+      continue;
+    for (pp = &a->head; *pp && (*pp)->frame > p->frame; pp = &(*pp)->shadow)
+      ;
+    p->shadow = *pp;
+    *pp = p;
+    p->atom = a;
+  }
+}
+
+
+static symtable_atom_t
+symtable_intern_unlocked(symtable_t *st, const char *name)
+{
+  struct symtable_atom_ *a;
+  unsigned hash, len;
+  size_t index;
+
+  hash = symtable_hash_oa(name, &len);
+  a = symtable_atom_find(st, name, hash, len);
+  if (a)
+    return a;
+
+  if (st->natoms >= st->size_atoms && symtable_atom_grow(st) < 0)
+    return NULL;
+
+  a = malloc(offsetof(struct symtable_atom_, name) + len + 1);
+  if (!a)
+    return NULL;
+  memcpy(a->name, name, len + 1);
+  a->hash = hash;
+  a->chash = symtable_hash(name);
+  a->len = len;
+  a->head = NULL;
+
+  symtable_atom_adopt(st, a);
+
+  index = hash & (st->size_atoms - 1);
+  a->next = st->atoms[index];
+  st->atoms[index] = a;
+  st->natoms++;
+
+  return a;
+}
+
+
+symtable_atom_t
+symtable_intern(symtable_t *st, const char *name)
+{
+  symtable_atom_t ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return NULL;
+  ret = symtable_intern_unlocked(st, name);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+const char *
+symtable_atom_name(symtable_atom_t atom)
+{
+  return atom->name;
+}
+
+
+static void *
+symtable_lookup_atom_unlocked(symtable_t *st, symtable_atom_t atom,
+                              size_t *size, unsigned flags)
+{
+  struct snode *p;
+
+  p = symtable_shadow_find(st, atom->head, flags);
+  if (!p)
+    return NULL;
+
+  if (size)
+    *size = p->size_val;
+
+  return p->val;
+}
+
+
+void *
+symtable_lookup_atom(symtable_t *st, symtable_atom_t atom,
+                     size_t *size, unsigned flags)
+{
+  void *ret;
+
+  if (SYMTABLE_RDLOCK(st) < 0)
+    return NULL;
+  ret = symtable_lookup_atom_unlocked(st, atom, size, flags);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+static int
+symtable_register_atom_unlocked(symtable_t *st, symtable_atom_t atom,
+                                const void *data, int len)
+{
+  struct snode *p;
+
+  p = symtable_shadow_find(st, atom->head, SYMTABLE_OPT_CFRAME);
+  if (p) {
+    symtable_touch(st, p->frame);
+    return symtable_set_value(p, data, len);
+  }
+
+  return symtable_add_node(st, atom->name, atom, data, len);
+}
+
+
 int
-symtable_enumerate(symtable_t *sp, int frame,
-                   symtable_enum_t proc, void *data)
+symtable_register_atom(symtable_t *st, symtable_atom_t atom,
+                       const void *data, int len)
+{
+  int ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return -1;
+  ret = symtable_register_atom_unlocked(st, atom, data, len);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+/*
+ * Snapshots
+ *
+ * A snapshot refers to a read-only copy (struct sfrozen) of each frame.
+ * The copy of a frame is made by the first symtable_snapshot() after
+ * the frame changed, and is shared by the following snapshots until the
+ * frame changes again (see symtable_touch()).  Thus, a snapshot costs
+ * only the frames modified since the previous snapshot.  The copies own
+ * their names and values, so the table may change in any way while
+ * other threads look up a snapshot.
+ */
+struct sfentry {
+  const char *name;             /* NULL if the entry is empty */
+  const void *val;
+  size_t size_val;
+  unsigned hash;                /* symtable_hash_oa() of NAME */
+};
+
+struct sfrozen {
+  int refs;                     /* reference count */
+  size_t mask;                  /* size of ENT - 1 */
+  struct sfentry ent[1];        /* linear probing, followed by the names
+                                   and the values */
+};
+
+struct symtable_snapshot_ {
+  int depth;                    /* depth of the table when taken */
+  struct sfrozen *frame[1];     /* [depth + 1] */
+};
+
+#define SYMTABLE_ALIGN(x)       (((x) + 15) & ~(size_t)15)
+
+
+static struct sfrozen *
+symtable_frozen_new(symtable_t *st, int frame)
+{
+  struct sfrozen *fz;
+  struct sfentry *e;
+  struct snode *p;
+  size_t count = 0, blob = 0, size, nent = 2, i;
+  unsigned hash, len;
+  char *q;
+
+  for (p = st->frame[frame].link; p != NULL; p = p->flnk) {
+    if (!p->valid)
+      continue;
+    count++;
+    blob += SYMTABLE_ALIGN(p->size_val) + strlen(p->name) + 1;
+  }
+  while (nent < count * 2)
+    nent <<= 1;
+
+  size = SYMTABLE_ALIGN(offsetof(struct sfrozen, ent) + sizeof(*e) * nent);
+  fz = malloc(size + blob);
+  if (!fz)
+    return NULL;
+  fz->refs = 1;
+  fz->mask = nent - 1;
+  for (i = 0; i < nent; i++)
+    fz->ent[i].name = NULL;
+
+  /* values first, to keep them aligned */
+  q = (char *)fz + size;
+  for (p = st->frame[frame].link; p != NULL; p = p->flnk) {
+    if (!p->valid)
+      continue;
+
+    hash = symtable_hash_oa(p->name, &len);
+    for (i = hash & fz->mask; fz->ent[i].name != NULL; i = (i + 1) & fz->mask)
+      ;
+    e = fz->ent + i;
+    e->hash = hash;
+    e->size_val = p->size_val;
+    if (p->val) {
+      memcpy(q, p->val, p->size_val);
+      e->val = q;
+      q += SYMTABLE_ALIGN(p->size_val);
+    }
+    else
+      e->val = NULL;
+    e->name = p->name;          /* temporary; replaced below */
+  }
+  for (i = 0; i < nent; i++) {
+    e = fz->ent + i;
+    if (e->name) {
+      len = strlen(e->name) + 1;
+      e->name = memcpy(q, e->name, len);
+      q += len;
+    }
+  }
+  return fz;
+}
+
+
+static void
+symtable_frozen_release(struct sfrozen *fz)
+{
+  if (__atomic_sub_fetch(&fz->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(fz);
+}
+
+
+static const struct sfentry *
+symtable_frozen_find(const struct sfrozen *fz, const char *key, unsigned hash)
+{
+  const struct sfentry *e;
+  size_t i;
+
+  for (i = hash & fz->mask; (e = fz->ent + i)->name != NULL;
+       i = (i + 1) & fz->mask)
+    if (e->hash == hash && strcmp(e->name, key) == 0)
+      return e;
+  return NULL;
+}
+
+
+static symtable_snapshot_t *
+symtable_snapshot_unlocked(symtable_t *st)
+{
+  symtable_snapshot_t *snap;
+  struct sfrozen *fz;
+  int i;
+
+  snap = malloc(offsetof(symtable_snapshot_t, frame) +
+                sizeof(snap->frame[0]) * (st->depth + 1));
+  if (!snap)
+    return NULL;
+
+  for (i = 0; i <= st->depth; i++) {
+    fz = st->frame[i].frozen;
+    if (!fz) {
+      fz = symtable_frozen_new(st, i);
+      if (!fz) {
+        snap->depth = i - 1;
+        symtable_snapshot_release(snap);
+        return NULL;
+      }
+      st->frame[i].frozen = fz;
+    }
+    __atomic_add_fetch(&fz->refs, 1, __ATOMIC_RELAXED);
+    snap->frame[i] = fz;
+  }
+  snap->depth = st->depth;
+
+  return snap;
+}
+
+
+symtable_snapshot_t *
+symtable_snapshot(symtable_t *st)
+{
+  symtable_snapshot_t *ret;
+
+  if (SYMTABLE_WRLOCK(st) < 0)
+    return NULL;
+  ret = symtable_snapshot_unlocked(st);
+  SYMTABLE_UNLOCK(st);
+  return ret;
+}
+
+
+void *
+symtable_snapshot_lookup(symtable_snapshot_t *snap, const char *key,
+                         size_t *size, unsigned flags)
+{
+  const struct sfentry *e;
+  unsigned hash, len;
+  int lo = 0, hi = snap->depth;
+
+  if (flags & SYMTABLE_OPT_CFRAME)
+    lo = hi;
+  else if (flags & SYMTABLE_OPT_FRAME) {
+    lo = hi = flags & SYMTABLE_OPT_FRAME_MASK;
+    if (hi > snap->depth)
+      return NULL;
+  }
+
+  hash = symtable_hash_oa(key, &len);
+  for (; hi >= lo; hi--) {
+    e = symtable_frozen_find(snap->frame[hi], key, hash);
+    if (e) {
+      if (size)
+        *size = e->size_val;
+      return (void *)e->val;
+    }
+  }
+  return NULL;
+}
+
+
+void
+symtable_snapshot_release(symtable_snapshot_t *snap)
+{
+  int i;
+
+  for (i = 0; i <= snap->depth; i++)
+    symtable_frozen_release(snap->frame[i]);
+  free(snap);
+}
+
+
+static int
+symtable_enumerate_unlocked(symtable_t *sp, int frame,
+                            symtable_enum_t proc, void *data)
 {
   int i, ret;
   struct snode *node;
@@ -767,6 +2312,20 @@ symtable_enumerate(symtable_t *sp, int frame,
 }
 
 
+int
+symtable_enumerate(symtable_t *sp, int frame,
+                   symtable_enum_t proc, void *data)
+{
+  int ret;
+
+  if (SYMTABLE_RDLOCK(sp) < 0)
+    return -1;
+  ret = symtable_enumerate_unlocked(sp, frame, proc, data);
+  SYMTABLE_UNLOCK(sp);
+  return ret;
+}
+
+
 #if 0
 int
 symtable_enumerate(symtable_t *sp, symtable_enum_t proc, void *data)
@@ -789,6 +2348,9 @@ symtable_enumerate(symtable_t *sp, symtable_enum_t proc, void *data)
 #endif  /* 0 */
 
 
+#define SYMTABLE_MARK(st, node)  (SYMTABLE_STALE(st, node) ? 'S' :    \
+                                  (node)->valid ? 'V' : 'D')
+
 void
 symtable_dump(symtable_t *p)
 {
@@ -804,19 +2366,34 @@ symtable_dump(symtable_t *p)
     printf("    %2d: base(%p), link(%p) name(%s)\n", i,
            p->frame[i].base, p->frame[i].link, p->frame[i].name);
 
+  if (p->flags & SYMTABLE_OPT_OPENADDR) {
+    printf("  slot: size(%zu) used(%zu) deleted(%zu)\n",
+           p->size_slot, p->used, p->tomb);
+    for (i = 0; i < p->size_slot; i++) {
+      if (p->ctrl[i] < 0)
+        continue;
+      printf("    %2d: ", i);
+      for (node = p->slot[i].node; node != NULL; node = node->shadow)
+        printf("%s[%d:%c:%s]", (node == p->slot[i].node) ? "" : "->",
+               node->frame, SYMTABLE_MARK(p, node), node->name);
+      putchar('\n');
+    }
+    return;
+  }
+
   printf("  table: size(%u)\n", p->size_table);
   for (i = 0; i < p->size_table; i++) {
     printf("    %2d: ", i);
     node = p->table[i];
     if (node) {
-      printf("[%d:%c:%s]", node->frame, node->valid? 'V' : 'D', node->name);
+      printf("[%d:%c:%s]", node->frame, SYMTABLE_MARK(p, node), node->name);
       node = node->next;
     }
     else
       printf("NIL");
 
     for (; node != NULL; node = node->next) {
-      printf("->[%d:%c:%s]", node->frame, node->valid? 'V' : 'D', node->name);
+      printf("->[%d:%c:%s]", node->frame, SYMTABLE_MARK(p, node), node->name);
     }
     putchar('\n');
   }
@@ -855,7 +2432,9 @@ void my_free(const char *name, void *data, size_t len)
 symtable_t *
 table_init(void)
 {
-  symtable_t *p = symtable_new(32, 4, 0);
+  symtable_t *p = symtable_new(32, 4,
+                               getenv("SYMTABLE_OPENADDR") ?
+                               SYMTABLE_OPT_OPENADDR : 0);
   return p;
 }
 
@@ -27,6 +27,15 @@
 #define SYMTABLE_OPT_FRAME_MASK 0x00FF
 #define SYMTABLE_OPT_FRAME      0x0100
 
+/* Flag for symtable_new(): use an open-addressing table with inline
+ * short keys instead of the bucket chains.  TABLE_SIZE becomes the
+ * expected number of names; the table grows as needed. */
+#define SYMTABLE_OPT_OPENADDR   0x10000
+
+/* Flag for symtable_new(): allow calls from multiple threads.  See
+ * symtable_read_lock(). */
+#define SYMTABLE_CONCURRENT     0x20000
+
 typedef void (*symtable_free_t)(const char *name, void *data, size_t len);
 
 struct symtable_;
@@ -37,7 +46,7 @@ typedef struct symtable_ symtable_t;
  *
  * Where TABLE_SIZE is the number of entries in the bucket table,
  * and MAX_DEPTH is the number of frames that this symbol table will support,
- * and FLAGS is options.
+ * and FLAGS is options (SYMTABLE_OPT_OPENADDR, SYMTABLE_CONCURRENT).
  */
 extern symtable_t *symtable_new(size_t table_size,
                                 size_t max_depth, unsigned flags);
@@ -115,10 +124,36 @@ extern void *symtable_lookup(symtable_t *st, const char *key, size_t *size,
  */
 extern int symtable_enter(symtable_t *st, const char *name);
 
+/*
+ * Interned names (atoms)
+ *
+ * symtable_intern() returns the atom of NAME, which is valid until
+ * symtable_delete().  Interning the same NAME again returns the same
+ * atom.  On error, it returns NULL.
+ *
+ * symtable_lookup_atom() and symtable_register_atom() are the same as
+ * symtable_lookup() and symtable_register() except that they take an
+ * atom instead of the name; they neither hash nor compare the name.
+ */
+struct symtable_atom_;
+typedef struct symtable_atom_ *symtable_atom_t;
+
+extern symtable_atom_t symtable_intern(symtable_t *st, const char *name);
+extern const char *symtable_atom_name(symtable_atom_t atom);
+
+extern void *symtable_lookup_atom(symtable_t *st, symtable_atom_t atom,
+                                  size_t *size, unsigned flags);
+extern int symtable_register_atom(symtable_t *st, symtable_atom_t atom,
+                                  const void *data, int len);
+
 /*
  * Leave the current frame.
  *
  * symtable_leave() removes all (key, value) pairs of the current frame.
+ * It takes constant time; the pairs are no longer visible, but their
+ * memory is released (and the user-registered free function is called)
+ * a few at a time by the following symtable_enter() and registrations,
+ * or by symtable_delete().
  *
  * symtable_leave() returns the new frame depth after leaving.  If
  * there's no frame to leave, symtable_leave() returns -1,
@@ -134,6 +169,27 @@ char *symtable_strdup(symtable_t *table, const char *s);
 
 extern char *symtable_string_substitute(symtable_t *st, const char *data);
 
+/*
+ * Compiled substitution templates
+ *
+ * symtable_template_compile() parses DATA once, in the same syntax as
+ * symtable_string_substitute(), and resolves the variable names into
+ * atoms of ST.  It returns NULL if DATA has no closing '}' or on memory
+ * shortage.  Release the template with symtable_template_free(); it
+ * cannot be expanded after symtable_delete(ST).
+ *
+ * symtable_template_expand() returns the same malloc()ed string that
+ * symtable_string_substitute() would return for DATA, or NULL on error.
+ */
+struct symtable_template_;
+typedef struct symtable_template_ symtable_template_t;
+
+extern symtable_template_t *symtable_template_compile(symtable_t *st,
+                                                      const char *data);
+extern char *symtable_template_expand(symtable_t *st,
+                                      symtable_template_t *tmpl);
+extern void symtable_template_free(symtable_template_t *tmpl);
+
 extern int symtable_current_frame(symtable_t *table);
 extern const char *symtable_get_frame_name(symtable_t *table, int frame_id);
 
@@ -145,6 +201,53 @@ typedef int (*symtable_enum_t)(const char *name,
 extern int symtable_enumerate(symtable_t *sp, int frame,
                               symtable_enum_t proc, void *data);
 
+/*
+ * Read-only snapshots
+ *
+ * symtable_snapshot() returns a snapshot of all frames of ST, or NULL on
+ * memory shortage.  Only the frames changed since the last snapshot are
+ * copied; the others are shared.
+ *
+ * A snapshot does not refer to ST.  It can be looked up by any number
+ * of threads at the same time, while the owner of ST keeps modifying
+ * (or even deletes) ST.  symtable_snapshot_lookup() works like
+ * symtable_lookup() on the table as it was when the snapshot was taken.
+ *
+ * Release a snapshot with symtable_snapshot_release(), from any thread.
+ */
+struct symtable_snapshot_;
+typedef struct symtable_snapshot_ symtable_snapshot_t;
+
+extern symtable_snapshot_t *symtable_snapshot(symtable_t *st);
+extern void *symtable_snapshot_lookup(symtable_snapshot_t *snap,
+                                      const char *key, size_t *size,
+                                      unsigned flags);
+extern void symtable_snapshot_release(symtable_snapshot_t *snap);
+
 extern void symtable_dump(symtable_t *p);
 
+/*
+ * Concurrent tables
+ *
+ * A table created with SYMTABLE_CONCURRENT may be used from any number
+ * of threads.  Lookups (symtable_lookup(), symtable_lookup_atom(),
+ * symtable_string_substitute(), symtable_template_expand(), and
+ * symtable_enumerate()) run in parallel; every other function excludes
+ * them while it runs.  Readers do not write any shared memory, so the
+ * lookups scale with the number of threads, as long as writers are
+ * rare.  Each thread uses its own obstack for symtable_string_substitute().
+ *
+ * Since a writer may change or release a value at any time, the pointer
+ * returned by symtable_lookup() or symtable_lookup_atom() is valid only
+ * inside of symtable_read_lock() and symtable_read_unlock().  The read
+ * lock may nest, but the thread that holds it cannot modify the table.
+ *
+ * obsutil.c and the callers must be compiled with -D_PTHREAD, so that the
+ * obstack error state is kept per thread.
+ *
+ * For the other tables, these two functions do nothing.
+ */
+extern int symtable_read_lock(symtable_t *st);
+extern void symtable_read_unlock(symtable_t *st);
+
 #endif  /* SYMTABLE_H__ */
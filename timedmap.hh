@@ -170,7 +170,7 @@ public:
     impl_iter_type i = map_.find(k);
 
     if (i == map_.end()) {
-      map_[k] = TMENT(v, duration_);
+      map_[k] = TMENT(v, duration ? duration : duration_);
 
       mtx_->unlock();
     }
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * See twheel.h for the license.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "twheel.h"
+
+#define TWHEEL_MASK     (TWHEEL_SLOTS - 1)
+#define TWHEEL_WORDS    (TWHEEL_SLOTS / 64)
+
+/* Span of one slot, and of the whole level, in ticks */
+#define LEVEL_SHIFT(level)      ((level) * TWHEEL_BITS)
+#define LEVEL_SPAN(level)       ((uint64_t)1 << (((level) + 1) * TWHEEL_BITS))
+
+struct twheel {
+  /*
+   * Every timer that expires before 'cur' has been collected; the
+   * next twheel_advance() starts at the tick 'cur'.
+   */
+  uint64_t cur;
+  long count;
+  uint64_t used[TWHEEL_LEVELS][TWHEEL_WORDS];   /* non-empty slots */
+  struct twheel_timer *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+};
+
+
+uint64_t
+twheel_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+twheel_t *
+twheel_new(uint64_t now)
+{
+  twheel_t *w;
+
+  w = calloc(1, sizeof(*w));
+  if (!w)
+    return NULL;
+  w->cur = now;
+  return w;
+}
+
+
+void
+twheel_delete(twheel_t *w)
+{
+  free(w);
+}
+
+
+void
+twheel_timer_init(struct twheel_timer *timer, twheel_func_t func, void *arg)
+{
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->func = func;
+  timer->arg = arg;
+}
+
+
+static __inline__ void
+slot_set(twheel_t *w, int level, int slot)
+{
+  w->used[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+
+static __inline__ void
+slot_clear(twheel_t *w, int level, int slot)
+{
+  w->used[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+
+/*
+ * Return the first used slot of LEVEL at or after FROM, wrapping
+ * around, as a distance from FROM; or -1 if the level is empty.
+ */
+static int
+slot_next(const twheel_t *w, int level, int from)
+{
+  const uint64_t *bits = w->used[level];
+  int i, word, slot;
+  uint64_t m;
+
+  for (i = 0; i <= TWHEEL_WORDS; i++) {
+    word = (from / 64 + i) % TWHEEL_WORDS;
+    m = bits[word];
+    if (i == 0)
+      m &= ~(uint64_t)0 << (from % 64);         /* at or after FROM */
+    else if (i == TWHEEL_WORDS)
+      m &= ((uint64_t)1 << (from % 64)) - 1;    /* wrapped; before FROM */
+    if (m) {
+      slot = word * 64 + __builtin_ctzll(m);
+      return (slot - from + TWHEEL_SLOTS) & TWHEEL_MASK;
+    }
+  }
+  return -1;
+}
+
+
+/* Link TIMER into the slot for its expiry, relative to 'cur'. */
+static void
+twheel_link(twheel_t *w, struct twheel_timer *timer)
+{
+  uint64_t expires = timer->expires, delta;
+  struct twheel_timer **head;
+  int level, slot;
+
+  if (expires < w->cur)
+    expires = w->cur;
+  delta = expires - w->cur;
+
+  for (level = 0; level < TWHEEL_LEVELS - 1; level++)
+    if (delta < LEVEL_SPAN(level))
+      break;
+  if (delta >= LEVEL_SPAN(level))
+    /* too far; park it in the last slot, and place it again later */
+    expires = w->cur + LEVEL_SPAN(level) - 1;
+
+  slot = (expires >> LEVEL_SHIFT(level)) & TWHEEL_MASK;
+  head = &w->slots[level][slot];
+
+  timer->next = *head;
+  if (*head)
+    (*head)->pprev = &timer->next;
+  *head = timer;
+  timer->pprev = head;
+  slot_set(w, level, slot);
+}
+
+
+static void
+twheel_unlink(twheel_t *w, struct twheel_timer *timer)
+{
+  struct twheel_timer **pprev = timer->pprev;
+  int level, slot;
+
+  *pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+
+  if (!*pprev && (char *)pprev >= (char *)w->slots &&
+      (char *)pprev < (char *)(w->slots + TWHEEL_LEVELS)) {
+    /* it was the last timer of the slot */
+    slot = (struct twheel_timer **)pprev - &w->slots[0][0];
+    level = slot / TWHEEL_SLOTS;
+    slot_clear(w, level, slot % TWHEEL_SLOTS);
+  }
+}
+
+
+void
+twheel_schedule(twheel_t *w, struct twheel_timer *timer, uint64_t expires)
+{
+  if (timer->pprev)
+    twheel_unlink(w, timer);
+  else
+    w->count++;
+  timer->expires = expires;
+  twheel_link(w, timer);
+}
+
+
+int
+twheel_cancel(twheel_t *w, struct twheel_timer *timer)
+{
+  if (!timer->pprev)
+    return -1;
+  twheel_unlink(w, timer);
+  w->count--;
+  return 0;
+}
+
+
+/* Place the timers of a higher-level slot again, relative to 'cur'. */
+static void
+twheel_cascade(twheel_t *w, int level, int slot)
+{
+  struct twheel_timer *timer, *next;
+
+  timer = w->slots[level][slot];
+  w->slots[level][slot] = NULL;
+  slot_clear(w, level, slot);
+
+  for (; timer; timer = next) {
+    next = timer->next;
+    twheel_link(w, timer);
+  }
+}
+
+
+/*
+ * Return the first tick at or after T that has work: a used slot of
+ * level 0, or the start of a used slot of a higher level, which then
+ * cascades.  Returns UINT64_MAX if the wheel is empty.  T must not be
+ * before 'cur'.
+ */
+static uint64_t
+twheel_next(const twheel_t *w, uint64_t t)
+{
+  uint64_t when = UINT64_MAX, base, start;
+  int level, dist;
+
+  dist = slot_next(w, 0, t & TWHEEL_MASK);
+  if (dist >= 0)
+    when = t + dist;
+
+  for (level = 1; level < TWHEEL_LEVELS; level++) {
+    base = t >> LEVEL_SHIFT(level);
+    /* the slot of T cascades at T only if T is its very start */
+    if (t & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1))
+      base++;
+    dist = slot_next(w, level, base & TWHEEL_MASK);
+    if (dist < 0)
+      continue;
+    start = (base + dist) << LEVEL_SHIFT(level);
+    if (start < when)
+      when = start;
+  }
+  return when;
+}
+
+
+int
+twheel_advance(twheel_t *w, uint64_t now)
+{
+  struct twheel_timer *expired = NULL, *timer, **tail = &expired;
+  int level, slot, count = 0;
+
+  w->cur = twheel_next(w, w->cur);
+  while (w->cur <= now) {
+    slot = w->cur & TWHEEL_MASK;
+    if (slot == 0)
+      for (level = TWHEEL_LEVELS - 1; level > 0; level--)
+        if ((w->cur & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1)) == 0)
+          twheel_cascade(w, level,
+                         (w->cur >> LEVEL_SHIFT(level)) & TWHEEL_MASK);
+
+    /* every timer of this slot expires at 'cur' */
+    if (w->slots[0][slot]) {
+      *tail = w->slots[0][slot];
+      w->slots[0][slot]->pprev = tail;
+      w->slots[0][slot] = NULL;
+      slot_clear(w, 0, slot);
+      while (*tail)
+        tail = &(*tail)->next;
+    }
+
+    /* skip the ticks with nothing to do */
+    w->cur = twheel_next(w, w->cur + 1);
+  }
+  if (w->cur > now + 1)
+    w->cur = now + 1;
+
+  /* The callbacks may touch any timer, so detach each one first. */
+  while ((timer = expired) != NULL) {
+    expired = timer->next;
+    if (expired)
+      expired->pprev = &expired;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    w->count--;
+    count++;
+    if (timer->func)
+      timer->func(timer, timer->arg);
+  }
+  return count;
+}
+
+
+long
+twheel_timeout(twheel_t *w, uint64_t now)
+{
+  uint64_t when;
+
+  if (w->count == 0)
+    return -1;
+  when = twheel_next(w, w->cur);
+  if (when <= now)
+    return 0;
+  return (long)(when - now);
+}
+
+
+long
+twheel_count(twheel_t *w)
+{
+  return w->count;
+}
@@ -0,0 +1,155 @@
+#ifndef TWHEEL_H__
+#define TWHEEL_H__
+
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ *
+ * Copyright (C) 2014 Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * Everyone is permitted to copy and distribute verbatim or modified
+ * copies of this license document, and changing it is allowed as long
+ * as the name is changed.
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ * This program is free software. It comes without any warranty, to the
+ * extent permitted by applicable law. You can redistribute it and/or
+ * modify it under the terms of the Do What The Fuck You Want To Public
+ * License, Version 2, as published by Sam Hocevar. See
+ * http://www.wtfpl.net/ for more details.
+ */
+
+#include <stdint.h>
+
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * twheel -- hierarchical timer wheel with millisecond ticks.
+ *
+ * The wheel has TWHEEL_LEVELS levels of TWHEEL_SLOTS slots.  A slot of
+ * level 0 holds the timers of one millisecond, a slot of level 1 those
+ * of 256 ms, and so on, up to about 49 days at level 3.  Timers
+ * further out wait in the last level and are placed again when it
+ * comes around.  When the clock enters a slot of a higher level, its
+ * timers cascade to the lower levels, so every timer moves at most
+ * TWHEEL_LEVELS times in its life.
+ *
+ * twheel_schedule() and twheel_cancel() are O(1): a timer is linked
+ * into a slot, and knows where it is linked.  twheel_advance() moves
+ * the clock, skipping empty stretches with a bitmap of the slots in
+ * use.  It collects all the expired timers first, then runs their
+ * callbacks in one batch.  A callback may schedule or cancel any
+ * timer, including its own.
+ *
+ * The timers are intrusive, and the wheel never allocates them:
+ *
+ *   struct conn { struct twheel_timer idle; ... };
+ *
+ *   twheel_t *w = twheel_new(twheel_clock());
+ *   twheel_timer_init(&c->idle, on_idle, c);
+ *   twheel_schedule(w, &c->idle, twheel_clock() + 30000);
+ *   ...
+ *   twheel_advance(w, twheel_clock());    -- calls on_idle() when due
+ *
+ * Times are absolute milliseconds in any clock that does not go back;
+ * twheel_clock() reads CLOCK_MONOTONIC.  A twheel_t is not thread-safe.
+ */
+
+#define TWHEEL_BITS     8
+#define TWHEEL_SLOTS    (1 << TWHEEL_BITS)
+#define TWHEEL_LEVELS   4
+
+struct twheel_timer;
+typedef void (*twheel_func_t)(struct twheel_timer *timer, void *arg);
+
+struct twheel_timer {
+  struct twheel_timer *next;
+  struct twheel_timer **pprev;  /* NULL if not scheduled */
+  uint64_t expires;             /* in milliseconds */
+  twheel_func_t func;
+  void *arg;
+};
+
+struct twheel;
+typedef struct twheel twheel_t;
+
+/*
+ * Create a timer wheel whose clock starts at NOW.
+ * Returns NULL on error.
+ */
+extern twheel_t *twheel_new(uint64_t now);
+
+/*
+ * Delete W.  The scheduled timers are forgotten, not called.
+ */
+extern void twheel_delete(twheel_t *w);
+
+/*
+ * Return CLOCK_MONOTONIC in milliseconds.
+ */
+extern uint64_t twheel_clock(void);
+
+/*
+ * Initialize TIMER to call FUNC(TIMER, ARG) when it expires.
+ */
+extern void twheel_timer_init(struct twheel_timer *timer,
+                              twheel_func_t func, void *arg);
+
+/*
+ * Schedule TIMER to expire at EXPIRES, or to reschedule it if it was
+ * already scheduled.  A time that has already passed expires on the
+ * next twheel_advance().
+ */
+extern void twheel_schedule(twheel_t *w, struct twheel_timer *timer,
+                            uint64_t expires);
+
+/*
+ * Cancel TIMER.  Returns zero if it was scheduled, -1 otherwise.
+ */
+extern int twheel_cancel(twheel_t *w, struct twheel_timer *timer);
+
+static __inline__ int
+twheel_pending(const struct twheel_timer *timer)
+{
+  return timer->pprev != 0;
+}
+
+/*
+ * Move the clock of W to NOW, and call every timer that expired up to
+ * NOW, in no particular order within the same millisecond.
+ * Returns the number of timers called.
+ */
+extern int twheel_advance(twheel_t *w, uint64_t now);
+
+/*
+ * Return the number of milliseconds from NOW until twheel_advance()
+ * has work to do, zero if it is already due, or -1 if no timer is
+ * scheduled.  For timers beyond the first level, it returns when they
+ * cascade, which may be before they expire; the result is meant as a
+ * poll(2) timeout.
+ */
+extern long twheel_timeout(twheel_t *w, uint64_t now);
+
+/*
+ * Return the number of scheduled timers.
+ */
+extern long twheel_count(twheel_t *w);
+
+END_C_DECLS
+
+#endif  /* TWHEEL_H__ */